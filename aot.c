@@ -0,0 +1,1071 @@
+/*
+ *	aot compiles the functions of modules to C, for linking into a program
+ *	as native functions (see lispNative):
+ *
+ *		./aot stdlib.scm matrix.scm > modules.c
+ *
+ *	A top-level (let (name args...) body...) is compiled if its body only
+ *	uses its arguments and variables, nested functions that don't capture
+ *	any, constants, if, set! of its variables, ((lambda ...) ...), the
+ *	builtins in the table below and the other compiled functions, which it
+ *	calls directly. A function defined more than once or set! anywhere is
+ *	left alone. Everything else, the functions that take or make closures
+ *	say, stays in the source that the program evaluates after lispAotInit
+ *	has defined the natives. See main.c for how it is linked in.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include "basiclisp.h"
+
+typedef struct Buf Buf;
+typedef struct Func Func;
+typedef struct Name Name;
+typedef struct Form Form;
+typedef struct Aot Aot;
+
+struct Buf {
+	char *p;
+	size_t len;
+	size_t cap;
+};
+
+// a function being compiled, or one nested in one and lifted to the top.
+struct Func {
+	LispRef name;
+	LispRef params;
+	LispRef body;
+	int nparams;
+	int ok;
+};
+
+// a variable in slot v<idx>, or the nested function funcs[idx]. depth is the
+// function the variable belongs to.
+enum {
+	AOT_VAR,
+	AOT_FUNC,
+};
+
+struct Name {
+	LispRef sym;
+	int kind;
+	int depth;
+	int idx;
+};
+
+// a top-level form and where its text ends in its file.
+struct Form {
+	LispRef expr;
+	int file;
+	size_t end;
+	int func;
+};
+
+struct Aot {
+	LispMachine m;
+
+	Form *forms;
+	size_t nforms;
+
+	// the top-level functions come first, nfuncs is reset to ntop before
+	// each pass over them.
+	Func *funcs;
+	size_t nfuncs;
+	size_t ntop;
+	size_t capfuncs;
+
+	Name *names;
+	size_t nnames;
+	size_t capnames;
+
+	// quoted symbols, syms[i] in the output.
+	LispRef *syms;
+	size_t nsyms;
+	size_t capsyms;
+
+	// the function being compiled.
+	int fn;
+	int depth;
+	int nvars;
+	int ntemps;
+	int maxtemps;
+	int indent;
+	int top; // the function jumps to its start for a tail call
+	Buf *out;
+
+	Buf code; // the compiled functions
+	Buf print; // port 1 prints here
+
+	LispRef ifSym;
+	LispRef lambdaSym;
+	LispRef letSym;
+	LispRef setSym;
+	LispRef quoteSym;
+};
+
+// the builtins compiled code applies, and the constants it uses.
+enum {
+	AOT_APPLY,
+	AOT_CONST,
+};
+
+#define AOT_BUILTIN(name, blt, kind) { name, blt, #blt, kind }
+static struct {
+	char *name;
+	int blt;
+	char *id;
+	int kind;
+} builtins[] = {
+	AOT_BUILTIN("car", LISP_BUILTIN_CAR, AOT_APPLY),
+	AOT_BUILTIN("cdr", LISP_BUILTIN_CDR, AOT_APPLY),
+	AOT_BUILTIN("cons", LISP_BUILTIN_CONS, AOT_APPLY),
+	AOT_BUILTIN("set-car!", LISP_BUILTIN_SETCAR, AOT_APPLY),
+	AOT_BUILTIN("set-cdr!", LISP_BUILTIN_SETCDR, AOT_APPLY),
+	AOT_BUILTIN("compare", LISP_BUILTIN_COMPARE, AOT_APPLY),
+	AOT_BUILTIN("+", LISP_BUILTIN_ADD, AOT_APPLY),
+	AOT_BUILTIN("-", LISP_BUILTIN_SUB, AOT_APPLY),
+	AOT_BUILTIN("*", LISP_BUILTIN_MUL, AOT_APPLY),
+	AOT_BUILTIN("/", LISP_BUILTIN_DIV, AOT_APPLY),
+	AOT_BUILTIN("pair?", LISP_BUILTIN_ISPAIR, AOT_APPLY),
+	AOT_BUILTIN("equal?", LISP_BUILTIN_ISEQUAL, AOT_APPLY),
+	AOT_BUILTIN("less?", LISP_BUILTIN_ISLESS, AOT_APPLY),
+	AOT_BUILTIN("error?", LISP_BUILTIN_ISERROR, AOT_APPLY),
+	AOT_BUILTIN("make-vector", LISP_BUILTIN_MAKEVECTOR, AOT_APPLY),
+	AOT_BUILTIN("vector-ref", LISP_BUILTIN_VECTORREF, AOT_APPLY),
+	AOT_BUILTIN("vector-set!", LISP_BUILTIN_VECTORSET, AOT_APPLY),
+	AOT_BUILTIN("vector-length", LISP_BUILTIN_VECTORLENGTH, AOT_APPLY),
+	AOT_BUILTIN("string-length", LISP_BUILTIN_STRINGLENGTH, AOT_APPLY),
+	AOT_BUILTIN("string-ref", LISP_BUILTIN_STRINGREF, AOT_APPLY),
+	AOT_BUILTIN("#true", LISP_BUILTIN_TRUE, AOT_CONST),
+	AOT_BUILTIN("#false", LISP_BUILTIN_FALSE, AOT_CONST),
+	AOT_BUILTIN("#nil", LISP_BUILTIN_NIL, AOT_CONST),
+	AOT_BUILTIN("#above", LISP_BUILTIN_ABOVE, AOT_CONST),
+	AOT_BUILTIN("#equal", LISP_BUILTIN_EQUAL, AOT_CONST),
+	AOT_BUILTIN("#below", LISP_BUILTIN_BELOW, AOT_CONST),
+	AOT_BUILTIN("#error", LISP_BUILTIN_ERROR, AOT_CONST),
+};
+static LispRef builtinSyms[sizeof builtins / sizeof builtins[0]];
+
+// what the compiled functions start with. they call the builtins through
+// these, which do what lispInlineBuiltin does for the VM.
+static char prologue[] =
+	"#include <stddef.h>\n"
+	"#include <stdint.h>\n"
+	"#include \"basiclisp.h\"\n"
+	"\n"
+	"static LispRef\n"
+	"aotApply(LispMachine *m, int blt, LispRef args)\n"
+	"{\n"
+	"\treturn lispApply(m, lispCons(m, lispBuiltin(m, blt), args));\n"
+	"}\n"
+	"\n"
+	"static LispRef\n"
+	"aotCall1(LispMachine *m, int blt, LispRef a)\n"
+	"{\n"
+	"\tswitch(blt){\n"
+	"\tcase LISP_BUILTIN_CAR:\n"
+	"\t\tif(lispIsCons(m, a))\n"
+	"\t\t\treturn lispCar(m, a);\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_CDR:\n"
+	"\t\tif(lispIsCons(m, a))\n"
+	"\t\t\treturn lispCdr(m, a);\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_VECTORLENGTH:\n"
+	"\t\tif(lispIsVector(m, a))\n"
+	"\t\t\treturn lispNumber(m, lispVectorLength(m, a));\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_ISPAIR:\n"
+	"\t\treturn lispBuiltin(m, lispIsCons(m, a) ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);\n"
+	"\t}\n"
+	"\treturn aotApply(m, blt, lispCons(m, a, LISP_NIL));\n"
+	"}\n"
+	"\n"
+	"static LispRef\n"
+	"aotCall2(LispMachine *m, int blt, LispRef a, LispRef b)\n"
+	"{\n"
+	"\tint num = lispIsNumber(m, a) && lispIsNumber(m, b);\n"
+	"\tlong long x = num ? lispGetInt(m, a) : 0, y = num ? lispGetInt(m, b) : 0, r = LISP_FIXNUM_MAX + 1LL;\n"
+	"\t// floats, or integers with floats, in doubles.\n"
+	"\tif(!num && (lispIsFloat(m, a) || lispIsFloat(m, b)) && (lispIsNumber(m, a) || lispIsFloat(m, a)) && (lispIsNumber(m, b) || lispIsFloat(m, b))){\n"
+	"\t\tdouble f = lispGetFloat(m, a), g = lispGetFloat(m, b);\n"
+	"\t\tswitch(blt){\n"
+	"\t\tcase LISP_BUILTIN_ADD:\n"
+	"\t\t\treturn lispFloat(m, f + g);\n"
+	"\t\tcase LISP_BUILTIN_SUB:\n"
+	"\t\t\treturn lispFloat(m, f - g);\n"
+	"\t\tcase LISP_BUILTIN_MUL:\n"
+	"\t\t\treturn lispFloat(m, f * g);\n"
+	"\t\tcase LISP_BUILTIN_DIV:\n"
+	"\t\t\treturn lispFloat(m, f / g);\n"
+	"\t\tcase LISP_BUILTIN_ISLESS:\n"
+	"\t\t\treturn lispBuiltin(m, f < g ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);\n"
+	"\t\t}\n"
+	"\t}\n"
+	"\tswitch(blt){\n"
+	"\tcase LISP_BUILTIN_CONS:\n"
+	"\t\treturn lispCons(m, a, b);\n"
+	"\tcase LISP_BUILTIN_VECTORREF:\n"
+	"\t\tif(lispIsVector(m, a) && lispIsNumber(m, b) && (size_t)lispGetInt(m, b) < lispVectorLength(m, a))\n"
+	"\t\t\treturn lispVectorRef(m, a, lispGetInt(m, b));\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_ADD:\n"
+	"\t\tif(__builtin_add_overflow(x, y, &r))\n"
+	"\t\t\tr = LISP_FIXNUM_MAX + 1LL;\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_SUB:\n"
+	"\t\tif(__builtin_sub_overflow(x, y, &r))\n"
+	"\t\t\tr = LISP_FIXNUM_MAX + 1LL;\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_MUL:\n"
+	"\t\tif(__builtin_mul_overflow(x, y, &r))\n"
+	"\t\t\tr = LISP_FIXNUM_MAX + 1LL;\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_ISLESS:\n"
+	"\t\tif(num)\n"
+	"\t\t\treturn lispBuiltin(m, x < y ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);\n"
+	"\t\tbreak;\n"
+	"\tcase LISP_BUILTIN_ISEQUAL:\n"
+	"\t\t// numbers by value, lists by identity.\n"
+	"\t\tif(num)\n"
+	"\t\t\treturn lispBuiltin(m, x == y ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);\n"
+	"\t\tif((lispIsPair(m, a) || lispIsNull(m, a)) && (lispIsPair(m, b) || lispIsNull(m, b)) && !lispIsString(m, a) && !lispIsString(m, b) && !lispIsBignum(m, a) && !lispIsBignum(m, b))\n"
+	"\t\t\treturn lispBuiltin(m, a == b ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);\n"
+	"\t\tbreak;\n"
+	"\t}\n"
+	"\t// results that aren't fixnums are for lispApply.\n"
+	"\tif(num && r >= LISP_FIXNUM_MIN && r <= LISP_FIXNUM_MAX)\n"
+	"\t\treturn lispNumber(m, r);\n"
+	"\tLispRef *ra = lispRegister(m, a);\n"
+	"\tLispRef args = lispCons(m, b, LISP_NIL);\n"
+	"\targs = lispCons(m, *ra, args);\n"
+	"\tlispRelease(m, ra);\n"
+	"\treturn aotApply(m, blt, args);\n"
+	"}\n"
+	"\n"
+	"// the n arguments of a native function.\n"
+	"static int\n"
+	"aotArgs(LispMachine *m, LispRef args, LispRef *a, int n)\n"
+	"{\n"
+	"\tfor(int i = 0; i < n; i++){\n"
+	"\t\tif(!lispIsPair(m, args))\n"
+	"\t\t\treturn -1;\n"
+	"\t\ta[i] = lispCar(m, args);\n"
+	"\t\targs = lispCdr(m, args);\n"
+	"\t}\n"
+	"\treturn lispIsNull(m, args) ? 0 : -1;\n"
+	"}\n";
+
+static void
+bufGrow(Buf *b, size_t n)
+{
+	if(b->len + n + 1 <= b->cap)
+		return;
+	size_t cap = b->cap == 0 ? 256 : b->cap;
+	while(cap < b->len + n + 1)
+		cap *= 2;
+	char *p = realloc(b->p, cap);
+	if(p == NULL){
+		fprintf(stderr, "aot: out of memory\n");
+		exit(1);
+	}
+	b->p = p;
+	b->cap = cap;
+}
+
+static void
+bufWrite(Buf *b, char *p, size_t n)
+{
+	bufGrow(b, n);
+	memcpy(b->p + b->len, p, n);
+	b->len += n;
+	b->p[b->len] = '\0';
+}
+
+static void
+bufPrintf(Buf *b, char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	bufGrow(b, n);
+	va_start(ap, fmt);
+	vsnprintf(b->p + b->len, n + 1, fmt, ap);
+	va_end(ap);
+	b->len += n;
+}
+
+static void *
+grow(void *p, size_t *cap, size_t len, size_t size)
+{
+	if(len < *cap)
+		return p;
+	*cap = *cap == 0 ? 16 : 2 * *cap;
+	p = realloc(p, *cap * size);
+	if(p == NULL){
+		fprintf(stderr, "aot: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+// a statement of the function being compiled.
+static void
+emit(Aot *a, char *fmt, ...)
+{
+	for(int i = 0; i < a->indent; i++)
+		bufWrite(a->out, "\t", 1);
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	bufGrow(a->out, n);
+	va_start(ap, fmt);
+	vsnprintf(a->out->p + a->out->len, n + 1, fmt, ap);
+	va_end(ap);
+	a->out->len += n;
+}
+
+static int
+printByte(int ch, void *ctx)
+{
+	char c = ch;
+	bufWrite((Buf *)ctx, &c, 1);
+	return ch;
+}
+
+// the name of a symbol, valid until the next call.
+static char *
+symbolName(Aot *a, LispRef sym)
+{
+	a->print.len = 0;
+	bufWrite(&a->print, "", 0);
+	lispPrint1(&a->m, sym, 1);
+	return a->print.p;
+}
+
+// a C string literal of the name of sym.
+static void
+quoteName(Aot *a, Buf *b, LispRef sym)
+{
+	bufWrite(b, "\"", 1);
+	for(char *p = symbolName(a, sym); *p != '\0'; p++){
+		if(*p == '"' || *p == '\\')
+			bufWrite(b, "\\", 1);
+		bufWrite(b, p, 1);
+	}
+	bufWrite(b, "\"", 1);
+}
+
+static int
+isForm(Aot *a, LispRef head, LispRef sym, int blt)
+{
+	return head == sym || lispIsBuiltin(&a->m, head, blt);
+}
+
+static int
+listLength(Aot *a, LispRef list)
+{
+	int n = 0;
+	for(; lispIsPair(&a->m, list); list = lispCdr(&a->m, list))
+		n++;
+	return lispIsNull(&a->m, list) ? n : -1;
+}
+
+// the parameters, if they are a proper list of symbols.
+static int
+paramCount(Aot *a, LispRef params)
+{
+	int n = 0;
+	for(; lispIsPair(&a->m, params); params = lispCdr(&a->m, params), n++)
+		if(!lispIsSymbol(&a->m, lispCar(&a->m, params)))
+			return -1;
+	return lispIsNull(&a->m, params) ? n : -1;
+}
+
+// (let (name params...) body...) gives name, or LISP_NIL.
+static LispRef
+functionName(Aot *a, LispRef form)
+{
+	LispMachine *m = &a->m;
+	if(!lispIsPair(m, form) || !isForm(a, lispCar(m, form), a->letSym, LISP_BUILTIN_LET))
+		return LISP_NIL;
+	LispRef rest = lispCdr(m, form);
+	if(!lispIsPair(m, rest) || !lispIsPair(m, lispCar(m, rest)))
+		return LISP_NIL;
+	LispRef name = lispCar(m, lispCar(m, rest));
+	if(!lispIsSymbol(m, name) || paramCount(a, lispCdr(m, lispCar(m, rest))) == -1)
+		return LISP_NIL;
+	return name;
+}
+
+static int
+addFunc(Aot *a, LispRef form)
+{
+	LispMachine *m = &a->m;
+	a->funcs = grow(a->funcs, &a->capfuncs, a->nfuncs, sizeof a->funcs[0]);
+	Func *f = &a->funcs[a->nfuncs];
+	LispRef head = lispCar(m, lispCdr(m, form));
+	f->name = lispCar(m, head);
+	f->params = lispCdr(m, head);
+	f->nparams = paramCount(a, f->params);
+	f->body = lispCdr(m, lispCdr(m, form));
+	f->ok = 1;
+	return a->nfuncs++;
+}
+
+static void
+pushName(Aot *a, LispRef sym, int kind, int idx)
+{
+	a->names = grow(a->names, &a->capnames, a->nnames, sizeof a->names[0]);
+	a->names[a->nnames].sym = sym;
+	a->names[a->nnames].kind = kind;
+	a->names[a->nnames].depth = a->depth;
+	a->names[a->nnames].idx = idx;
+	a->nnames++;
+}
+
+static Name *
+lookup(Aot *a, LispRef sym)
+{
+	for(size_t i = a->nnames; i-- > 0;)
+		if(a->names[i].sym == sym)
+			return &a->names[i];
+	return NULL;
+}
+
+// the compiled top-level function named sym, or -1.
+static int
+lookupFunc(Aot *a, LispRef sym)
+{
+	for(size_t i = 0; i < a->ntop; i++)
+		if(a->funcs[i].name == sym)
+			return a->funcs[i].ok ? (int)i : -1;
+	return -1;
+}
+
+// is sym defined at the top level, the name of a builtin then isn't one.
+static int
+isDefined(Aot *a, LispRef sym)
+{
+	LispMachine *m = &a->m;
+	for(size_t i = 0; i < a->nforms; i++){
+		LispRef form = a->forms[i].expr;
+		if(!lispIsPair(m, form) || !isForm(a, lispCar(m, form), a->letSym, LISP_BUILTIN_LET) || !lispIsPair(m, lispCdr(m, form)))
+			continue;
+		LispRef name = lispCar(m, lispCdr(m, form));
+		if(lispIsPair(m, name))
+			name = lispCar(m, name);
+		if(name == sym)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+lookupBuiltin(LispRef sym, int kind)
+{
+	for(size_t i = 0; i < sizeof builtins / sizeof builtins[0]; i++)
+		if(builtinSyms[i] == sym && builtins[i].kind == kind)
+			return i;
+	return -1;
+}
+
+static int
+quoteSymbol(Aot *a, LispRef sym)
+{
+	for(size_t i = 0; i < a->nsyms; i++)
+		if(a->syms[i] == sym)
+			return i;
+	a->syms = grow(a->syms, &a->capsyms, a->nsyms, sizeof a->syms[0]);
+	a->syms[a->nsyms] = sym;
+	return a->nsyms++;
+}
+
+static int
+newTemp(Aot *a)
+{
+	if(a->ntemps == a->maxtemps)
+		a->maxtemps++;
+	return a->ntemps++;
+}
+
+static int compileExpr(Aot *a, LispRef expr, char *dst, int tail);
+static int compileBody(Aot *a, LispRef body, char *dst, int tail);
+static int compileFunc(Aot *a, int fn);
+
+static int
+compileConst(Aot *a, LispRef val, char *dst)
+{
+	LispMachine *m = &a->m;
+	if(lispIsNumber(m, val))
+		emit(a, "*%s = lispNumber(m, %lld);\n", dst, (long long)lispGetInt(m, val));
+	else if(lispIsFloat(m, val) && isfinite(lispGetFloat(m, val)))
+		emit(a, "*%s = lispFloat(m, %a);\n", dst, lispGetFloat(m, val));
+	else if(lispIsNull(m, val))
+		emit(a, "*%s = LISP_NIL;\n", dst);
+	else if(lispIsSymbol(m, val))
+		emit(a, "*%s = syms[%d]; // %s\n", dst, quoteSymbol(a, val), symbolName(a, val));
+	else
+		return -1;
+	return 0;
+}
+
+// a variable or a constant as a C expression, or -1 for anything that
+// has to be evaluated first.
+static int
+simpleArg(Aot *a, LispRef expr, char *buf, size_t len)
+{
+	LispMachine *m = &a->m;
+	if(lispIsPair(m, expr) && isForm(a, lispCar(m, expr), a->quoteSym, LISP_BUILTIN_QUOTE) && lookup(a, lispCar(m, expr)) == NULL){
+		if(listLength(a, lispCdr(m, expr)) != 1)
+			return -1;
+		expr = lispCar(m, lispCdr(m, expr));
+		if(lispIsNull(m, expr))
+			snprintf(buf, len, "LISP_NIL");
+		else if(lispIsSymbol(m, expr))
+			snprintf(buf, len, "syms[%d]", quoteSymbol(a, expr));
+		else if(!lispIsNumber(m, expr) && !lispIsFloat(m, expr))
+			return -1;
+	}
+	if(lispIsNumber(m, expr)){
+		snprintf(buf, len, "lispNumber(m, %lld)", (long long)lispGetInt(m, expr));
+	} else if(lispIsFloat(m, expr)){
+		// the floats on the heap allocate, which an argument can't.
+		if(!isfinite(lispGetFloat(m, expr)) || lispIsPair(m, expr))
+			return -1;
+		snprintf(buf, len, "lispFloat(m, %a)", lispGetFloat(m, expr));
+	} else if(lispIsSymbol(m, expr)){
+		Name *name = lookup(a, expr);
+		if(name == NULL || name->kind != AOT_VAR || name->depth != a->depth)
+			return -1;
+		snprintf(buf, len, "*v%d", name->idx);
+	} else if(lispIsPair(m, expr)){
+		return -1;
+	}
+	return 0;
+}
+
+// (head args...) where head is a builtin or a function compiled to C. the
+// arguments are evaluated to temporaries, unless they all are simpleArg.
+static int
+compileCall(Aot *a, LispRef head, LispRef args, char *dst, int tail)
+{
+	LispMachine *m = &a->m;
+	int n = listLength(a, args);
+	int fn = -1, blt = -1;
+	Name *name = lookup(a, head);
+	if(name != NULL && name->kind == AOT_FUNC)
+		fn = name->idx;
+	else if(name == NULL && (fn = lookupFunc(a, head)) == -1 && (isDefined(a, head) || (blt = lookupBuiltin(head, AOT_APPLY)) == -1))
+		return -1;
+	if(n == -1 || (name != NULL && name->kind != AOT_FUNC) || (fn != -1 && a->funcs[fn].nparams != n))
+		return -1;
+
+	int temps = a->ntemps, simple = 1;
+	char (*arg)[64] = malloc((n + 1) * sizeof arg[0]);
+	for(LispRef p = args; p != LISP_NIL && simple; p = lispCdr(m, p))
+		simple = simpleArg(a, lispCar(m, p), arg[0], sizeof arg[0]) == 0;
+	for(int i = 0; i < n; i++, args = lispCdr(m, args)){
+		if(simple){
+			simpleArg(a, lispCar(m, args), arg[i], sizeof arg[i]);
+			continue;
+		}
+		int t = newTemp(a);
+		snprintf(arg[i], sizeof arg[i], "t%d", t);
+		if(compileExpr(a, lispCar(m, args), arg[i], 0) == -1){
+			free(arg);
+			return -1;
+		}
+		snprintf(arg[i], sizeof arg[i], "*t%d", t);
+	}
+	Buf call = {0};
+	bufWrite(&call, "", 0);
+	for(int i = 0; i < n; i++)
+		bufPrintf(&call, ", %s", arg[i]);
+
+	if(fn == a->fn && tail){
+		// a jump to the start with the new arguments, which may read the
+		// parameters.
+		if(simple)
+			for(int i = 0; i < n; i++)
+				emit(a, "*t%d = %s;\n", newTemp(a), arg[i]);
+		for(int i = 0; i < n; i++)
+			emit(a, "*v%d = *t%d;\n", i, temps + i);
+		emit(a, "goto top;\n");
+		a->top = 1;
+	} else if(fn != -1){
+		emit(a, "*%s = aot%d(m%s); // %s\n", dst, fn, call.p, symbolName(a, head));
+	} else if(n == 1 || n == 2){
+		emit(a, "*%s = aotCall%d(m, %s%s);\n", dst, n, builtins[blt].id, call.p);
+	} else {
+		emit(a, "*%s = LISP_NIL;\n", dst);
+		for(int i = n; i-- > 0;)
+			emit(a, "*%s = lispCons(m, %s, *%s);\n", dst, arg[i], dst);
+		emit(a, "*%s = aotApply(m, %s, *%s);\n", dst, builtins[blt].id, dst);
+	}
+	a->ntemps = temps;
+	free(call.p);
+	free(arg);
+	return 0;
+}
+
+// ((lambda (params...) body...) args...), with the parameters as variables.
+static int
+compileLambda(Aot *a, LispRef lambda, LispRef args, char *dst, int tail)
+{
+	LispMachine *m = &a->m;
+	if(!lispIsPair(m, lispCdr(m, lambda)))
+		return -1;
+	LispRef params = lispCar(m, lispCdr(m, lambda));
+	int n = paramCount(a, params);
+	if(n == -1 || n != listLength(a, args))
+		return -1;
+	int vars = a->nvars;
+	a->nvars += n;
+	for(int i = 0; i < n; i++, args = lispCdr(m, args)){
+		char var[32];
+		snprintf(var, sizeof var, "v%d", vars + i);
+		if(compileExpr(a, lispCar(m, args), var, 0) == -1)
+			return -1;
+	}
+	size_t names = a->nnames;
+	for(int i = 0; i < n; i++, params = lispCdr(m, params))
+		pushName(a, lispCar(m, params), AOT_VAR, vars + i);
+	int r = compileBody(a, lispCdr(m, lispCdr(m, lambda)), dst, tail);
+	a->nnames = names;
+	return r;
+}
+
+static int
+compileExpr(Aot *a, LispRef expr, char *dst, int tail)
+{
+	LispMachine *m = &a->m;
+	if(lispIsNumber(m, expr) || lispIsFloat(m, expr))
+		return compileConst(a, expr, dst);
+	if(lispIsSymbol(m, expr)){
+		Name *name = lookup(a, expr);
+		if(name != NULL){
+			// variables of enclosing functions would be captured.
+			if(name->kind != AOT_VAR || name->depth != a->depth)
+				return -1;
+			emit(a, "*%s = *v%d;\n", dst, name->idx);
+			return 0;
+		}
+		int blt = lookupBuiltin(expr, AOT_CONST);
+		if(blt == -1 || isDefined(a, expr))
+			return -1;
+		emit(a, "*%s = lispBuiltin(m, %s);\n", dst, builtins[blt].id);
+		return 0;
+	}
+	if(!lispIsCons(m, expr))
+		return -1;
+
+	LispRef head = lispCar(m, expr);
+	LispRef args = lispCdr(m, expr);
+	int n = listLength(a, args);
+	if(lispIsPair(m, head) && isForm(a, lispCar(m, head), a->lambdaSym, LISP_BUILTIN_LAMBDA))
+		return compileLambda(a, head, args, dst, tail);
+	if(isForm(a, head, a->quoteSym, LISP_BUILTIN_QUOTE) && lookup(a, head) == NULL){
+		if(n != 1)
+			return -1;
+		return compileConst(a, lispCar(m, args), dst);
+	}
+	if(isForm(a, head, a->ifSym, LISP_BUILTIN_IF) && lookup(a, head) == NULL){
+		if(n != 3)
+			return -1;
+		if(compileExpr(a, lispCar(m, args), dst, 0) == -1)
+			return -1;
+		emit(a, "if(*%s != lispBuiltin(m, LISP_BUILTIN_FALSE)){\n", dst);
+		a->indent++;
+		args = lispCdr(m, args);
+		if(compileExpr(a, lispCar(m, args), dst, tail) == -1)
+			return -1;
+		a->indent--;
+		emit(a, "} else {\n");
+		a->indent++;
+		args = lispCdr(m, args);
+		if(compileExpr(a, lispCar(m, args), dst, tail) == -1)
+			return -1;
+		a->indent--;
+		emit(a, "}\n");
+		return 0;
+	}
+	if(isForm(a, head, a->setSym, LISP_BUILTIN_SET) && lookup(a, head) == NULL){
+		if(n != 2)
+			return -1;
+		Name *name = lookup(a, lispCar(m, args));
+		if(name == NULL || name->kind != AOT_VAR || name->depth != a->depth)
+			return -1;
+		char var[32];
+		snprintf(var, sizeof var, "v%d", name->idx);
+		if(compileExpr(a, lispCar(m, lispCdr(m, args)), var, 0) == -1)
+			return -1;
+		emit(a, "*%s = LISP_NIL;\n", dst);
+		return 0;
+	}
+	if(!lispIsSymbol(m, head))
+		return -1;
+	return compileCall(a, head, args, dst, tail);
+}
+
+/*
+ *	The nested functions of a body are lifted first, so they can call each
+ *	other. Then (let sym expr) gives a variable for the rest of the body,
+ *	like in the interpreter.
+ */
+static int
+compileBody(Aot *a, LispRef body, char *dst, int tail)
+{
+	LispMachine *m = &a->m;
+	if(listLength(a, body) <= 0)
+		return -1;
+	size_t names = a->nnames;
+	size_t first = a->nfuncs;
+	for(LispRef p = body; p != LISP_NIL; p = lispCdr(m, p)){
+		LispRef name = functionName(a, lispCar(m, p));
+		if(name != LISP_NIL)
+			pushName(a, name, AOT_FUNC, addFunc(a, lispCar(m, p)));
+	}
+	for(size_t i = first; i < a->nfuncs; i++)
+		if(compileFunc(a, i) == -1)
+			return -1;
+	for(LispRef p = body; p != LISP_NIL; p = lispCdr(m, p)){
+		LispRef form = lispCar(m, p);
+		int last = lispCdr(m, p) == LISP_NIL;
+		if(functionName(a, form) != LISP_NIL){
+			// the value would be the closure.
+			if(last)
+				return -1;
+			continue;
+		}
+		if(lispIsPair(m, form) && isForm(a, lispCar(m, form), a->letSym, LISP_BUILTIN_LET) && lookup(a, lispCar(m, form)) == NULL){
+			LispRef rest = lispCdr(m, form);
+			if(listLength(a, rest) != 2 || !lispIsSymbol(m, lispCar(m, rest)))
+				return -1;
+			char var[32];
+			int v = a->nvars++;
+			snprintf(var, sizeof var, "v%d", v);
+			if(compileExpr(a, lispCar(m, lispCdr(m, rest)), var, 0) == -1)
+				return -1;
+			pushName(a, lispCar(m, rest), AOT_VAR, v);
+			if(last)
+				emit(a, "*%s = *%s;\n", dst, var);
+			continue;
+		}
+		if(compileExpr(a, form, dst, tail && last) == -1)
+			return -1;
+	}
+	a->nnames = names;
+	return 0;
+}
+
+// compile funcs[fn] to a C function aot<fn> in a->code.
+static int
+compileFunc(Aot *a, int fn)
+{
+	LispMachine *m = &a->m;
+	Func *f = &a->funcs[fn];
+	if(f->nparams == -1)
+		return -1;
+	LispRef params = f->params, body = f->body;
+	int saved[] = {a->fn, a->depth, a->nvars, a->ntemps, a->maxtemps, a->indent, a->top};
+	Buf *out = a->out;
+	Buf buf = {0};
+	a->fn = fn;
+	a->depth++;
+	a->nvars = f->nparams;
+	a->ntemps = 0;
+	a->maxtemps = 0;
+	a->indent = 1;
+	a->top = 0;
+	a->out = &buf;
+	size_t names = a->nnames;
+	for(int i = 0; i < f->nparams; i++, params = lispCdr(m, params))
+		pushName(a, lispCar(m, params), AOT_VAR, i);
+	// the value goes to t0.
+	newTemp(a);
+	int r = compileBody(a, body, "t0", 1);
+	a->nnames = names;
+
+	// nested functions may have moved funcs.
+	f = &a->funcs[fn];
+	if(r == 0){
+		Buf *c = &a->code;
+		bufPrintf(c, "\n// (%s", symbolName(a, f->name));
+		for(LispRef p = f->params; p != LISP_NIL; p = lispCdr(m, p))
+			bufPrintf(c, " %s", symbolName(a, lispCar(m, p)));
+		bufPrintf(c, ")\nstatic LispRef\naot%d(LispMachine *m", fn);
+		for(int i = 0; i < f->nparams; i++)
+			bufPrintf(c, ", LispRef a%d", i);
+		bufPrintf(c, ")\n{\n\tsize_t scope = lispRegisterScope(m);\n");
+		for(int i = 0; i < a->nvars; i++){
+			if(i < f->nparams)
+				bufPrintf(c, "\tLispRef *v%d = lispRegister(m, a%d);\n", i, i);
+			else
+				bufPrintf(c, "\tLispRef *v%d = lispRegister(m, LISP_NIL);\n", i);
+		}
+		for(int i = 0; i < a->maxtemps; i++)
+			bufPrintf(c, "\tLispRef *t%d = lispRegister(m, LISP_NIL);\n", i);
+		if(a->top)
+			bufPrintf(c, "top:\n");
+		bufWrite(c, buf.p, buf.len);
+		bufPrintf(c, "\tLispRef r = *t0;\n\tlispReleaseScope(m, scope);\n\treturn r;\n}\n");
+	}
+	free(buf.p);
+	a->out = out;
+	a->fn = saved[0];
+	a->depth = saved[1];
+	a->nvars = saved[2];
+	a->ntemps = saved[3];
+	a->maxtemps = saved[4];
+	a->indent = saved[5];
+	a->top = saved[6];
+	return r;
+}
+
+// is sym the target of a set! anywhere in expr?
+static int
+isSet(Aot *a, LispRef expr, LispRef sym)
+{
+	LispMachine *m = &a->m;
+	for(; lispIsCons(m, expr); expr = lispCdr(m, expr)){
+		LispRef head = lispCar(m, expr);
+		if(isForm(a, head, a->setSym, LISP_BUILTIN_SET) && lispIsPair(m, lispCdr(m, expr)) && lispCar(m, lispCdr(m, expr)) == sym)
+			return 1;
+		if(isSet(a, head, sym))
+			return 1;
+	}
+	return 0;
+}
+
+// the top-level functions that can be compiled, as the largest set that
+// only calls itself.
+static void
+findFuncs(Aot *a)
+{
+	LispMachine *m = &a->m;
+	for(size_t i = 0; i < a->nforms; i++){
+		a->forms[i].func = -1;
+		if(functionName(a, a->forms[i].expr) != LISP_NIL)
+			a->forms[i].func = addFunc(a, a->forms[i].expr);
+	}
+	a->ntop = a->nfuncs;
+	for(size_t i = 0; i < a->ntop; i++){
+		Func *f = &a->funcs[i];
+		for(size_t j = 0; j < a->nforms && f->ok; j++){
+			LispRef form = a->forms[j].expr;
+			if(a->forms[j].func != (int)i && lispIsPair(m, form) && isForm(a, lispCar(m, form), a->letSym, LISP_BUILTIN_LET)){
+				LispRef name = lispCar(m, lispCdr(m, form));
+				if(lispIsPair(m, name))
+					name = lispCar(m, name);
+				if(name == f->name)
+					f->ok = 0;
+			}
+			if(isSet(a, form, f->name))
+				f->ok = 0;
+		}
+	}
+	Buf scratch = {0};
+	a->out = &scratch;
+	for(int changed = 1; changed;){
+		changed = 0;
+		for(size_t i = 0; i < a->ntop; i++){
+			if(!a->funcs[i].ok)
+				continue;
+			a->nfuncs = a->ntop;
+			a->code.len = 0;
+			if(compileFunc(a, i) == -1){
+				a->funcs[i].ok = 0;
+				changed = 1;
+			}
+		}
+	}
+	free(scratch.p);
+}
+
+// writes p as a C string literal, a line each, and a newline after it.
+static void
+writeString(FILE *fp, char *p, size_t len)
+{
+	fprintf(fp, "\t\"");
+	for(size_t i = 0; i < len; i++){
+		switch(p[i]){
+		case '\n':
+			fprintf(fp, "\\n\"\n\t\"");
+			break;
+		case '\t':
+			fprintf(fp, "\\t");
+			break;
+		case '"':
+		case '\\':
+			fprintf(fp, "\\%c", p[i]);
+			break;
+		default:
+			fputc(p[i], fp);
+		}
+	}
+	fprintf(fp, "\\n\"\n");
+}
+
+// reads a file for lispParse, counting where it is.
+typedef struct {
+	char *p;
+	size_t len;
+	size_t off;
+} Source;
+
+static int
+sourceGetc(void *ctx)
+{
+	Source *s = ctx;
+	if(s->off == s->len){
+		s->off++;
+		return EOF;
+	}
+	return (unsigned char)s->p[s->off++];
+}
+
+static int
+sourceUngetc(int ch, void *ctx)
+{
+	Source *s = ctx;
+	s->off--;
+	return ch;
+}
+
+static char *
+readFile(char *path, size_t *len)
+{
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL){
+		fprintf(stderr, "aot: cannot open %s\n", path);
+		exit(1);
+	}
+	Buf b = {0};
+	char tmp[4096];
+	size_t n;
+	while((n = fread(tmp, 1, sizeof tmp, fp)) > 0)
+		bufWrite(&b, tmp, n);
+	bufWrite(&b, "", 0);
+	fclose(fp);
+	*len = b.len;
+	return b.p;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static Aot aot;
+	Aot *a = &aot;
+	LispMachine *m = &a->m;
+	if(argc < 2){
+		fprintf(stderr, "usage: %s files... > module.c\n", argv[0]);
+		return 1;
+	}
+	lispSetCollector(m, LISP_GC_COPYING);
+	lispInit(m);
+	lispSetPort(m, 1, printByte, NULL, NULL, &a->print);
+	a->ifSym = lispSymbol(m, "if");
+	a->lambdaSym = lispSymbol(m, "lambda");
+	a->letSym = lispSymbol(m, "let");
+	a->setSym = lispSymbol(m, "set!");
+	a->quoteSym = lispSymbol(m, "quote");
+	for(size_t i = 0; i < sizeof builtins / sizeof builtins[0]; i++)
+		builtinSyms[i] = lispSymbol(m, builtins[i].name);
+
+	// the forms of all files stay in a list until the last one is parsed,
+	// nothing moves after that.
+	char **text = malloc(argc * sizeof text[0]);
+	LispRef *list = lispRegister(m, LISP_NIL);
+	size_t cap = 0;
+	for(int i = 1; i < argc; i++){
+		Source src = {0};
+		text[i] = src.p = readFile(argv[i], &src.len);
+		lispSetPort(m, 0, NULL, sourceGetc, sourceUngetc, &src);
+		for(;;){
+			LispRef expr = lispParse(m, 1);
+			if(lispIsError(m, expr))
+				break;
+			*list = lispCons(m, expr, *list);
+			a->forms = grow(a->forms, &cap, a->nforms, sizeof a->forms[0]);
+			a->forms[a->nforms].file = i;
+			a->forms[a->nforms].end = src.off > src.len ? src.len : src.off;
+			a->nforms++;
+		}
+	}
+	LispRef p = *list;
+	for(size_t i = a->nforms; i-- > 0; p = lispCdr(m, p))
+		a->forms[i].expr = lispCar(m, p);
+
+	findFuncs(a);
+	a->nfuncs = a->ntop;
+	a->code.len = 0;
+	for(size_t i = 0; i < a->ntop; i++)
+		if(a->funcs[i].ok && compileFunc(a, i) == -1){
+			fprintf(stderr, "aot: %s does not compile\n", symbolName(a, a->funcs[i].name));
+			return 1;
+		}
+
+	printf("// generated by aot from");
+	for(int i = 1; i < argc; i++)
+		printf(" %s", argv[i]);
+	printf(", do not edit.\n%s\nstatic LispRef syms[%zu];\n\n", prologue, a->nsyms + 1);
+	for(size_t i = 0; i < a->nfuncs; i++){
+		if(!a->funcs[i].ok)
+			continue;
+		printf("static LispRef aot%zu(LispMachine *m", i);
+		for(int j = 0; j < a->funcs[i].nparams; j++)
+			printf(", LispRef");
+		printf(");\n");
+	}
+	fwrite(a->code.p, 1, a->code.len, stdout);
+
+	// the natives take the arguments as a list.
+	Buf natives = {0};
+	for(size_t i = 0; i < a->ntop; i++){
+		Func *f = &a->funcs[i];
+		if(!f->ok)
+			continue;
+		printf("\nstatic LispRef\naotNative%zu(LispMachine *m, LispRef args)\n{\n", i);
+		printf("\tLispRef a[%d];\n", f->nparams + 1);
+		printf("\tif(aotArgs(m, args, a, %d) == -1)\n\t\treturn lispBuiltin(m, LISP_BUILTIN_ERROR);\n", f->nparams);
+		printf("\treturn aot%zu(m", i);
+		for(int j = 0; j < f->nparams; j++)
+			printf(", a[%d]", j);
+		printf(");\n}\n");
+		bufPrintf(&natives, "\t{");
+		quoteName(a, &natives, f->name);
+		bufPrintf(&natives, ", aotNative%zu},\n", i);
+	}
+	printf("\nstatic LispNative natives[] = {\n%s\t{NULL, NULL},\n};\n", natives.p != NULL ? natives.p : "");
+
+	printf("\nvoid\nlispAotInit(LispMachine *m)\n{\n");
+	for(size_t i = 0; i < a->nsyms; i++){
+		Buf b = {0};
+		quoteName(a, &b, a->syms[i]);
+		printf("\tsyms[%zu] = lispSymbol(m, %s);\n", i, b.p);
+		free(b.p);
+	}
+	printf("\tfor(size_t i = 0; natives[i].name != NULL; i++)\n");
+	printf("\t\tlispDefine(m, lispSymbol(m, natives[i].name), lispNative(m, &natives[i]));\n}\n");
+
+	// the forms that weren't compiled, with what comes before them.
+	printf("\nchar lispAotSource[] =\n");
+	for(size_t i = 0; i < a->nforms; i++){
+		Form *f = &a->forms[i];
+		size_t start = i > 0 && a->forms[i-1].file == f->file ? a->forms[i-1].end : 0;
+		if(f->func != -1 && a->funcs[f->func].ok)
+			continue;
+		// without the newlines between forms.
+		while(start < f->end && text[f->file][start] == '\n')
+			start++;
+		writeString(stdout, text[f->file] + start, f->end - start);
+	}
+	printf("\t\"\";\n");
+	return 0;
+}
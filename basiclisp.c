@@ -4,9 +4,76 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 #include <assert.h>
+#include <math.h>
 #include "basiclisp.h"
 
+#ifndef LISP_USE_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define LISP_USE_MMAP 1
+#else
+#define LISP_USE_MMAP 0
+#endif
+#endif
+
+#if LISP_USE_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef LISP_USE_THREADS
+#if defined(__unix__) || defined(__APPLE__)
+#define LISP_USE_THREADS 1
+#else
+#define LISP_USE_THREADS 0
+#endif
+#endif
+
+#if LISP_USE_THREADS
+#include <pthread.h>
+#endif
+
+// lispStep and lispRunCode jump from one state or instruction straight to
+// the code of the next one through a table of label addresses, instead of
+// going back to a switch. It needs the computed goto of GCC and clang.
+#ifndef LISP_THREADED
+#if defined(__GNUC__)
+#define LISP_THREADED 1
+#else
+#define LISP_THREADED 0
+#endif
+#endif
+
+// references are tagged in their low bits instead of the high ones, see
+// mkref.
+#ifndef LISP_LOWTAG
+#define LISP_LOWTAG 0
+#endif
+
+// with LISP_JIT, compiled code that gets applied often is translated to
+// x86-64 machine code, see lispJitCompile. the region it goes to is mapped
+// with mmap. the templates work on 32 bit references tagged in the high
+// bits. it is off by default, since it is still slower than the VM on
+// bench.scm and bench-matrix.scm, see the bench target of the Makefile.
+#ifndef LISP_JIT
+#define LISP_JIT 0
+#endif
+#if LISP_JIT && !(defined(__x86_64__) && defined(__GNUC__) && LISP_USE_MMAP)
+#error "LISP_JIT needs x86-64, gcc and mmap"
+#endif
+#if LISP_JIT && (LISP_REF64 || LISP_LOWTAG)
+#error "LISP_JIT needs 32 bit references tagged in the high bits"
+#endif
+
+#if LISP_THREADED
+#define LISP_TARGET(x) case x: label_##x:
+#define LISP_LABEL(x) [x] = &&label_##x
+#else
+#define LISP_TARGET(x) case x:
+#endif
+
 // external object system
 
 // cmp(extref, extref) -> {LISP_BUILTIN_LESS, LISP_BUILTIN_EQUAL, LISP_BUILTIN_GREATER}
@@ -34,6 +101,113 @@
 
 #define nelem(x) (sizeof(x)/sizeof(x[0]))
 
+// the generational collector remembers writes at the granularity of cards of
+// 1<<LISP_CARD_BITS references.
+#define LISP_CARD_BITS 5
+
+// default nursery size, in references.
+#ifndef LISP_NURSERY_SIZE
+#define LISP_NURSERY_SIZE (1<<16)
+#endif
+
+// address space reserved for each heap space, in references. it is only
+// committed as the heap grows.
+#ifndef LISP_HEAP_RESERVE
+#if SIZE_MAX > 4294967295 && LISP_REF64
+#define LISP_HEAP_RESERVE ((size_t)1<<35)
+#elif SIZE_MAX > 4294967295
+#define LISP_HEAP_RESERVE ((size_t)1<<31)
+#else
+#define LISP_HEAP_RESERVE ((size_t)1<<26)
+#endif
+#endif
+
+// initial size of the mark stack of the mark-compact collector, which
+// doubles when it runs out. only when it can't grow is the heap rescanned
+// for unfinished cells, from the lowest one.
+#ifndef LISP_MARK_STACK
+#define LISP_MARK_STACK 1024
+#endif
+
+// the parallel collector hands out the new space in chunks of this many
+// references, and only kicks in for heaps of at least LISP_PARALLEL_MIN.
+#ifndef LISP_GC_CHUNK
+#define LISP_GC_CHUNK 1024
+#endif
+#ifndef LISP_PARALLEL_MIN
+#define LISP_PARALLEL_MIN ((size_t)1<<18)
+#endif
+
+// the call stack starts with room for this many entries, and doubles.
+#ifndef LISP_STACK_MIN
+#define LISP_STACK_MIN 256
+#endif
+
+// the root stack grows by this many registers at a time.
+#ifndef LISP_ROOT_CHUNK
+#define LISP_ROOT_CHUNK 64
+#endif
+
+// a full collection is also due when the extrefs in use have grown by this
+// many plus the number that were in use after the previous one.
+#ifndef LISP_EXT_MIN
+#define LISP_EXT_MIN 256
+#endif
+
+// the code cache is emptied when it would grow past this many lambdas.
+#ifndef LISP_CODE_CACHE
+#define LISP_CODE_CACHE 4096
+#endif
+
+// a lambda is translated to machine code once it has been applied this
+// many times. translations go to a region of LISP_JIT_SIZE bytes, which is
+// emptied when it runs out, and bodies of more than LISP_JIT_OPS
+// instructions are left to the VM.
+#ifndef LISP_JIT_HOT
+#define LISP_JIT_HOT 64
+#endif
+#ifndef LISP_JIT_SIZE
+#define LISP_JIT_SIZE ((size_t)1<<20)
+#endif
+#ifndef LISP_JIT_OPS
+#define LISP_JIT_OPS 1024
+#endif
+
+// the ieee format floats are kept in, see lispFloat.
+#if LISP_REF64
+typedef double LispFloatBase;
+typedef uint64_t LispFloatBits;
+#else
+typedef float LispFloatBase;
+typedef uint32_t LispFloatBits;
+#endif
+
+// the bytes of a string in each of its words, see lispString.
+#define LISP_STRING_BYTES (sizeof(LispRef) == 8 ? 7 : 3)
+
+// bignums keep this many bits in each of their digits, see lispArith.
+#define LISP_BIGNUM_BITS 16
+
+// the floats on the heap keep their 64 bits in this many fixnums of
+// LISP_FLOAT_BITS each, see lispFloat.
+#define LISP_FLOAT_BITS (sizeof(LispRef) == 8 ? 32 : 22)
+#define LISP_FLOAT_DIGITS ((64 + LISP_FLOAT_BITS-1) / LISP_FLOAT_BITS)
+
+// lookups of globals stop being cached once the epoch doesn't fit a fixnum.
+#define LISP_EPOCH_MAX ((size_t)LISP_FIXNUM_MAX)
+
+// default amount of work per slice of the incremental collector, in references.
+#ifndef LISP_GC_BUDGET
+#define LISP_GC_BUDGET 256
+#endif
+
+// with LISP_GC_STRESS, every allocation collects: a full collection for the
+// copying and compacting collectors, a minor one for the generational, and a
+// slice for the incremental. this finds references the collector misses.
+#ifndef LISP_GC_STRESS
+#define LISP_GC_STRESS 0
+#endif
+
 static char *bltnames[] = {
 
 [LISP_BUILTIN_IF] = "if",
@@ -84,6 +258,19 @@ static char *bltnames[] = {
 // should be (fmt obj) -> '(1 0)
 [LISP_BUILTIN_PRINT1] = "print1",
 
+// collector counters as an a-list, see lispGetStats.
+[LISP_BUILTIN_GCSTATS] = "gc-stats",
+
+// contiguous vectors on the heap, see lispVector. (3 vec) is (vector-ref vec 3).
+[LISP_BUILTIN_MAKEVECTOR] = "make-vector",
+[LISP_BUILTIN_VECTORREF] = "vector-ref",
+[LISP_BUILTIN_VECTORSET] = "vector-set!",
+[LISP_BUILTIN_VECTORLENGTH] = "vector-length",
+
+// heap strings, see lispString.
+[LISP_BUILTIN_STRINGLENGTH] = "string-length",
+[LISP_BUILTIN_STRINGREF] = "string-ref",
+
 // error should return a list (#error message context) instead.. obviously this
 // won't work for OOM errors, so we should just preallocate that one.
 [LISP_BUILTIN_ERROR] = "#error",
@@ -105,38 +292,121 @@ static char *bltnames[] = {
 LispRef *
 lispRegister(LispMachine *m, LispRef val)
 {
-	uint32_t reguse = m->reguse;
-	for(size_t i = 0; i < nelem(m->regs); i++){
-		if((reguse & (1<<i)) == 0){
-			LispRef *regp = &m->regs[i];
-			m->reguse = reguse | (1<<i);
-			*regp = val;
-			m->regCount++;
-			if(m->regCount > m->maxRegCount){
-				m->maxRegCount = m->regCount;
-				fprintf(stderr, "max regcount %d\n", m->maxRegCount);
-			}
-			return regp;
+	size_t chunk = m->roots.len / LISP_ROOT_CHUNK;
+	if(chunk == m->roots.nchunks){
+		void *p = realloc(m->roots.chunks, (chunk+1) * sizeof m->roots.chunks[0]);
+		void *q = malloc(LISP_ROOT_CHUNK * sizeof m->roots.chunks[0][0]);
+		if(p == NULL || q == NULL){
+			fprintf(stderr, "lispRegister: out of memory\n");
+			abort();
 		}
+		m->roots.chunks = p;
+		m->roots.chunks[chunk] = q;
+		m->roots.nchunks++;
 	}
-	fprintf(stderr, "lispRegister: ran out of registers\n");
-	abort();
-	return NULL;
+	LispRef *regp = &m->roots.chunks[chunk][m->roots.len % LISP_ROOT_CHUNK];
+	m->roots.len++;
+	*regp = val;
+	return regp;
+}
+
+static LispRef *
+lispRootSlot(LispMachine *m, size_t i)
+{
+	return &m->roots.chunks[i / LISP_ROOT_CHUNK][i % LISP_ROOT_CHUNK];
+}
+
+static void
+lispPopFree(LispMachine *m)
+{
+	while(m->roots.len > 0 && *lispRootSlot(m, m->roots.len-1) == lispBuiltin(m, LISP_BUILTIN_FREE))
+		m->roots.len--;
 }
 
+/*
+ *	Registers don't have to be released in order. A released slot is marked
+ *	free, and the stack shrinks once everything above it is free too.
+ */
 void
 lispRelease(LispMachine *m, LispRef *regp)
 {
-	size_t i = regp - m->regs;
-	if(i >= nelem(m->regs))
+	if(*regp == lispBuiltin(m, LISP_BUILTIN_FREE)){
+		fprintf(stderr, "lispRelease: register released twice\n");
 		abort();
-	*regp = LISP_NIL;
-	m->regCount--;
-	m->reguse &= ~(1<<i);
+	}
+	*regp = lispBuiltin(m, LISP_BUILTIN_FREE);
+	lispPopFree(m);
+}
+
+// the current depth of the root stack, for lispReleaseScope.
+size_t
+lispRegisterScope(LispMachine *m)
+{
+	return m->roots.len;
+}
+
+// release every register taken since lispRegisterScope returned scope.
+void
+lispReleaseScope(LispMachine *m, size_t scope)
+{
+	if(scope < m->roots.len)
+		m->roots.len = scope;
+	lispPopFree(m);
+}
+
+/*
+ *	The tag of a reference is the number of leading zeros, see the tags in
+ *	basiclisp.h. With LISP_LOWTAG it is the number of trailing ones
+ *	instead, and a pair is the offset of its cell as it is: the offsets are
+ *	even, so pairs get by without a tag bit, and the other values shift.
+ *	Both leave the same number of bits to each tag.
+ */
+#if LISP_LOWTAG
+static LispRef
+mkref(intptr_t val, int tag)
+{
+	if(tag == LISP_TAG_PAIR)
+		return val;
+	return ((LispRef)val << (tag+1)) | (((LispRef)1 << tag) - 1);
+}
+
+static int
+reftag(LispRef ref)
+{
+	LispRef ntz, inv = ~ref;
+	__asm__("tzcnt %[inv], %[ntz]"
+		: [ntz]"=r"(ntz)
+		: [inv]"r"(inv)
+		: "cc"
+	);
+	return (int)ntz;
+}
+
+// does ref have tag, without counting the bits.
+static int
+hastag(LispRef ref, int tag)
+{
+	LispRef ones = ((LispRef)1 << tag) - 1;
+	return (ref & (2*ones + 1)) == ones;
 }
 
+// the value of ref, which has tag.
+static size_t
+tagval(LispRef ref, int tag)
+{
+	return tag == LISP_TAG_PAIR ? ref : ref >> (tag+1);
+}
+
+// the number of the builtin ref is, or one above all of them if it isn't a
+// builtin.
+static size_t
+bltval(LispRef ref)
+{
+	return hastag(ref, LISP_TAG_BUILTIN) ? tagval(ref, LISP_TAG_BUILTIN) : SIZE_MAX;
+}
+#else
 static LispRef
-mkref(int val, int tag)
+mkref(intptr_t val, int tag)
 {
 	LispRef ref = LISP_TAG_BIT >> tag;
 	return ref | ((ref - 1) & val);
@@ -154,16 +424,35 @@ reftag(LispRef ref)
 	return (int)nlz;
 }
 
+static int
+hastag(LispRef ref, int tag)
+{
+	return ref >> (8*sizeof(LispRef)-1 - tag) == 1;
+}
+
+static size_t
+tagval(LispRef ref, int tag)
+{
+	return (LISP_VAL_MASK >> tag) & ref;
+}
+
+static size_t
+bltval(LispRef ref)
+{
+	return (LispRef)(ref - (LISP_TAG_BIT >> LISP_TAG_BUILTIN));
+}
+#endif
+
 static intptr_t
 refval(LispRef ref)
 {
-	return (LISP_VAL_MASK >> reftag(ref)) & ref;
+	return tagval(ref, reftag(ref));
 }
 
 static size_t
 urefval(LispRef ref)
 {
-	return (LISP_VAL_MASK >> reftag(ref)) & ref;
+	return tagval(ref, reftag(ref));
 }
 
 LispRef
@@ -177,7 +466,7 @@ lispCellPointer(LispMachine *m, LispRef ref)
 {
 	size_t off = urefval(ref);
 	if(off <= 0 || off >= m->mem.len){
-		fprintf(stderr, "dereferencing an out of bounds reference: %x\n", ref);
+		fprintf(stderr, "dereferencing an out of bounds reference: %llx\n", (unsigned long long)ref);
 		abort();
 	}
 	assert((off&1) == 0);
@@ -189,16 +478,78 @@ lispStringPointer(LispMachine *m, LispRef ref)
 {
 	size_t off = urefval(ref);
 	if(off < LISP_INLINE_SYMBOL || off >= LISP_INLINE_SYMBOL+m->strings.len){
-		fprintf(stderr, "dereferencing an out of bounds string reference: %x off: %zu %c\n", ref, off, off);
+		fprintf(stderr, "dereferencing an out of bounds string reference: %llx off: %zu %c\n", (unsigned long long)ref, off, (int)off);
 		abort();
 	}
 	return m->strings.p + off - LISP_INLINE_SYMBOL;
 }
 
+static LispRef lispCopy(LispMachine *m, LispRef ref);
+
+// during an incremental collection, a cell is gray if it has been copied but
+// not yet scanned. its fields still point to the old space.
+static int
+lispIsGray(LispMachine *m, size_t off)
+{
+	size_t cell = off / 2;
+	if(off < m->incremental.scan)
+		return 0;
+	return ((m->incremental.black[cell / 64] >> (cell % 64)) & 1) == 0;
+}
+
+static void
+lispSetBlack(LispMachine *m, size_t off)
+{
+	size_t cell = off / 2;
+	m->incremental.black[cell / 64] |= (uint64_t)1 << (cell % 64);
+}
+
+// scan a single cell ahead of the incremental collector and make it black,
+// so that the collector skips it when it gets there.
+static void
+lispScanCell(LispMachine *m, size_t off)
+{
+	LispRef car = lispCopy(m, m->mem.ref[off + LISP_CAR_OFFSET]);
+	LispRef cdr = lispCopy(m, m->mem.ref[off + LISP_CDR_OFFSET]);
+	m->mem.ref[off + LISP_CAR_OFFSET] = car;
+	m->mem.ref[off + LISP_CDR_OFFSET] = cdr;
+	lispSetBlack(m, off);
+}
+
+// the write barrier of the generational collector. when an old cell is made
+// to point into the nursery, its card goes on the dirty list so that a minor
+// collection can use it as a root instead of scanning the old generation.
+static void
+lispRemember(LispMachine *m, size_t off, LispRef obj)
+{
+	if(reftag(obj) != LISP_TAG_PAIR || urefval(obj) < m->nursery.oldlen)
+		return;
+	size_t card = off >> LISP_CARD_BITS;
+	if(m->nursery.cards[card])
+		return;
+	m->nursery.cards[card] = 1;
+	if(m->nursery.len == m->nursery.cap){
+		m->nursery.cap = (m->nursery.cap == 0) ? 256 : 2*m->nursery.cap;
+		void *p = realloc(m->nursery.dirty, m->nursery.cap * sizeof m->nursery.dirty[0]);
+		if(p == NULL){
+			fprintf(stderr, "lispRemember: realloc failed\n");
+			abort();
+		}
+		m->nursery.dirty = p;
+	}
+	m->nursery.dirty[m->nursery.len++] = card;
+}
+
 static LispRef
 lispSetCar(LispMachine *m, LispRef base, LispRef obj)
 {
+	// the incremental collector must never see a new reference in a gray
+	// cell, so scan the cell before storing to it.
+	if(m->incremental.active && lispIsGray(m, urefval(base)))
+		lispScanCell(m, urefval(base));
 	LispRef *p = lispCellPointer(m, base);
+	if(urefval(base) < m->nursery.oldlen)
+		lispRemember(m, urefval(base) + LISP_CAR_OFFSET, obj);
 	p[LISP_CAR_OFFSET] = obj;
 	return obj;
 }
@@ -206,7 +557,13 @@ lispSetCar(LispMachine *m, LispRef base, LispRef obj)
 static LispRef
 lispSetCdr(LispMachine *m, LispRef base, LispRef obj)
 {
+	// the incremental collector must never see a new reference in a gray
+	// cell, so scan the cell before storing to it.
+	if(m->incremental.active && lispIsGray(m, urefval(base)))
+		lispScanCell(m, urefval(base));
 	LispRef *p = lispCellPointer(m, base);
+	if(urefval(base) < m->nursery.oldlen)
+		lispRemember(m, urefval(base) + LISP_CDR_OFFSET, obj);
 	p[LISP_CDR_OFFSET] = obj;
 	return obj;
 }
@@ -218,17 +575,24 @@ lispMemSet(LispRef *mem, LispRef val, size_t len)
 		mem[i] = val;
 }
 
+// an atom evaluates to itself. the strings, bignums, floats and vectors on
+// the heap are atoms too, though they are pairs to the collector.
 static int
 lispIsAtom(LispMachine *m, LispRef a)
 {
 	int tag = reftag(a);
-	return tag != LISP_TAG_SYMBOL && tag != LISP_TAG_PAIR;
+	if(tag == LISP_TAG_PAIR)
+		return a != LISP_NIL && !lispIsCons(m, a);
+	return tag != LISP_TAG_SYMBOL;
 }
 
 LispRef
 lispCar(LispMachine *m, LispRef base)
 {
 	LispRef *p = lispCellPointer(m, base);
+	// read barrier: a gray cell may point to the old space, forward it.
+	if(m->incremental.active && lispIsGray(m, urefval(base)))
+		return lispCopy(m, p[LISP_CAR_OFFSET]);
 	return p[LISP_CAR_OFFSET];
 }
 
@@ -236,41 +600,104 @@ LispRef
 lispCdr(LispMachine *m, LispRef base)
 {
 	LispRef *p = lispCellPointer(m, base);
+	// read barrier: a gray cell may point to the old space, forward it.
+	if(m->incremental.active && lispIsGray(m, urefval(base)))
+		return lispCopy(m, p[LISP_CDR_OFFSET]);
 	return p[LISP_CDR_OFFSET];
 }
 
+// lispCar and lispCdr without the bounds check, for the hot paths of the
+// interpreter, where base can only be a pair: code, frames, environments.
+static LispRef
+lispCarUnchecked(LispMachine *m, LispRef base)
+{
+	size_t off = tagval(base, LISP_TAG_PAIR);
+	if(m->incremental.active && lispIsGray(m, off))
+		return lispCopy(m, m->mem.ref[off + LISP_CAR_OFFSET]);
+	return m->mem.ref[off + LISP_CAR_OFFSET];
+}
+
+static LispRef
+lispCdrUnchecked(LispMachine *m, LispRef base)
+{
+	size_t off = tagval(base, LISP_TAG_PAIR);
+	if(m->incremental.active && lispIsGray(m, off))
+		return lispCopy(m, m->mem.ref[off + LISP_CDR_OFFSET]);
+	return m->mem.ref[off + LISP_CDR_OFFSET];
+}
+
 int
 lispIsSymbol(LispMachine *m, LispRef a)
 {
-	return reftag(a) == LISP_TAG_SYMBOL;
+	return hastag(a, LISP_TAG_SYMBOL);
 }
 
 int
 lispIsNumber(LispMachine *m, LispRef a)
 {
-	return reftag(a) == LISP_TAG_INTEGER;
+	return hastag(a, LISP_TAG_INTEGER);
 }
 
-int
+LispInt
 lispGetInt(LispMachine *m, LispRef ref)
 {
+	// the field is two's complement, sign extend it.
+	LispRef sign = (LispRef)LISP_FIXNUM_MAX + 1;
 	if(lispIsNumber(m, ref))
-		return refval(ref);
+		return (LispInt)(tagval(ref, LISP_TAG_INTEGER) ^ sign) - (LispInt)sign;
 	abort();
 	return -1;
 }
 
+// an immediate float, or one on the heap, see lispFloat.
+int
+lispIsFloat(LispMachine *m, LispRef a)
+{
+	if(hastag(a, LISP_TAG_FLOAT))
+		return 1;
+	return lispIsPair(m, a) && lispCarUnchecked(m, a) == lispBuiltin(m, LISP_BUILTIN_FLOAT);
+}
+
+static double lispBigFloat(LispMachine *m, LispRef num);
+
+// the value of a float, or of an integer converted to one.
+double
+lispGetFloat(LispMachine *m, LispRef ref)
+{
+	if(lispIsNumber(m, ref))
+		return lispGetInt(m, ref);
+	if(lispIsBignum(m, ref))
+		return lispBigFloat(m, ref);
+	if(!lispIsFloat(m, ref))
+		abort();
+	if(lispIsPair(m, ref)){
+		// the digits are fixnums the collectors don't change, so there is
+		// no read barrier.
+		LispRef *p = m->mem.ref + urefval(ref);
+		uint64_t u = 0;
+		for(size_t i = 0; i < LISP_FLOAT_DIGITS; i++)
+			u |= (uint64_t)lispGetInt(m, p[1 + i]) << i*LISP_FLOAT_BITS;
+		double d;
+		memcpy(&d, &u, sizeof d);
+		return d;
+	}
+	LispFloatBits bits = (LispFloatBits)tagval(ref, LISP_TAG_FLOAT) << (LISP_TAG_FLOAT+1);
+	LispFloatBase f;
+	memcpy(&f, &bits, sizeof f);
+	return f;
+}
+
 int
 lispIsBuiltinTag(LispMachine *m, LispRef ref)
 {
-	return reftag(ref) == LISP_TAG_BUILTIN;
+	return hastag(ref, LISP_TAG_BUILTIN);
 }
 
 int
 lispGetBuiltin(LispMachine *m, LispRef ref)
 {
 	if(lispIsBuiltinTag(m, ref))
-		return urefval(ref);
+		return tagval(ref, LISP_TAG_BUILTIN);
 	abort();
 	return -1;
 }
@@ -278,33 +705,73 @@ lispGetBuiltin(LispMachine *m, LispRef ref)
 int
 lispIsBuiltin(LispMachine *m, LispRef ref, int builtin)
 {
-	return lispIsBuiltinTag(m, ref) && lispGetBuiltin(m, ref) == builtin;
+	return ref == lispBuiltin(m, builtin);
 }
 
 int
 lispIsExtRef(LispMachine *mach, LispRef a)
 {
-	return reftag(a) == LISP_TAG_EXTREF;
+	return hastag(a, LISP_TAG_EXTREF);
 }
 
 // pair, can be nil.
 int
 lispIsList(LispMachine *m, LispRef a)
 {
-	return reftag(a) == LISP_TAG_PAIR;
+	return hastag(a, LISP_TAG_PAIR);
 }
 
 int
 lispIsNull(LispMachine *m, LispRef a)
 {
-	return reftag(a) == LISP_TAG_PAIR && a == LISP_NIL;
+	return a == LISP_NIL;
 }
 
 // a non-nil pair (car and cdr will work)
 int
 lispIsPair(LispMachine *m, LispRef a)
 {
-	return reftag(a) == LISP_TAG_PAIR && a != LISP_NIL;
+	return hastag(a, LISP_TAG_PAIR) && a != LISP_NIL;
+}
+
+// a heap string, which is also a pair to the collector.
+int
+lispIsString(LispMachine *m, LispRef a)
+{
+	return lispIsPair(m, a) && lispCarUnchecked(m, a) == lispBuiltin(m, LISP_BUILTIN_STRING);
+}
+
+// a heap bignum, see lispArith.
+int
+lispIsBignum(LispMachine *m, LispRef a)
+{
+	return lispIsPair(m, a) && lispCarUnchecked(m, a) == lispBuiltin(m, LISP_BUILTIN_BIGNUM);
+}
+
+// a heap vector, see lispVector.
+int
+lispIsVector(LispMachine *m, LispRef a)
+{
+	return lispIsPair(m, a) && lispCarUnchecked(m, a) == lispBuiltin(m, LISP_BUILTIN_VECTOR);
+}
+
+// a pair of the program, not one of the heap objects kept in pairs:
+// strings, bignums, floats and vectors.
+int
+lispIsCons(LispMachine *m, LispRef a)
+{
+	if(!lispIsPair(m, a))
+		return 0;
+	LispRef car = lispCarUnchecked(m, a);
+	return car != lispBuiltin(m, LISP_BUILTIN_STRING) && car != lispBuiltin(m, LISP_BUILTIN_BIGNUM)
+		&& car != lispBuiltin(m, LISP_BUILTIN_FLOAT) && car != lispBuiltin(m, LISP_BUILTIN_VECTOR);
+}
+
+// a number of any kind, what the arithmetic takes.
+static int
+lispIsReal(LispMachine *m, LispRef a)
+{
+	return hastag(a, LISP_TAG_INTEGER) || lispIsFloat(m, a) || lispIsBignum(m, a);
 }
 
 int
@@ -383,7 +850,7 @@ tokenClear(LispMachine *m)
 static int
 lispLex(LispMachine *m)
 {
-	int isinteger, ishex;
+	int isfloat, ishex;
 	int ch, peekc;
 
 again:
@@ -415,11 +882,31 @@ again:
 	caseself:
 		return ch;
 
+	// a sign right before a digit starts a number, -5 or +2.5, otherwise
+	// it is a symbol like - and +.
+	case '-': case '+':
+		peekc = m->ports[0].readbyte(m->ports[0].context);
+		if(peekc != -1)
+			m->ports[0].unreadbyte(peekc, m->ports[0].context);
+		if(peekc < '0' || peekc > '9')
+			goto casesym;
+		tokenAppend(m, ch);
+		ch = m->ports[0].readbyte(m->ports[0].context);
+		// fall through
 	case '0': case '1': case '2': case '3': case '4':
 	case '5': case '6': case '7': case '8': case '9':
-		ishex = 0;
+		isfloat = ishex = 0;
 		while(ch != -1){
-			if(!isDecimal(ch) && !(ishex && isHexadecimal(ch))){
+			// a fraction or an exponent makes it a float: 2.0, 1e-3.
+			if(ch == '.' && !ishex && !isfloat){
+				isfloat = 1;
+			} else if((ch == 'e' || ch == 'E') && !ishex && isfloat != 2){
+				isfloat = 2;
+				tokenAppend(m, ch);
+				ch = m->ports[0].readbyte(m->ports[0].context);
+				if(ch != '-' && ch != '+')
+					continue;
+			} else if(!isDecimal(ch) && !(ishex && isHexadecimal(ch))){
 				if(isBreak(ch))
 					break;
 				goto casesym;
@@ -431,7 +918,7 @@ again:
 		}
 		if(ch != -1)
 			m->ports[0].unreadbyte(ch, m->ports[0].context);
-		return LISP_TOK_INTEGER;
+		return isfloat ? LISP_TOK_FLOAT : LISP_TOK_INTEGER;
 
 	// string constant, detect and interpret standard escapes like in c.
 	case '"':
@@ -570,74 +1057,293 @@ lispAllocSymbol(LispMachine *m, char *str)
 	return ref;
 }
 
-static LispRef
-lispAllocate(LispMachine *m)
+static void lispCollectMinor(LispMachine *m);
+static void lispFlip(LispMachine *m);
+
+static void
+lispResizeBlack(LispMachine *m)
 {
-	LispRef ref;
-	size_t num = 2;
-	int didgc = 0;
-	// first, try gc.
-	if(!m->gclock && (m->mem.cap - m->mem.len) < num){
-		lispCollect(m);
-		didgc = 1;
-	}
-recheck:
-	if((didgc && 4*m->mem.len >= 3*m->mem.cap) || (m->mem.cap - m->mem.len) < num){
-		m->mem.cap = (m->mem.cap == 0) ? 256 : 2*m->mem.cap;
-		void *p = realloc(m->mem.ref, m->mem.cap * sizeof m->mem.ref[0]);
+	size_t len = (m->mem.cap/2 + 63) / 64;
+	if(len > m->incremental.len){
+		void *p = realloc(m->incremental.black, len * sizeof m->incremental.black[0]);
 		if(p == NULL){
-			fprintf(stderr, "lispAllocate: realloc failed (after gc)\n");
+			fprintf(stderr, "lispResizeBlack: realloc failed\n");
 			abort();
 		}
-		m->mem.ref = p;
-		lispMemSet(m->mem.ref + m->mem.len, LISP_NIL, m->mem.cap - m->mem.len);
-		goto recheck;
-	}
-	// never return LISP_NIL by accident.
-	if(m->mem.len == 0){
-		m->mem.len += 2;
-		goto recheck;
-	}
-	ref = mkref(m->mem.len, LISP_TAG_PAIR);
-	if(urefval(ref) != m->mem.len || reftag(ref) != LISP_TAG_PAIR){
-		fprintf(stderr, "out of address bits in ref: want %zx.%x got %zx.%x\n",
-			m->mem.len, LISP_TAG_PAIR, urefval(ref), reftag(ref));
-		exit(1);
+		m->incremental.black = p;
+		memset(m->incremental.black + m->incremental.len, 0, (len - m->incremental.len) * sizeof m->incremental.black[0]);
+		m->incremental.len = len;
 	}
-	m->mem.len += num;
-	lispSetCar(m, ref, LISP_NIL);
-	lispSetCdr(m, ref, LISP_NIL);
-	return ref;
 }
 
-static uint32_t
-fnv32a(char *str, uint32_t hval)
+#if LISP_USE_MMAP
+static size_t
+lispPageRound(size_t nrefs)
 {
-	unsigned char *s;
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (nrefs * sizeof(LispRef) + page - 1) & ~(page - 1);
+}
 
-	for(s = (unsigned char *)str; *s != '\0'; s++){
-		hval ^= (uint32_t)*s;
-		hval += (hval<<1) + (hval<<4) + (hval<<7) + (hval<<8) + (hval<<24);
-	}
-	return hval;
+static int
+lispReserve(LispSpace *sp, size_t reserved)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	void *p = mmap(NULL, lispPageRound(reserved), PROT_NONE, flags, -1, 0);
+	if(p == MAP_FAILED)
+		return -1;
+	sp->ref = p;
+	sp->reserved = reserved;
+	return 0;
 }
 
+/*
+ *	Map len references of a heap image at offset off of fd to the start of an
+ *	empty space. The pages are private to the process, and shared with other
+ *	processes that map the same image until they get written to.
+ */
 static int
-indexInsert1(LispMachine *m, uint32_t hash, LispRef ref)
+lispMapSpace(LispSpace *sp, int fd, size_t off, size_t len)
 {
-	size_t i, off;
+	if(sp->ref == NULL && lispReserve(sp, len > LISP_HEAP_RESERVE ? 2*len : LISP_HEAP_RESERVE) == -1)
+		return -1;
+	if(sp->reserved < len || sp->cap != 0)
+		return -1;
+	size_t size = lispPageRound(len);
+	void *p = mmap(sp->ref, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, off);
+	if(p == MAP_FAILED)
+		return -1;
+	sp->cap = size / sizeof sp->ref[0];
+	sp->len = len;
+	return 0;
+}
+#endif
 
-	for(i = 0; i < m->stringIndex.cap; i++){
-		LispRef nref;
-		off = (hash + i) & (m->stringIndex.cap - 1);
-		nref = m->stringIndex.ref[off];
-		if(nref == LISP_NIL){
-			m->stringIndex.ref[off] = ref;
-			m->stringIndex.len++;
-			return 0;
+/*
+ *	Heap spaces are reserved from the address space once and committed as
+ *	they grow, so growing the heap doesn't copy it. Shrinking gives the pages
+ *	back to the system. If mmap is not available (or fails), a space is an
+ *	ordinary realloc'd array.
+ */
+static void
+lispResizeSpace(LispSpace *sp, size_t cap)
+{
+#if LISP_USE_MMAP
+	if(sp->ref == NULL && cap > 0)
+		lispReserve(sp, cap > LISP_HEAP_RESERVE ? cap : LISP_HEAP_RESERVE);
+	if(sp->reserved != 0){
+		if(cap > sp->reserved){
+			// outgrew the reservation, move to a bigger one.
+			LispSpace nsp;
+			if(lispReserve(&nsp, 2*cap) == -1){
+				fprintf(stderr, "lispResizeSpace: out of address space\n");
+				abort();
+			}
+			mprotect(nsp.ref, lispPageRound(cap), PROT_READ|PROT_WRITE);
+			memcpy(nsp.ref, sp->ref, sp->len * sizeof sp->ref[0]);
+			munmap(sp->ref, lispPageRound(sp->reserved));
+			sp->ref = nsp.ref;
+			sp->reserved = nsp.reserved;
+		}
+		size_t oldsize = lispPageRound(sp->cap);
+		size_t newsize = lispPageRound(cap);
+		char *base = (char *)sp->ref;
+		if(newsize > oldsize){
+			if(mprotect(base + oldsize, newsize - oldsize, PROT_READ|PROT_WRITE) == -1){
+				fprintf(stderr, "lispResizeSpace: mprotect failed\n");
+				abort();
+			}
+		} else if(newsize < oldsize){
+			madvise(base + newsize, oldsize - newsize, MADV_DONTNEED);
+			mprotect(base + newsize, oldsize - newsize, PROT_NONE);
 		}
+		sp->cap = cap;
+		return;
 	}
-	return -1;
+#endif
+	if(cap == 0){
+		free(sp->ref);
+		sp->ref = NULL;
+		sp->cap = 0;
+		return;
+	}
+	void *p = realloc(sp->ref, cap * sizeof sp->ref[0]);
+	if(p == NULL){
+		fprintf(stderr, "lispResizeSpace: realloc failed\n");
+		abort();
+	}
+	sp->ref = p;
+	sp->cap = cap;
+}
+
+static uint64_t
+lispNanotime(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ *	The collector routines call each other, so only the outermost one
+ *	times the pause.
+ */
+static void
+lispPauseBegin(LispMachine *m)
+{
+	if(m->pause.depth++ == 0)
+		m->pause.start = lispNanotime();
+}
+
+static void
+lispPauseEnd(LispMachine *m)
+{
+	if(--m->pause.depth == 0){
+		uint64_t ns = lispNanotime() - m->pause.start;
+		m->stats.pauses++;
+		m->stats.pausens += ns;
+		if(ns > m->stats.maxpausens)
+			m->stats.maxpausens = ns;
+	}
+}
+
+static void
+lispGrow(LispMachine *m)
+{
+	m->stats.grows++;
+	lispResizeSpace(&m->mem, (m->mem.cap == 0) ? 256 : 2*m->mem.cap);
+	if(m->incremental.active)
+		lispResizeBlack(m);
+}
+
+/*
+ *	Return memory to the system after a collection that left the heap mostly
+ *	empty. The copy space only holds garbage at this point, and it is sized
+ *	back up by the next collection that needs it.
+ */
+static void
+lispTrim(LispMachine *m)
+{
+	size_t cap = m->mem.cap;
+	while(cap > 256 && 8*m->mem.len < cap)
+		cap /= 2;
+	if(cap < m->mem.cap)
+		lispResizeSpace(&m->mem, cap);
+	if(m->copy.cap > cap)
+		lispResizeSpace(&m->copy, cap);
+}
+
+/*
+ *	Every worker of the parallel collector can leave part of a chunk unused,
+ *	so the old space has to be this much smaller than the new one.
+ */
+static size_t
+lispHeadroom(LispMachine *m)
+{
+	if(m->gcthreads < 2 || m->mem.cap < LISP_PARALLEL_MIN)
+		return 0;
+	return (m->gcthreads+1) * LISP_GC_CHUNK;
+}
+
+/*
+ *	Allocate num words, an even number, and set them to nil. It is a pair
+ *	for lispCons, and the block of a vector for lispVector.
+ */
+static LispRef
+lispAllocate(LispMachine *m, size_t num)
+{
+	LispRef ref;
+	size_t room = num + lispHeadroom(m);
+	int extfull = m->extrefs.count >= 2*m->extrefs.live + LISP_EXT_MIN;
+	int stress = LISP_GC_STRESS && m->mem.len > 2;
+	int didgc = 0;
+	// first, try gc.
+	if(!m->gclock && m->gcmode == LISP_GC_INCREMENTAL){
+		// every allocation pays for a slice of the collection in progress,
+		// and a new one starts when the heap is getting full.
+		if(m->incremental.active){
+			size_t budget = m->incremental.budget != 0 ? m->incremental.budget : LISP_GC_BUDGET;
+			didgc = !lispCollectStep(m, budget);
+		} else if(extfull || stress || (m->mem.len > 2 && 4*m->mem.len >= 3*m->mem.cap)){
+			lispFlip(m);
+		}
+	} else if(!m->gclock && m->gcmode == LISP_GC_GENERATIONAL){
+		// a full nursery is evacuated to the old generation, which gets
+		// collected in turn once there is no longer room for a nursery.
+		size_t size = m->nursery.size != 0 ? m->nursery.size : LISP_NURSERY_SIZE;
+		if(extfull || stress || m->mem.len - m->nursery.oldlen >= size || (m->mem.cap - m->mem.len) < num){
+			lispCollectMinor(m);
+			if(extfull || 4*(m->mem.cap - m->mem.len) < m->mem.cap){
+				lispCollect(m);
+				didgc = 1;
+			}
+		}
+	} else if(!m->gclock && (extfull || stress || (m->mem.cap - m->mem.len) < room)){
+		lispCollect(m);
+		didgc = 1;
+	}
+recheck:
+	if((didgc && (4*m->mem.len >= 3*m->mem.cap || (m->mem.cap - m->mem.len) < room)) || (m->mem.cap - m->mem.len) < num){
+		lispGrow(m);
+		goto recheck;
+	}
+	// never return LISP_NIL by accident.
+	if(m->mem.len == 0){
+		lispMemSet(m->mem.ref, LISP_NIL, 2);
+		m->mem.len += 2;
+		goto recheck;
+	}
+	ref = mkref(m->mem.len, LISP_TAG_PAIR);
+	if(urefval(ref) != m->mem.len || reftag(ref) != LISP_TAG_PAIR){
+		fprintf(stderr, "out of address bits in ref: want %zx.%x got %zx.%x\n",
+			m->mem.len, LISP_TAG_PAIR, urefval(ref), reftag(ref));
+		exit(1);
+	}
+	m->mem.len += num;
+	m->stats.allocated += num / 2;
+	// cells allocated during an incremental collection are already black.
+	if(m->incremental.active)
+		for(size_t i = 0; i < num; i += 2)
+			lispSetBlack(m, urefval(ref) + i);
+	// they are new, so there is nothing for the barriers to do.
+	lispMemSet(m->mem.ref + urefval(ref), LISP_NIL, num);
+	return ref;
+}
+
+static uint32_t
+fnv32a(char *str, uint32_t hval)
+{
+	unsigned char *s;
+
+	for(s = (unsigned char *)str; *s != '\0'; s++){
+		hval ^= (uint32_t)*s;
+		hval += (hval<<1) + (hval<<4) + (hval<<7) + (hval<<8) + (hval<<24);
+	}
+	return hval;
+}
+
+static int
+indexInsert1(LispMachine *m, uint32_t hash, LispRef ref)
+{
+	size_t i, off;
+
+	for(i = 0; i < m->stringIndex.cap; i++){
+		LispRef nref;
+		off = (hash + i) & (m->stringIndex.cap - 1);
+		nref = m->stringIndex.ref[off];
+		if(nref == LISP_NIL){
+			m->stringIndex.ref[off] = ref;
+			m->stringIndex.len++;
+			return 0;
+		}
+	}
+	return -1;
 }
 
 static int
@@ -693,22 +1399,58 @@ indexLookup(LispMachine *m, uint32_t hash, char *str)
 }
 
 LispRef
-lispNumber(LispMachine *m, int v)
+lispNumber(LispMachine *m, LispInt v)
 {
-	LispRef ref = mkref(v, LISP_TAG_INTEGER);
-	if((int)refval(ref) == v)
-		return ref;
-	fprintf(stderr, "lispNumber: integer overflow %d\n", v);
+	if(v >= LISP_FIXNUM_MIN && v <= LISP_FIXNUM_MAX)
+		return mkref(v, LISP_TAG_INTEGER);
+	fprintf(stderr, "lispNumber: integer overflow %lld\n", (long long)v);
 	abort();
 }
 
+static size_t lispVectorSize(size_t len);
+
+/*
+ *	Floats are doubles. The ones with few enough mantissa bits are
+ *	immediate: the reference keeps the high bits of the ieee representation
+ *	of v, a float for 32 bit references and a double with LISP_REF64, and
+ *	the tag takes the place of the low bits of the mantissa. That leaves 17
+ *	bits of mantissa, or 46, and the whole range of the exponent. Any other
+ *	double lives on the heap in a block of two cells: LISP_BUILTIN_FLOAT,
+ *	then the bits of v in LISP_FLOAT_DIGITS fixnums of LISP_FLOAT_BITS, the
+ *	least significant first, with a nil after them when there are only
+ *	two. The collectors take its size from the marker, see lispBlockSize.
+ *	Either way v reads back exactly, and a value only has the one
+ *	representation.
+ */
+LispRef
+lispFloat(LispMachine *m, double v)
+{
+	LispFloatBase f = v;
+	LispFloatBits bits;
+	// all nans are the one with the high mantissa bit set.
+	if(f != f)
+		f = NAN;
+	memcpy(&bits, &f, sizeof bits);
+	if(f != f || ((double)f == v && (bits & (((LispFloatBits)1 << (LISP_TAG_FLOAT+1)) - 1)) == 0))
+		return mkref(bits >> (LISP_TAG_FLOAT+1), LISP_TAG_FLOAT);
+
+	uint64_t u;
+	memcpy(&u, &v, sizeof u);
+	LispRef ref = lispAllocate(m, lispVectorSize(LISP_FLOAT_DIGITS-1));
+	LispRef *p = m->mem.ref + urefval(ref);
+	p[LISP_CAR_OFFSET] = lispBuiltin(m, LISP_BUILTIN_FLOAT);
+	for(size_t i = 0; i < LISP_FLOAT_DIGITS; i++)
+		p[1 + i] = lispNumber(m, (u >> i*LISP_FLOAT_BITS) & (((uint64_t)1 << LISP_FLOAT_BITS) - 1));
+	return ref;
+}
+
 LispRef
 lispCons(LispMachine *m, LispRef a, LispRef d)
 {
 	LispRef ref;
 	LispRef *areg = lispRegister(m, a);
 	LispRef *dreg = lispRegister(m, d);
-	ref = lispAllocate(m);
+	ref = lispAllocate(m, 2);
 	lispSetCar(m, ref, *areg);
 	lispSetCdr(m, ref, *dreg);
 	lispRelease(m, areg);
@@ -737,721 +1479,3518 @@ lispSymbol(LispMachine *m, char *str)
 	return ref;
 }
 
-LispRef
-lispParse(LispMachine *m, int justone)
+/*
+ *	A vector is a block of words on the heap: LISP_BUILTIN_VECTOR, the length
+ *	and the elements, with a nil after them if the length is odd. A reference
+ *	to it is a pair reference to the first word, so the collectors take the
+ *	first two words for a pair, and copy the whole block when they see the
+ *	marker in its car. The elements get scanned as if they were the fields of
+ *	the pairs that follow it.
+ */
+static size_t
+lispVectorSize(size_t len)
 {
-	LispRef list = LISP_NIL, prev = LISP_NIL, cons, nval;
-	int ltok;
-	int dot = 0;
+	return 2 + len + (len & 1);
+}
 
-m->gclock++;
-	while((ltok = lispLex(m)) != -1){
-		tokenAppend(m, '\0');
-		switch(ltok){
-		default:
-			//fprintf(stderr, "unknown token %d: '%c' '%s'\n", ltok, ltok, m->tok);
-			list = lispBuiltin(m, LISP_BUILTIN_ERROR);
-			goto done;
-		case ')':
-			goto done;
-		case '(':
-			nval = lispParse(m, 0);
-			goto append;
-		case '\'':
-			nval = lispParse(m, 1);
-			nval = lispCons(m, lispBuiltin(m, LISP_BUILTIN_QUOTE), lispCons(m, nval, LISP_NIL));
-			goto append;
-		case '.':
-			dot++;
-			break;
-		case ',':
-			//fprintf(stderr, "TODO: backquote not implemented yet\n");
-			list = lispBuiltin(m, LISP_BUILTIN_ERROR);
-			goto done;
-		case LISP_TOK_INTEGER:
-			nval = lispNumber(m, strtol(m->token.buf, NULL, 0));
-			goto append;
-		case LISP_TOK_STRING:
-			nval = lispCons(m, lispBuiltin(m, LISP_BUILTIN_QUOTE),
-				lispCons(m, lispSymbol(m, m->token.buf),
-				LISP_NIL));
-			goto append;
-		case LISP_TOK_SYMBOL:
-			nval = lispSymbol(m, m->token.buf);
-		append:
-			if(justone){
-				list = nval;
-				goto done;
-			}
-			if(dot == 0){
-				cons = lispCons(m, nval, LISP_NIL);
-				if(prev != LISP_NIL)
-					lispSetCdr(m, prev, cons);
-				else
-					list = cons;
-				prev = cons;
-			} else if(dot == 1){
-				if(prev != LISP_NIL){
-					lispSetCdr(m, prev, nval);
-					dot++;
-				} else {
-					//fprintf(stderr, "malformed s-expression, bad use of '.'\n");
-					list = lispBuiltin(m, LISP_BUILTIN_ERROR);
-					goto done;
-				}
-			} else {
-				//fprintf(stderr, "malformed s-expression, bad use of '.'\n");
-				list = lispBuiltin(m, LISP_BUILTIN_ERROR);
-				goto done;
-			}
-			break;
-		}
+static size_t lispStringWords(size_t len);
+
+// the words of the heap object with the first word car and the second hdr:
+// the whole block of a vector, a string, a float or a bignum, or the two of
+// a pair.
+static size_t
+lispBlockSize(LispMachine *m, LispRef car, LispRef hdr)
+{
+	if(car == lispBuiltin(m, LISP_BUILTIN_VECTOR))
+		return lispVectorSize(lispGetInt(m, hdr));
+	if(car == lispBuiltin(m, LISP_BUILTIN_BIGNUM)){
+		LispInt len = lispGetInt(m, hdr);
+		return lispVectorSize(len < 0 ? -len : len);
 	}
-	if(justone && ltok == -1)
-		list = lispBuiltin(m, LISP_BUILTIN_ERROR);
-done:
-m->gclock--;
-	return list;
+	if(car == lispBuiltin(m, LISP_BUILTIN_STRING))
+		return lispVectorSize(lispStringWords(lispGetInt(m, hdr)));
+	if(car == lispBuiltin(m, LISP_BUILTIN_FLOAT))
+		return lispVectorSize(LISP_FLOAT_DIGITS-1);
+	return 2;
 }
 
-static int
-lispWrite(LispMachine *m, LispPort port, unsigned char *buf, size_t len)
+LispRef
+lispVector(LispMachine *m, size_t len, LispRef fill)
 {
+	LispRef *freg = lispRegister(m, fill);
+	LispRef ref = lispAllocate(m, lispVectorSize(len));
+	LispRef *p = m->mem.ref + urefval(ref);
+	p[LISP_CAR_OFFSET] = lispBuiltin(m, LISP_BUILTIN_VECTOR);
+	p[LISP_CDR_OFFSET] = lispNumber(m, len);
 	for(size_t i = 0; i < len; i++)
-		if(m->ports[port].writebyte(buf[i], m->ports[port].context) == -1)
-			return i == 0 ? -1 : (int)i;
-	return len;
+		p[2 + i] = *freg;
+	lispRelease(m, freg);
+	return ref;
 }
 
-static int
-lispRead(LispMachine *m, LispPort port)
+size_t
+lispVectorLength(LispMachine *m, LispRef vec)
 {
-	return m->ports[port].readbyte(m->ports[port].context);
+	if(!lispIsVector(m, vec)){
+		fprintf(stderr, "lispVectorLength: not a vector\n");
+		abort();
+	}
+	return lispGetInt(m, m->mem.ref[urefval(vec) + LISP_CDR_OFFSET]);
 }
 
-int
-lispPrint1(LispMachine *m, LispRef aref, LispPort port)
+// element i of the vector, or #error if it is out of range.
+LispRef
+lispVectorRef(LispMachine *m, LispRef vec, size_t i)
 {
-	char buf[128];
-	int tag = reftag(aref);
-	switch(tag){
-	default:
-		snprintf(buf, sizeof buf, "print1: unknown atom: val:%zx tag:%x\n", refval(aref), reftag(aref));
-		break;
-	case LISP_TAG_BUILTIN:
-		if(refval(aref) >= 0 && refval(aref) < LISP_NUM_BUILTINS)
-			snprintf(buf, sizeof buf, "%s", bltnames[refval(aref)]);
-		else
-			snprintf(buf, sizeof buf, "blt-0x%zx", refval(aref));
-		break;
-	case LISP_TAG_EXTREF:
-		snprintf(buf, sizeof buf, "extref(#%zx)", refval(aref));
-		break;
-	case LISP_TAG_PAIR:
-		if(aref == LISP_NIL)
-			snprintf(buf, sizeof buf, "()");
-		else
-			snprintf(buf, sizeof buf, "cons(#x%x)", aref);
-		break;
-	case LISP_TAG_INTEGER:
-		snprintf(buf, sizeof buf, "%zd", refval(aref));
-		break;
-	case LISP_TAG_SYMBOL:{
-			unsigned sym = urefval(aref);
-			if(sym < LISP_INLINE_SYMBOL)
-				snprintf(buf, sizeof buf, "%lc", sym);
-			else
-				snprintf(buf, sizeof buf, "%s", lispStringPointer(m, aref));
-			break;
-		}
-	}
-	lispWrite(m, port, (unsigned char *)buf, strlen(buf));
-	return tag;
+	if(!lispIsVector(m, vec) || i >= lispVectorLength(m, vec))
+		return lispBuiltin(m, LISP_BUILTIN_ERROR);
+	size_t off = urefval(vec) + 2 + i;
+	// read barrier, like lispCar.
+	if(m->incremental.active && lispIsGray(m, off))
+		return lispCopy(m, m->mem.ref[off]);
+	return m->mem.ref[off];
 }
 
-static LispRef
-lispPush(LispMachine *m, LispRef val)
+// store val as element i of the vector, returns -1 if it is out of range.
+int
+lispVectorSet(LispMachine *m, LispRef vec, size_t i, LispRef val)
 {
-	m->stack = lispCons(m, val, m->stack);
+	if(!lispIsVector(m, vec) || i >= lispVectorLength(m, vec))
+		return -1;
+	size_t off = urefval(vec) + 2 + i;
+	// the barriers of lispSetCar, on the pair the element is in.
+	if(m->incremental.active && lispIsGray(m, off))
+		lispScanCell(m, off & ~(size_t)1);
+	if(off < m->nursery.oldlen)
+		lispRemember(m, off, val);
+	m->mem.ref[off] = val;
+	return 0;
 }
 
-static LispRef
-lispPeek(LispMachine *m)
+/*
+ *	Unlike symbols, strings live on the heap and are collected like anything
+ *	else. A string is a block like a vector: LISP_BUILTIN_STRING, the length
+ *	in bytes, and the bytes, LISP_STRING_BYTES of them to a fixnum, the
+ *	first in the low bits. The collectors take its size from the length,
+ *	see lispBlockSize.
+ */
+static size_t
+lispStringWords(size_t len)
 {
-	LispRef val = lispCar(m, m->stack);
-	return val;
+	return (len + LISP_STRING_BYTES-1) / LISP_STRING_BYTES;
 }
 
-static LispRef
-lispPop(LispMachine *m)
+LispRef
+lispString(LispMachine *m, char *buf, size_t len)
 {
-	LispRef val = lispPeek(m);
-	m->stack = lispCdr(m, m->stack);
-	return val;
+	size_t words = lispStringWords(len);
+	LispRef ref = lispAllocate(m, lispVectorSize(words));
+	LispRef *p = m->mem.ref + urefval(ref);
+	p[LISP_CAR_OFFSET] = lispBuiltin(m, LISP_BUILTIN_STRING);
+	p[LISP_CDR_OFFSET] = lispNumber(m, len);
+	for(size_t k = 0; k < words; k++){
+		LispInt word = 0;
+		for(size_t j = LISP_STRING_BYTES; j-- > 0;)
+			if(k*LISP_STRING_BYTES + j < len)
+				word = word<<8 | (unsigned char)buf[k*LISP_STRING_BYTES + j];
+			else
+				word <<= 8;
+		p[2 + k] = lispNumber(m, word);
+	}
+	return ref;
 }
 
-static void
-lispGoto(LispMachine *m, int inst)
+size_t
+lispStringLength(LispMachine *m, LispRef str)
 {
-	m->inst = lispBuiltin(m, inst);
+	if(!lispIsString(m, str)){
+		fprintf(stderr, "lispStringLength: not a string\n");
+		abort();
+	}
+	return lispGetInt(m, m->mem.ref[urefval(str) + LISP_CDR_OFFSET]);
 }
 
-void
-lispCall(LispMachine *m, int ret, int inst)
+// byte i of the string, which has to be in range. the words are fixnums
+// that the collectors don't change, so there is no read barrier.
+static unsigned char
+lispStringByte(LispMachine *m, LispRef str, size_t i)
 {
-	lispPush(m, m->envr);
-	lispPush(m, lispBuiltin(m, ret));
-	lispGoto(m, inst);
+	LispRef word = m->mem.ref[urefval(str) + 2 + i/LISP_STRING_BYTES];
+	return lispGetInt(m, word) >> 8*(i % LISP_STRING_BYTES);
 }
 
-static void
-lispReturn(LispMachine *m)
+// copy up to cap bytes of the string to buf, return the length of the string.
+size_t
+lispGetString(LispMachine *m, LispRef str, char *buf, size_t cap)
 {
-	m->inst = lispPop(m);
-	m->envr = lispPop(m);
-	m->expr = LISP_NIL;
+	size_t len = lispStringLength(m, str);
+	for(size_t i = 0; i < len && i < cap; i++)
+		buf[i] = lispStringByte(m, str, i);
+	return len;
 }
 
-void
-lispDefine(LispMachine *m, LispRef sym, LispRef val)
+// compare strings bytewise, returns -1, 0 or 1.
+static int
+lispStringCompare(LispMachine *m, LispRef a, LispRef b)
 {
-	LispRef *pair = lispRegister(m, lispCons(m, sym, val));
-	LispRef *env = lispRegister(m, lispCdr(m, m->envr));
-	*env = lispCons(m, *pair, *env);
-	lispSetCdr(m, m->envr, *env);
-	lispRelease(m, pair);
-	lispRelease(m, env);
+	size_t alen = lispStringLength(m, a), blen = lispStringLength(m, b);
+	for(size_t i = 0; i < alen && i < blen; i++){
+		unsigned char x = lispStringByte(m, a, i), y = lispStringByte(m, b, i);
+		if(x != y)
+			return x < y ? -1 : 1;
+	}
+	return (alen > blen) - (alen < blen);
 }
 
-static int
-lispApplyIf(LispMachine *m)
+/*
+ *	Bignums are the integers that don't fit a fixnum. A bignum is a block
+ *	like a vector: LISP_BUILTIN_BIGNUM, the number of digits, negated for
+ *	a negative bignum, and the digits, fixnums of LISP_BIGNUM_BITS bits,
+ *	the least significant first. The collectors take its size from the
+ *	count, see lispBlockSize. The arithmetic unpacks them to a LispBig, and
+ *	packs the result back, into a fixnum whenever it fits.
+ */
+typedef struct LispBig LispBig;
+struct LispBig {
+	uint32_t *d;
+	size_t len, cap;
+	int neg;
+};
+
+#define LISP_BIGNUM_BASE ((uint32_t)1 << LISP_BIGNUM_BITS)
+
+// make room for len digits, the new ones zero.
+static void
+lispBigGrow(LispBig *b, size_t len)
 {
-	switch(lispGetBuiltin(m, m->inst)){
-	default:
-		abort();
-	case LISP_STATE_IF0:
-		// (if cond then else)
-		lispPush(m, m->expr);
-		// evaluate condition recursively, return to IF1.
-		m->expr = lispCar(m, lispCdr(m, m->expr));
-		lispCall(m, LISP_STATE_IF1, LISP_STATE_EVAL);
-		return 0;
-	case LISP_STATE_IF1:
-		// evaluate result as a tail-call, if condition
-		// evaluated to #f, skip over 'then' to 'else'.
-		m->expr = lispPop(m);
-		if(lispIsExtRef(m, m->value)){
-			// escape if condition is extref,
-			// if may still be a symbol in expr, so resolve it.
-			m->expr = lispCons(m, lispBuiltin(m, LISP_BUILTIN_IF), lispCdr(m, m->expr));
-			lispGoto(m, LISP_STATE_CONTINUE);
-			return 1;
-		} else {
-			LispRef tmp = lispCdr(m, m->expr);// 'if' -> 'cond'
-			tmp = lispCdr(m, tmp); // 'cond' -> 'then'
-			if(m->value == lispBuiltin(m, LISP_BUILTIN_FALSE))
-				tmp = lispCdr(m, tmp); // 'then' -> 'else'
-			m->expr = lispCar(m, tmp);
-			lispGoto(m, LISP_STATE_EVAL);
-			return 0;
+	if(len > b->cap){
+		size_t cap = b->cap == 0 ? 8 : b->cap;
+		while(cap < len)
+			cap *= 2;
+		uint32_t *d = realloc(b->d, cap * sizeof d[0]);
+		if(d == NULL){
+			fprintf(stderr, "lispBigGrow: out of memory\n");
+			abort();
 		}
+		b->d = d;
+		b->cap = cap;
 	}
+	for(size_t i = b->len; i < len; i++)
+		b->d[i] = 0;
+	b->len = len;
 }
 
-static int
-lispApplyLet(LispMachine *m)
+static void
+lispBigTrim(LispBig *b)
 {
-	switch(lispGetBuiltin(m, m->inst)){
-	default:
-		abort();
-	case LISP_STATE_LET0:{
-			// (let sym val) -> args,
-			// current environment gets sym associated with val.
-			LispRef *sym = lispRegister(m, lispCdr(m, m->expr));
-			LispRef *val = lispRegister(m, lispCdr(m, *sym));
-			*sym = lispCar(m, *sym);
-			if(lispIsPair(m, *sym)){
-				// scheme shorthand: (let (name args...) body1 body2...).
-				LispRef *tmp = lispRegister(m, lispCons(m, lispCdr(m, *sym), *val));
-				*val = lispCons(m, lispBuiltin(m, LISP_BUILTIN_LAMBDA), *tmp);
-				lispRelease(m, tmp);
-				*sym = lispCar(m, *sym);
-			} else {
-				*val = lispCar(m, *val);
-			}
-			lispPush(m, *sym);
-			m->expr = *val;
-			lispRelease(m, sym);
-			lispRelease(m, val);
-			lispCall(m, LISP_STATE_LET1, LISP_STATE_EVAL);
-		}
-		return 0;
-	case LISP_STATE_LET1:{
-			// restore sym from stack, construct (sym . val)
-			LispRef *sym = lispRegister(m, lispPop(m));
-			*sym = lispCons(m, *sym, m->value);
-			// push new (sym . val) just below current env head.
-			LispRef *env = lispRegister(m, lispCdr(m, m->envr));
-			*env = lispCons(m, *sym, *env);
-			lispSetCdr(m, m->envr, *env);
-			lispRelease(m, env);
-			lispRelease(m, sym);
-			lispReturn(m);
+	while(b->len > 0 && b->d[b->len-1] == 0)
+		b->len--;
+}
+
+// b = b*mul + add.
+static void
+lispBigMulAdd(LispBig *b, uint32_t mul, uint32_t add)
+{
+	uint64_t carry = add;
+	for(size_t i = 0; i < b->len; i++){
+		carry += (uint64_t)b->d[i] * mul;
+		b->d[i] = carry % LISP_BIGNUM_BASE;
+		carry /= LISP_BIGNUM_BASE;
+	}
+	while(carry > 0){
+		lispBigGrow(b, b->len+1);
+		b->d[b->len-1] = carry % LISP_BIGNUM_BASE;
+		carry /= LISP_BIGNUM_BASE;
+	}
+}
+
+// b = b/div, returns the remainder.
+static uint32_t
+lispBigDivSmall(LispBig *b, uint32_t div)
+{
+	uint64_t rem = 0;
+	for(size_t i = b->len; i-- > 0;){
+		rem = rem * LISP_BIGNUM_BASE + b->d[i];
+		b->d[i] = rem / div;
+		rem %= div;
+	}
+	lispBigTrim(b);
+	return rem;
+}
+
+// b = v.
+static void
+lispBigSet(LispBig *b, uint64_t v)
+{
+	*b = (LispBig){0};
+	for(; v > 0; v /= LISP_BIGNUM_BASE){
+		lispBigGrow(b, b->len+1);
+		b->d[b->len-1] = v % LISP_BIGNUM_BASE;
+	}
+}
+
+// unpack the fixnum or bignum num.
+static void
+lispBigGet(LispMachine *m, LispRef num, LispBig *b)
+{
+	*b = (LispBig){0};
+	if(lispIsNumber(m, num)){
+		LispInt v = lispGetInt(m, num);
+		lispBigSet(b, v < 0 ? -(uint64_t)v : (uint64_t)v);
+		b->neg = v < 0;
+		return;
+	}
+	// the digits are fixnums the collectors don't change, so there is no
+	// read barrier.
+	LispRef *p = m->mem.ref + urefval(num);
+	LispInt len = lispGetInt(m, p[LISP_CDR_OFFSET]);
+	b->neg = len < 0;
+	lispBigGrow(b, b->neg ? -len : len);
+	for(size_t i = 0; i < b->len; i++)
+		b->d[i] = lispGetInt(m, p[2 + i]);
+}
+
+// pack b and free its digits.
+static LispRef
+lispBigRef(LispMachine *m, LispBig *b)
+{
+	LispRef ref;
+	lispBigTrim(b);
+	if(b->len == 0)
+		b->neg = 0;
+	if(b->len * LISP_BIGNUM_BITS <= 8*sizeof(uint64_t)){
+		uint64_t v = 0;
+		for(size_t i = b->len; i-- > 0;)
+			v = v * LISP_BIGNUM_BASE + b->d[i];
+		// the fixnums go one further below zero than above it.
+		if(v <= (uint64_t)LISP_FIXNUM_MAX + b->neg){
+			LispInt s = v - b->neg;
+			free(b->d);
+			return lispNumber(m, b->neg ? -s-1 : s);
 		}
-		return 0;
 	}
+	ref = lispAllocate(m, lispVectorSize(b->len));
+	LispRef *p = m->mem.ref + urefval(ref);
+	p[LISP_CAR_OFFSET] = lispBuiltin(m, LISP_BUILTIN_BIGNUM);
+	p[LISP_CDR_OFFSET] = lispNumber(m, b->neg ? -(LispInt)b->len : (LispInt)b->len);
+	for(size_t i = 0; i < b->len; i++)
+		p[2 + i] = lispNumber(m, b->d[i]);
+	free(b->d);
+	return ref;
+}
 
+// the integer v, a bignum if it doesn't fit a fixnum.
+static LispRef
+lispBigNumber(LispMachine *m, uint64_t v)
+{
+	LispBig b;
+	lispBigSet(&b, v);
+	return lispBigRef(m, &b);
 }
 
+// compare the magnitudes of a and b, returns -1, 0 or 1.
 static int
-lispApplySet(LispMachine *m)
+lispBigCompareAbs(LispBig *a, LispBig *b)
 {
-	switch(lispGetBuiltin(m, m->inst)){
-	default:
-		abort();
-	case LISP_STATE_SET0:{
-			// (set! sym val) -> args,
-			// current environment gets sym associated with val.
-			LispRef *sym = lispRegister(m, lispCdr(m, m->expr));
-			LispRef *val = lispRegister(m, lispCdr(m, *sym));
-			*sym = lispCar(m, *sym);
-			if(lispIsPair(m, *sym)){
-				// setter for our object system: (set! ('field obj) value).
-				// since set is a special form, we must explicitly evaluate
-				// the list elements (but not call apply)
-				lispPush(m, *val);
-				// set expr to ('field obj) and eval the list (no apply)
-				m->expr = *sym;
-				lispRelease(m, sym);
-				lispRelease(m, val);
-				lispCall(m, LISP_STATE_SET1, LISP_STATE_EVAL_ARGS0);
-				return 0;
-			} else {
-				*val = lispCar(m, *val);
-				lispPush(m, *sym);
-				m->expr = *val;
-				lispRelease(m, sym);
-				lispRelease(m, val);
-				lispCall(m, LISP_STATE_SET2, LISP_STATE_EVAL);
-				return 0;
-			}
-		}
-		abort();
-	case LISP_STATE_SET1:{
-			LispRef *val = lispRegister(m, lispPop(m));
-			LispRef *sym = lispRegister(m, m->value);
-			*val = lispCar(m, *val);
-			lispPush(m, *sym);
-			m->expr = *val;
-			lispRelease(m, sym);
-			lispRelease(m, val);
-			lispCall(m, LISP_STATE_SET2, LISP_STATE_EVAL);
-			return 0;
+	if(a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+	for(size_t i = a->len; i-- > 0;)
+		if(a->d[i] != b->d[i])
+			return a->d[i] < b->d[i] ? -1 : 1;
+	return 0;
+}
+
+// r = |a| + |b|.
+static void
+lispBigAddAbs(LispBig *r, LispBig *a, LispBig *b)
+{
+	size_t len = a->len > b->len ? a->len : b->len;
+	uint32_t carry = 0;
+	lispBigGrow(r, len+1);
+	for(size_t i = 0; i < len; i++){
+		carry += (i < a->len ? a->d[i] : 0) + (i < b->len ? b->d[i] : 0);
+		r->d[i] = carry % LISP_BIGNUM_BASE;
+		carry /= LISP_BIGNUM_BASE;
+	}
+	r->d[len] = carry;
+	lispBigTrim(r);
+}
+
+// r = |a| - |b|, where |a| >= |b|.
+static void
+lispBigSubAbs(LispBig *r, LispBig *a, LispBig *b)
+{
+	uint32_t borrow = 0;
+	lispBigGrow(r, a->len);
+	for(size_t i = 0; i < a->len; i++){
+		uint32_t sub = (i < b->len ? b->d[i] : 0) + borrow;
+		borrow = a->d[i] < sub;
+		r->d[i] = a->d[i] + (borrow ? LISP_BIGNUM_BASE : 0) - sub;
+	}
+	lispBigTrim(r);
+}
+
+// r = |a| * |b|.
+static void
+lispBigMulAbs(LispBig *r, LispBig *a, LispBig *b)
+{
+	lispBigGrow(r, a->len + b->len);
+	for(size_t i = 0; i < a->len; i++){
+		uint64_t carry = 0;
+		for(size_t j = 0; j < b->len; j++){
+			carry += r->d[i+j] + (uint64_t)a->d[i] * b->d[j];
+			r->d[i+j] = carry % LISP_BIGNUM_BASE;
+			carry /= LISP_BIGNUM_BASE;
 		}
-	case LISP_STATE_SET2:{
-			// restore sym from stack, construct (sym . val)
-			LispRef *symp = lispRegister(m, lispPop(m));
-			LispRef envr;
-			if(lispIsPair(m, *symp)){
+		r->d[i + b->len] = carry;
+	}
+	lispBigTrim(r);
+}
 
-				LispRef function = lispCar(m, lispCdr(m, *symp));
-				if(lispIsExtRef(m, function)){
-					// it's (10 buf) form, ie. buffer indexing
-					// assemble a form (set! (10 buf) value) and call/ext
-					m->expr = lispCons(m, m->value, LISP_NIL);
-					m->expr = lispCons(m, *symp, m->expr);
-					m->expr = lispCons(m, lispBuiltin(m, LISP_BUILTIN_SET), m->expr);
-					lispRelease(m, symp);
-					lispGoto(m, LISP_STATE_CONTINUE);
-					return 1;
-				}
-				LispRef functionHead = lispCar(m, function);
-				if(lispIsBuiltin(m, functionHead, LISP_BUILTIN_FUNCTION)){
-					// it's (set! ('sym function) ...) form, ie. member access.
-					// -> search sym in envr scoped in function
-					envr = lispCdr(m, lispCdr(m, function));
-					*symp = lispCar(m, *symp);
-				} else {
-					// else it's unsupported form
-					fprintf(stderr, "set!: unsupported form in first argument\n");
-					m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
-					lispRelease(m, symp);
-					lispReturn(m);
-					return 0;
-				}
-			} else {
-				// (set! sym ...) -> search sym in active envr.
-				envr = m->envr;
-			}
-			m->expr = envr;
-			lispPush(m, m->value);
-			lispPush(m, *symp);
-			lispRelease(m, symp);
-			lispCall(m, LISP_STATE_SET3, LISP_STATE_SYM_LOOKUP0);
-			return 0;
+// r = |a| / |b|, where b isn't zero. long division a bit at a time, or a
+// digit at a time for divisors of one digit.
+static void
+lispBigDivAbs(LispBig *r, LispBig *a, LispBig *b)
+{
+	LispBig rem = {0};
+	lispBigGrow(r, a->len);
+	if(b->len == 1){
+		memcpy(r->d, a->d, a->len * sizeof r->d[0]);
+		lispBigDivSmall(r, b->d[0]);
+		return;
+	}
+	for(size_t i = a->len * LISP_BIGNUM_BITS; i-- > 0;){
+		lispBigMulAdd(&rem, 2, (a->d[i / LISP_BIGNUM_BITS] >> i % LISP_BIGNUM_BITS) & 1);
+		if(lispBigCompareAbs(&rem, b) >= 0){
+			lispBigSubAbs(&rem, &rem, b);
+			r->d[i / LISP_BIGNUM_BITS] |= (uint32_t)1 << i % LISP_BIGNUM_BITS;
 		}
-	case LISP_STATE_SET3:{
-			LispRef sym = lispPop(m);
-			LispRef value = lispPop(m);
-			LispRef pair = m->value;
-			if(pair != LISP_NIL)
-				lispSetCdr(m, pair, value);
-			else
-				fprintf(stderr, "set!: undefined symbol %s\n", (char *)lispStringPointer(m, sym));
-			m->value = LISP_NIL;
-			lispReturn(m);
-			return 0;
+	}
+	free(rem.d);
+	lispBigTrim(r);
+}
+
+// the integer of the digits in str, like strtoll with base 0 but of any
+// size. nil if str has anything but a sign and digits of its base.
+static LispRef
+lispBigParse(LispMachine *m, char *str)
+{
+	LispBig b = {0};
+	uint32_t base = 10;
+	int neg = str[0] == '-';
+	if(str[0] == '-' || str[0] == '+')
+		str++;
+	if(str[0] == '0' && (str[1] == 'x' || str[1] == 'X') && str[2] != '\0'){
+		base = 16;
+		str += 2;
+	} else if(str[0] == '0'){
+		base = 8;
+	}
+	for(; *str != '\0'; str++){
+		uint32_t digit = isDecimal(*str) && *str != 'x' ? *str - '0' : isHexadecimal(*str) ? *str - 'a' + 10 : base;
+		if(digit >= base){
+			free(b.d);
+			return LISP_NIL;
 		}
+		lispBigMulAdd(&b, base, digit);
 	}
-	abort();
+	b.neg = neg;
+	return lispBigRef(m, &b);
 }
 
+// compare the integers a and b, returns -1, 0 or 1.
 static int
-lispApplyBuiltin(LispMachine *m)
+lispBigCompare(LispMachine *m, LispRef a, LispRef b)
 {
-	LispRef blt = lispGetBuiltin(m, lispCar(m, m->expr));
-	if(blt - LISP_BUILTIN_ADD <= LISP_BUILTIN_DIV - LISP_BUILTIN_ADD){
-		LispRef ref0, ref;
-		int ires;
-		int nterms;
-		ref = lispCdr(m, m->expr);
-		ref0 = lispCar(m, ref);
-		if(lispIsNumber(m, ref0)){
-			ires = lispGetInt(m, ref0);
-		} else if(lispIsExtRef(m, ref0)){
-			// arithmetic on external object, escape.
-			lispGoto(m, LISP_STATE_CONTINUE);
-			return 1;
-		} else {
-			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
-			lispReturn(m);
-			return 0;
-		}
-		m->expr = lispCdr(m, ref);
-		nterms = 0;
-		while(m->expr != LISP_NIL){
-			nterms++;
-			ref = lispCar(m, m->expr);
-			if(lispIsNumber(m, ref)){
-				long long tmp = lispGetInt(m, ref);
-				switch(blt){
-				case LISP_BUILTIN_ADD:
-					ires += tmp;
-					break;
-				case LISP_BUILTIN_SUB:
-					ires -= tmp;
-					break;
-				case LISP_BUILTIN_MUL:
-					ires *= tmp;
-					break;
-				case LISP_BUILTIN_DIV:
-					ires /= tmp;
-					break;
+	LispBig x, y;
+	lispBigGet(m, a, &x);
+	lispBigGet(m, b, &y);
+	int cmp = x.neg != y.neg ? (x.neg ? -1 : 1) : x.neg ? lispBigCompareAbs(&y, &x) : lispBigCompareAbs(&x, &y);
+	free(x.d);
+	free(y.d);
+	return cmp;
+}
+
+static double
+lispBigFloat(LispMachine *m, LispRef num)
+{
+	LispBig b;
+	double v = 0;
+	lispBigGet(m, num, &b);
+	for(size_t i = b.len; i-- > 0;)
+		v = v * LISP_BIGNUM_BASE + b.d[i];
+	free(b.d);
+	return b.neg ? -v : v;
+}
+
+// the bignum num in decimal, in a string to free.
+static char *
+lispBigString(LispMachine *m, LispRef num)
+{
+	LispBig b;
+	lispBigGet(m, num, &b);
+	// every digit makes at most five decimal ones.
+	size_t i = 5 * b.len + 2;
+	char *buf = malloc(i + 1);
+	if(buf == NULL){
+		fprintf(stderr, "lispBigString: out of memory\n");
+		abort();
+	}
+	buf[i] = '\0';
+	do {
+		buf[--i] = '0' + lispBigDivSmall(&b, 10);
+	} while(b.len > 0);
+	if(b.neg)
+		buf[--i] = '-';
+	memmove(buf, buf + i, strlen(buf + i) + 1);
+	free(b.d);
+	return buf;
+}
+
+// a op b for the arithmetic builtin blt, in floats.
+static double
+lispFloatOp(int blt, double a, double b)
+{
+	switch(blt){
+	case LISP_BUILTIN_ADD:
+		return a + b;
+	case LISP_BUILTIN_SUB:
+		return a - b;
+	case LISP_BUILTIN_MUL:
+		return a * b;
+	default:
+		return a / b;
+	}
+}
+
+/*
+ *	a blt b for the arithmetic builtin blt and numbers of any kind, the slow
+ *	path of lispApplyBuiltin: fixnums that overflow go on as bignums, and
+ *	floats make the result a float. Gives #error for anything else and for
+ *	division by zero.
+ */
+static LispRef
+lispArith(LispMachine *m, int blt, LispRef a, LispRef b)
+{
+	LispBig x, y, r = {0};
+	if(!lispIsReal(m, a) || !lispIsReal(m, b))
+		return lispBuiltin(m, LISP_BUILTIN_ERROR);
+	if(lispIsFloat(m, a) || lispIsFloat(m, b))
+		return lispFloat(m, lispFloatOp(blt, lispGetFloat(m, a), lispGetFloat(m, b)));
+	lispBigGet(m, a, &x);
+	lispBigGet(m, b, &y);
+	switch(blt){
+	case LISP_BUILTIN_SUB:
+		y.neg = !y.neg;
+		// fall through
+	case LISP_BUILTIN_ADD:
+		if(x.neg == y.neg){
+			lispBigAddAbs(&r, &x, &y);
+			r.neg = x.neg;
+		} else if(lispBigCompareAbs(&x, &y) >= 0){
+			lispBigSubAbs(&r, &x, &y);
+			r.neg = x.neg;
+		} else {
+			lispBigSubAbs(&r, &y, &x);
+			r.neg = y.neg;
+		}
+		break;
+	case LISP_BUILTIN_MUL:
+		lispBigMulAbs(&r, &x, &y);
+		r.neg = x.neg != y.neg;
+		break;
+	case LISP_BUILTIN_DIV:
+		if(y.len == 0){
+			free(x.d);
+			free(y.d);
+			return lispBuiltin(m, LISP_BUILTIN_ERROR);
+		}
+		lispBigDivAbs(&r, &x, &y);
+		r.neg = x.neg != y.neg;
+		break;
+	}
+	free(x.d);
+	free(y.d);
+	return lispBigRef(m, &r);
+}
+
+LispRef
+lispParse(LispMachine *m, int justone)
+{
+	LispRef list = LISP_NIL, prev = LISP_NIL, cons, nval;
+	int ltok;
+	int dot = 0;
+
+m->gclock++;
+	while((ltok = lispLex(m)) != -1){
+		tokenAppend(m, '\0');
+		switch(ltok){
+		default:
+			//fprintf(stderr, "unknown token %d: '%c' '%s'\n", ltok, ltok, m->tok);
+			list = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			goto done;
+		case ')':
+			goto done;
+		case '(':
+			nval = lispParse(m, 0);
+			goto append;
+		case '\'':
+			nval = lispParse(m, 1);
+			nval = lispCons(m, lispBuiltin(m, LISP_BUILTIN_QUOTE), lispCons(m, nval, LISP_NIL));
+			goto append;
+		case '.':
+			dot++;
+			break;
+		case ',':
+			//fprintf(stderr, "TODO: backquote not implemented yet\n");
+			list = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			goto done;
+		case LISP_TOK_INTEGER:
+			nval = lispBigParse(m, m->token.buf);
+			// what only starts like a number, as 1x2, is a symbol.
+			if(nval == LISP_NIL)
+				goto casesym;
+			goto append;
+		case LISP_TOK_FLOAT:{
+			// token.len counts the terminating nul.
+			char *end;
+			double v = strtod(m->token.buf, &end);
+			if(end != m->token.buf + m->token.len-1)
+				goto casesym;
+			nval = lispFloat(m, v);
+			goto append;
+		}
+		case LISP_TOK_STRING:
+			// token.len counts the terminating nul.
+			nval = lispString(m, m->token.buf, m->token.len-1);
+			goto append;
+		case LISP_TOK_SYMBOL:
+		casesym:
+			nval = lispSymbol(m, m->token.buf);
+		append:
+			if(justone){
+				list = nval;
+				goto done;
+			}
+			if(dot == 0){
+				cons = lispCons(m, nval, LISP_NIL);
+				if(prev != LISP_NIL)
+					lispSetCdr(m, prev, cons);
+				else
+					list = cons;
+				prev = cons;
+			} else if(dot == 1){
+				if(prev != LISP_NIL){
+					lispSetCdr(m, prev, nval);
+					dot++;
+				} else {
+					//fprintf(stderr, "malformed s-expression, bad use of '.'\n");
+					list = lispBuiltin(m, LISP_BUILTIN_ERROR);
+					goto done;
 				}
 			} else {
-				m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
-				lispReturn(m);
-				return 0;
+				//fprintf(stderr, "malformed s-expression, bad use of '.'\n");
+				list = lispBuiltin(m, LISP_BUILTIN_ERROR);
+				goto done;
 			}
-			m->expr = lispCdr(m, m->expr);
+			break;
 		}
-		// special case for unary sub: make it a negate.
-		if(blt == LISP_BUILTIN_SUB && nterms == 0)
-			ires = -ires;
-		m->value = lispNumber(m, ires);
-		lispReturn(m);
-		return 0;
-	} else if(blt == LISP_BUILTIN_ISPAIR){ // (pair? ...)
-		m->expr = lispCdr(m, m->expr);
-		m->expr = lispCar(m, m->expr);
-		if(lispIsPair(m, m->expr))
-			m->value =  lispBuiltin(m, LISP_BUILTIN_TRUE);
+	}
+	if(justone && ltok == -1)
+		list = lispBuiltin(m, LISP_BUILTIN_ERROR);
+done:
+m->gclock--;
+	return list;
+}
+
+static int
+lispWrite(LispMachine *m, LispPort port, unsigned char *buf, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+		if(m->ports[port].writebyte(buf[i], m->ports[port].context) == -1)
+			return i == 0 ? -1 : (int)i;
+	return len;
+}
+
+static int
+lispRead(LispMachine *m, LispPort port)
+{
+	return m->ports[port].readbyte(m->ports[port].context);
+}
+
+// the fewest digits of v that read back as v, with a fraction to read back
+// as a float.
+static void
+lispFloatString(char *buf, size_t len, double v)
+{
+	for(int prec = 1; prec <= 17; prec++){
+		snprintf(buf, len, "%.*g", prec, v);
+		if(strtod(buf, NULL) == v)
+			break;
+	}
+	// %g also goes to an exponent when the number has fewer digits than
+	// places before the point, as in 1e+02.
+	char *e = strchr(buf, 'e');
+	if(e != NULL && atoi(e+1) >= 0 && atoi(e+1) < 17)
+		snprintf(buf, len, "%.0f", v);
+	if(strspn(buf, "-0123456789") == strlen(buf))
+		strcat(buf, ".0");
+}
+
+int
+lispPrint1(LispMachine *m, LispRef aref, LispPort port)
+{
+	char buf[128];
+	int tag = reftag(aref);
+	switch(tag){
+	default:
+		snprintf(buf, sizeof buf, "print1: unknown atom: val:%zx tag:%x\n", refval(aref), reftag(aref));
+		break;
+	case LISP_TAG_BUILTIN:
+		if(refval(aref) >= 0 && refval(aref) < LISP_NUM_BUILTINS)
+			snprintf(buf, sizeof buf, "%s", bltnames[refval(aref)]);
 		else
-			m->value =  lispBuiltin(m, LISP_BUILTIN_FALSE);
-		lispReturn(m);
-		return 0;
-	} else if(blt == LISP_BUILTIN_ISEQUAL){ // (equal? ...)
-		LispRef args = lispCdr(m, m->expr);
-		LispRef arg0 = lispCar(m, args);
-		args = lispCdr(m, args);
-		LispRef arg = lispCar(m, args);
-		if(lispIsExtRef(m, arg0) || lispIsExtRef(m, arg)){
-			lispGoto(m, LISP_STATE_CONTINUE);
-			return 1;
-		} else if(reftag(arg0) != reftag(arg)){
-			m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
-			goto eqdone;
-		} else if(lispIsNumber(m, arg0) && lispIsNumber(m, arg)){
-			if(lispGetInt(m, arg0) != lispGetInt(m, arg)){
-				m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
-				goto eqdone;
+			snprintf(buf, sizeof buf, "blt-0x%zx", refval(aref));
+		break;
+	case LISP_TAG_EXTREF:
+		snprintf(buf, sizeof buf, "extref(#%zx)", refval(aref));
+		break;
+	case LISP_TAG_PAIR:
+		if(aref == LISP_NIL){
+			snprintf(buf, sizeof buf, "()");
+		} else if(lispIsString(m, aref)){
+			size_t len = lispStringLength(m, aref);
+			for(size_t i = 0; i < len; i++){
+				unsigned char byte = lispStringByte(m, aref, i);
+				lispWrite(m, port, &byte, 1);
 			}
-		} else if(lispIsList(m, arg0) && lispIsList(m, arg)){
-			if(arg0 != arg){
-				m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
-				goto eqdone;
+			return tag;
+		} else if(lispIsBignum(m, aref)){
+			char *str = lispBigString(m, aref);
+			lispWrite(m, port, (unsigned char *)str, strlen(str));
+			free(str);
+			return tag;
+		} else if(lispIsFloat(m, aref)){
+			lispFloatString(buf, sizeof buf, lispGetFloat(m, aref));
+		} else if(lispIsVector(m, aref)){
+			// #(e0 e1 ...), with the elements printed like print1 would.
+			size_t len = lispVectorLength(m, aref);
+			lispWrite(m, port, (unsigned char *)"#(", 2);
+			for(size_t i = 0; i < len; i++){
+				if(i > 0)
+					lispWrite(m, port, (unsigned char *)" ", 1);
+				lispPrint1(m, lispVectorRef(m, aref, i), port);
 			}
+			lispWrite(m, port, (unsigned char *)")", 1);
+			return tag;
+		} else
+			snprintf(buf, sizeof buf, "cons(#x%llx)", (unsigned long long)aref);
+		break;
+	case LISP_TAG_INTEGER:
+		snprintf(buf, sizeof buf, "%lld", (long long)lispGetInt(m, aref));
+		break;
+	case LISP_TAG_FLOAT:
+		lispFloatString(buf, sizeof buf, lispGetFloat(m, aref));
+		break;
+	case LISP_TAG_SYMBOL:{
+			unsigned sym = urefval(aref);
+			if(sym < LISP_INLINE_SYMBOL)
+				snprintf(buf, sizeof buf, "%lc", sym);
+			else
+				snprintf(buf, sizeof buf, "%s", lispStringPointer(m, aref));
+			break;
+		}
+	}
+	lispWrite(m, port, (unsigned char *)buf, strlen(buf));
+	return tag;
+}
+
+static void
+lispGrowStack(LispMachine *m, size_t len)
+{
+	size_t cap = m->stack.cap == 0 ? LISP_STACK_MIN : m->stack.cap;
+	while(cap < len)
+		cap *= 2;
+	void *p = realloc(m->stack.p, cap * sizeof m->stack.p[0]);
+	if(p == NULL){
+		fprintf(stderr, "lispPush: out of memory\n");
+		abort();
+	}
+	m->stack.p = p;
+	m->stack.cap = cap;
+}
+
+static void
+lispPush(LispMachine *m, LispRef val)
+{
+	if(m->stack.len == m->stack.cap)
+		lispGrowStack(m, m->stack.len+1);
+	m->stack.p[m->stack.len++] = val;
+}
+
+static LispRef
+lispPeek(LispMachine *m)
+{
+	if(m->stack.len == 0){
+		fprintf(stderr, "lispPeek: stack underflow\n");
+		abort();
+	}
+	return m->stack.p[m->stack.len-1];
+}
+
+static LispRef
+lispPop(LispMachine *m)
+{
+	LispRef val = lispPeek(m);
+	m->stack.len--;
+	return val;
+}
+
+/*
+ *	A continuation is (continue . stack), the call stack copied to a list
+ *	with the top first. The stack holds no cells that get updated in place:
+ *	state that a resumed continuation shares with the frames it was taken
+ *	from, like the body of BETA3, is kept in a cell the stack points to.
+ */
+static LispRef
+lispCaptureStack(LispMachine *m)
+{
+	LispRef *list = lispRegister(m, LISP_NIL);
+	for(size_t i = 0; i < m->stack.len; i++)
+		*list = lispCons(m, m->stack.p[i], *list);
+	LispRef cont = lispCons(m, lispBuiltin(m, LISP_BUILTIN_CONTINUE), *list);
+	lispRelease(m, list);
+	return cont;
+}
+
+static void
+lispRestoreStack(LispMachine *m, LispRef list)
+{
+	size_t len = 0;
+	for(LispRef ref = list; ref != LISP_NIL; ref = lispCdr(m, ref))
+		len++;
+	if(len > m->stack.cap)
+		lispGrowStack(m, len);
+	m->stack.len = len;
+	for(LispRef ref = list; ref != LISP_NIL; ref = lispCdr(m, ref))
+		m->stack.p[--len] = lispCar(m, ref);
+}
+
+static void
+lispGoto(LispMachine *m, int inst)
+{
+	m->inst = lispBuiltin(m, inst);
+}
+
+void
+lispCall(LispMachine *m, int ret, int inst)
+{
+	lispPush(m, m->envr);
+	lispPush(m, lispBuiltin(m, ret));
+	lispGoto(m, inst);
+}
+
+static void
+lispReturn(LispMachine *m)
+{
+	m->inst = lispPop(m);
+	m->envr = lispPop(m);
+	m->expr = LISP_NIL;
+}
+
+/*
+ *	The top-level frame grows with every definition, so it is indexed by a
+ *	hash table from symbols to the pairs binding them. Symbols don't move,
+ *	the pairs are roots. A lookup that gets to the head of the top-level
+ *	frame finishes in the table.
+ */
+static size_t
+lispGlobalSlot(LispMachine *m, LispRef sym)
+{
+	size_t mask = m->globals.cap - 1;
+	size_t i = ((uint32_t)sym * 2654435761u >> 12) & mask;
+	while(m->globals.sym[i] != LISP_NIL && m->globals.sym[i] != sym)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static LispRef
+lispGlobalLookup(LispMachine *m, LispRef sym)
+{
+	if(m->globals.cap == 0)
+		return LISP_NIL;
+	size_t i = lispGlobalSlot(m, sym);
+	return m->globals.sym[i] == LISP_NIL ? LISP_NIL : m->globals.cell[i];
+}
+
+static void
+lispGlobalInsert(LispMachine *m, LispRef sym, LispRef pair)
+{
+	if(4*(m->globals.len+1) > 3*m->globals.cap){
+		LispRef *syms = m->globals.sym;
+		LispRef *cells = m->globals.cell;
+		size_t oldcap = m->globals.cap;
+		size_t cap = oldcap == 0 ? 256 : 2*oldcap;
+		m->globals.sym = malloc(cap * sizeof m->globals.sym[0]);
+		m->globals.cell = malloc(cap * sizeof m->globals.cell[0]);
+		if(m->globals.sym == NULL || m->globals.cell == NULL){
+			fprintf(stderr, "lispGlobalInsert: malloc failed\n");
+			abort();
+		}
+		lispMemSet(m->globals.sym, LISP_NIL, cap);
+		m->globals.cap = cap;
+		for(size_t i = 0; i < oldcap; i++){
+			if(syms[i] != LISP_NIL){
+				size_t j = lispGlobalSlot(m, syms[i]);
+				m->globals.sym[j] = syms[i];
+				m->globals.cell[j] = cells[i];
+			}
+		}
+		free(syms);
+		free(cells);
+	}
+	size_t i = lispGlobalSlot(m, sym);
+	if(m->globals.sym[i] == LISP_NIL)
+		m->globals.len++;
+	m->globals.sym[i] = sym;
+	m->globals.cell[i] = pair;
+}
+
+// index the top-level frame under head from scratch.
+static void
+lispIndexGlobals(LispMachine *m, LispRef head)
+{
+	m->globals.head = head;
+	for(LispRef env = lispCdr(m, head); env != LISP_NIL; env = lispCdr(m, env)){
+		LispRef pair = lispCar(m, env);
+		if(lispIsPair(m, pair) && lispGlobalLookup(m, lispCar(m, pair)) == LISP_NIL)
+			lispGlobalInsert(m, lispCar(m, pair), pair);
+	}
+	m->globals.epoch++;
+}
+
+/*
+ *	Put the binding (sym . val) in pair just below the head of the current
+ *	environment, like let does. Shadowing a global anywhere invalidates the
+ *	cached lookups of globals.
+ */
+static void
+lispBind(LispMachine *m, LispRef pair)
+{
+	LispRef *pairp = lispRegister(m, pair);
+	LispRef *env = lispRegister(m, lispCdr(m, m->envr));
+	*env = lispCons(m, *pairp, *env);
+	lispSetCdr(m, m->envr, *env);
+	LispRef sym = lispCar(m, *pairp);
+	if(lispGlobalLookup(m, sym) != LISP_NIL)
+		m->globals.epoch++;
+	if(m->envr == m->globals.head)
+		lispGlobalInsert(m, sym, *pairp);
+	lispRelease(m, pairp);
+	lispRelease(m, env);
+}
+
+void
+lispDefine(LispMachine *m, LispRef sym, LispRef val)
+{
+	lispBind(m, lispCons(m, sym, val));
+}
+
+static int
+lispApplyIf(LispMachine *m)
+{
+	switch(lispGetBuiltin(m, m->inst)){
+	default:
+		abort();
+	case LISP_STATE_IF0:
+		// (if cond then else)
+		lispPush(m, m->expr);
+		// evaluate condition recursively, return to IF1.
+		m->expr = lispCar(m, lispCdr(m, m->expr));
+		lispCall(m, LISP_STATE_IF1, LISP_STATE_EVAL);
+		return 0;
+	case LISP_STATE_IF1:
+		// evaluate result as a tail-call, if condition
+		// evaluated to #f, skip over 'then' to 'else'.
+		m->expr = lispPop(m);
+		if(lispIsExtRef(m, m->value)){
+			// escape if condition is extref,
+			// if may still be a symbol in expr, so resolve it.
+			m->expr = lispCons(m, lispBuiltin(m, LISP_BUILTIN_IF), lispCdr(m, m->expr));
+			lispGoto(m, LISP_STATE_CONTINUE);
+			return 1;
+		} else {
+			LispRef tmp = lispCdr(m, m->expr);// 'if' -> 'cond'
+			tmp = lispCdr(m, tmp); // 'cond' -> 'then'
+			if(m->value == lispBuiltin(m, LISP_BUILTIN_FALSE))
+				tmp = lispCdr(m, tmp); // 'then' -> 'else'
+			m->expr = lispCar(m, tmp);
+			lispGoto(m, LISP_STATE_EVAL);
+			return 0;
+		}
+	}
+}
+
+static int
+lispApplyLet(LispMachine *m)
+{
+	switch(lispGetBuiltin(m, m->inst)){
+	default:
+		abort();
+	case LISP_STATE_LET0:{
+			// (let sym val) -> args,
+			// current environment gets sym associated with val.
+			LispRef *sym = lispRegister(m, lispCdr(m, m->expr));
+			LispRef *val = lispRegister(m, lispCdr(m, *sym));
+			*sym = lispCar(m, *sym);
+			if(lispIsPair(m, *sym)){
+				// scheme shorthand: (let (name args...) body1 body2...).
+				LispRef *tmp = lispRegister(m, lispCons(m, lispCdr(m, *sym), *val));
+				*val = lispCons(m, lispBuiltin(m, LISP_BUILTIN_LAMBDA), *tmp);
+				lispRelease(m, tmp);
+				*sym = lispCar(m, *sym);
+			} else {
+				*val = lispCar(m, *val);
+			}
+			lispPush(m, *sym);
+			m->expr = *val;
+			lispRelease(m, sym);
+			lispRelease(m, val);
+			lispCall(m, LISP_STATE_LET1, LISP_STATE_EVAL);
+		}
+		return 0;
+	case LISP_STATE_LET1:{
+			// restore sym from stack, construct (sym . val)
+			LispRef sym = lispPop(m);
+			// push new (sym . val) just below current env head.
+			lispBind(m, lispCons(m, sym, m->value));
+			lispReturn(m);
+		}
+		return 0;
+	}
+
+}
+
+static int
+lispApplySet(LispMachine *m)
+{
+	switch(lispGetBuiltin(m, m->inst)){
+	default:
+		abort();
+	case LISP_STATE_SET0:{
+			// (set! sym val) -> args,
+			// current environment gets sym associated with val.
+			LispRef *sym = lispRegister(m, lispCdr(m, m->expr));
+			LispRef *val = lispRegister(m, lispCdr(m, *sym));
+			*sym = lispCar(m, *sym);
+			if(lispIsPair(m, *sym)){
+				// setter for our object system: (set! ('field obj) value).
+				// since set is a special form, we must explicitly evaluate
+				// the list elements (but not call apply)
+				lispPush(m, *val);
+				// set expr to ('field obj) and eval the list (no apply)
+				m->expr = *sym;
+				lispRelease(m, sym);
+				lispRelease(m, val);
+				lispCall(m, LISP_STATE_SET1, LISP_STATE_EVAL_ARGS0);
+				return 0;
+			} else {
+				*val = lispCar(m, *val);
+				lispPush(m, *sym);
+				m->expr = *val;
+				lispRelease(m, sym);
+				lispRelease(m, val);
+				lispCall(m, LISP_STATE_SET2, LISP_STATE_EVAL);
+				return 0;
+			}
+		}
+		abort();
+	case LISP_STATE_SET1:{
+			LispRef *val = lispRegister(m, lispPop(m));
+			LispRef *sym = lispRegister(m, m->value);
+			*val = lispCar(m, *val);
+			lispPush(m, *sym);
+			m->expr = *val;
+			lispRelease(m, sym);
+			lispRelease(m, val);
+			lispCall(m, LISP_STATE_SET2, LISP_STATE_EVAL);
+			return 0;
+		}
+	case LISP_STATE_SET2:{
+			// restore sym from stack, construct (sym . val)
+			LispRef *symp = lispRegister(m, lispPop(m));
+			LispRef envr;
+			if(lispIsPair(m, *symp)){
+
+				LispRef function = lispCar(m, lispCdr(m, *symp));
+				if(lispIsExtRef(m, function)){
+					// it's (10 buf) form, ie. buffer indexing
+					// assemble a form (set! (10 buf) value) and call/ext
+					m->expr = lispCons(m, m->value, LISP_NIL);
+					m->expr = lispCons(m, *symp, m->expr);
+					m->expr = lispCons(m, lispBuiltin(m, LISP_BUILTIN_SET), m->expr);
+					lispRelease(m, symp);
+					lispGoto(m, LISP_STATE_CONTINUE);
+					return 1;
+				}
+				if(lispIsVector(m, function)){
+					// it's (set! (3 vec) value), ie. vector indexing.
+					LispRef index = lispCar(m, *symp);
+					if(!lispIsNumber(m, index) || lispVectorSet(m, function, lispGetInt(m, index), m->value) == -1){
+						fprintf(stderr, "set!: vector index out of range\n");
+						m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+					} else
+						m->value = LISP_NIL;
+					lispRelease(m, symp);
+					lispReturn(m);
+					return 0;
+				}
+				LispRef functionHead = lispCar(m, function);
+				if(lispIsBuiltin(m, functionHead, LISP_BUILTIN_FUNCTION)){
+					// it's (set! ('sym function) ...) form, ie. member access.
+					// -> search sym in envr scoped in function
+					envr = lispCdr(m, lispCdr(m, function));
+					*symp = lispCar(m, *symp);
+				} else {
+					// else it's unsupported form
+					fprintf(stderr, "set!: unsupported form in first argument\n");
+					m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+					lispRelease(m, symp);
+					lispReturn(m);
+					return 0;
+				}
+			} else {
+				// (set! sym ...) -> search sym in active envr.
+				envr = m->envr;
+			}
+			m->expr = envr;
+			lispPush(m, m->value);
+			lispPush(m, *symp);
+			lispRelease(m, symp);
+			lispCall(m, LISP_STATE_SET3, LISP_STATE_SYM_LOOKUP0);
+			return 0;
+		}
+	case LISP_STATE_SET3:{
+			LispRef sym = lispPop(m);
+			LispRef value = lispPop(m);
+			LispRef pair = m->value;
+			if(pair != LISP_NIL)
+				lispSetCdr(m, pair, value);
+			else
+				fprintf(stderr, "set!: undefined symbol %s\n", (char *)lispStringPointer(m, sym));
+			m->value = LISP_NIL;
+			lispReturn(m);
+			return 0;
+		}
+	}
+	abort();
+}
+
+/*
+ *	Apply the builtin in the evaluated form at m->expr. Returns 0 with the
+ *	result in m->value, 1 for an extref escape, or 2 if the builtin went on
+ *	to evaluate something (eval, call/cc).
+ */
+static int
+lispApplyBuiltin(LispMachine *m)
+{
+	LispRef blt = lispGetBuiltin(m, lispCar(m, m->expr));
+	switch(blt){
+	case LISP_BUILTIN_ADD:
+	case LISP_BUILTIN_SUB:
+	case LISP_BUILTIN_MUL:
+	case LISP_BUILTIN_DIV:{
+		LispRef ref0, ref, *acc;
+		LispInt ires = 0, tmp;
+		double fres = 0;
+		int nterms, isfloat = 0, over;
+		ref = lispCdr(m, m->expr);
+		if(ref == LISP_NIL){
+			// (+) and (*) are their identities, (-) and (/) have none.
+			if(blt == LISP_BUILTIN_ADD || blt == LISP_BUILTIN_MUL){
+				m->value = lispNumber(m, blt == LISP_BUILTIN_MUL);
+			} else {
+				fprintf(stderr, "%s: needs an argument\n", blt == LISP_BUILTIN_SUB ? "-" : "/");
+				m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			}
+			return 0;
+		}
+		ref0 = lispCar(m, ref);
+		nterms = 0;
+		if(lispIsNumber(m, ref0)){
+			ires = lispGetInt(m, ref0);
+		} else if(lispIsFloat(m, ref0)){
+			fres = lispGetFloat(m, ref0);
+			isfloat = 1;
+		} else if(lispIsBignum(m, ref0)){
+			m->expr = lispCdr(m, ref);
+			goto bignum;
+		} else if(lispIsExtRef(m, ref0)){
+			// arithmetic on external object, escape.
+			lispGoto(m, LISP_STATE_CONTINUE);
+			return 1;
+		} else {
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		m->expr = lispCdr(m, ref);
+		while(m->expr != LISP_NIL){
+			ref = lispCar(m, m->expr);
+			if(!isfloat && lispIsFloat(m, ref)){
+				// the rest is in floats.
+				fres = ires;
+				isfloat = 1;
+			}
+			if(isfloat && lispIsReal(m, ref)){
+				fres = lispFloatOp(blt, fres, lispGetFloat(m, ref));
+			} else if(lispIsNumber(m, ref)){
+				// fixnums, until the result isn't one.
+				tmp = lispGetInt(m, ref);
+				switch(blt){
+				case LISP_BUILTIN_ADD:
+					over = __builtin_add_overflow(ires, tmp, &tmp);
+					break;
+				case LISP_BUILTIN_SUB:
+					over = __builtin_sub_overflow(ires, tmp, &tmp);
+					break;
+				case LISP_BUILTIN_MUL:
+					over = __builtin_mul_overflow(ires, tmp, &tmp);
+					break;
+				default:
+					if(tmp == 0){
+						m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+						return 0;
+					}
+					tmp = ires / tmp;
+					over = 0;
+					break;
+				}
+				if(over || tmp < LISP_FIXNUM_MIN || tmp > LISP_FIXNUM_MAX){
+					ref0 = lispNumber(m, ires);
+					goto bignum;
+				}
+				ires = tmp;
+			} else if(lispIsBignum(m, ref)){
+				ref0 = lispNumber(m, ires);
+				goto bignum;
+			} else {
+				m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+				return 0;
+			}
+			nterms++;
+			m->expr = lispCdr(m, m->expr);
+		}
+		// special case for unary sub: make it a negate.
+		if(blt == LISP_BUILTIN_SUB && nterms == 0){
+			if(!isfloat && ires == LISP_FIXNUM_MIN){
+				ref0 = lispNumber(m, ires);
+				goto bignum;
+			}
+			ires = -ires;
+			fres = -fres;
+		}
+		m->value = isfloat ? lispFloat(m, fres) : lispNumber(m, ires);
+		return 0;
+	bignum:
+		// the rest of the terms from ref0 on, through lispArith.
+		acc = lispRegister(m, ref0);
+		if(blt == LISP_BUILTIN_SUB && nterms == 0 && m->expr == LISP_NIL)
+			*acc = lispArith(m, blt, lispNumber(m, 0), *acc);
+		for(; m->expr != LISP_NIL && !lispIsError(m, *acc); m->expr = lispCdr(m, m->expr))
+			*acc = lispArith(m, blt, *acc, lispCar(m, m->expr));
+		m->value = *acc;
+		lispRelease(m, acc);
+		return 0;
+	}
+	case LISP_BUILTIN_ISPAIR:{ // (pair? ...)
+		m->expr = lispCdr(m, m->expr);
+		m->expr = lispCar(m, m->expr);
+		if(lispIsCons(m, m->expr))
+			m->value =  lispBuiltin(m, LISP_BUILTIN_TRUE);
+		else
+			m->value =  lispBuiltin(m, LISP_BUILTIN_FALSE);
+		return 0;
+	}
+	case LISP_BUILTIN_ISEQUAL:{ // (equal? ...)
+		LispRef args = lispCdr(m, m->expr);
+		LispRef arg0 = lispCar(m, args);
+		args = lispCdr(m, args);
+		LispRef arg = lispCar(m, args);
+		if(lispIsExtRef(m, arg0) || lispIsExtRef(m, arg)){
+			lispGoto(m, LISP_STATE_CONTINUE);
+			return 1;
+		} else if(reftag(arg0) != reftag(arg)){
+			m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
+			goto eqdone;
+		} else if(lispIsNumber(m, arg0) && lispIsNumber(m, arg)){
+			if(lispGetInt(m, arg0) != lispGetInt(m, arg)){
+				m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
+				goto eqdone;
+			}
+		} else if(lispIsFloat(m, arg0) || lispIsFloat(m, arg)){
+			// by value, so 0.0 is -0.0, and a nan is nothing.
+			if(!lispIsFloat(m, arg0) || !lispIsFloat(m, arg) || lispGetFloat(m, arg0) != lispGetFloat(m, arg)){
+				m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
+				goto eqdone;
+			}
+		} else if(lispIsBignum(m, arg0) || lispIsBignum(m, arg)){
+			if(!lispIsBignum(m, arg0) || !lispIsBignum(m, arg) || lispBigCompare(m, arg0, arg) != 0){
+				m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
+				goto eqdone;
+			}
+		} else if(lispIsString(m, arg0) || lispIsString(m, arg)){
+			if(!lispIsString(m, arg0) || !lispIsString(m, arg) || lispStringCompare(m, arg0, arg) != 0){
+				m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
+				goto eqdone;
+			}
+		} else if(lispIsList(m, arg0) && lispIsList(m, arg)){
+			if(arg0 != arg){
+				m->value = lispBuiltin(m, LISP_BUILTIN_FALSE);
+				goto eqdone;
+			}
+		} else {
+			fprintf(stderr, "equal?: unsupported types %d %d\n", reftag(arg0), reftag(arg));
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
+	eqdone:
+		return 0;
+	}
+	case LISP_BUILTIN_ISLESS:{
+		LispRef args = lispCdr(m, m->expr);
+		LispRef arg0 = lispCar(m, args);
+		args = lispCdr(m, args);
+		LispRef arg1 = lispCar(m, args);
+		m->value = lispBuiltin(m, LISP_BUILTIN_FALSE); // default to false.
+		if(lispIsExtRef(m, arg0) || lispIsExtRef(m, arg1)){
+			lispGoto(m, LISP_STATE_CONTINUE);
+			return 1;
+		} else if(lispIsNumber(m, arg0) && lispIsNumber(m, arg1)){
+			if(lispGetInt(m, arg0) < lispGetInt(m, arg1))
+				m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
+		} else if(!lispIsFloat(m, arg0) && !lispIsFloat(m, arg1) && lispIsReal(m, arg0) && lispIsReal(m, arg1)){
+			if(lispBigCompare(m, arg0, arg1) < 0)
+				m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
+		} else if(lispIsReal(m, arg0) && lispIsReal(m, arg1)){
+			if(lispGetFloat(m, arg0) < lispGetFloat(m, arg1))
+				m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
+		} else if(lispIsSymbol(m, arg0) && lispIsSymbol(m, arg1)){
+			if(strcmp(lispStringPointer(m, arg0), lispStringPointer(m, arg1)) < 0)
+				m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
+		} else if(lispIsString(m, arg0) && lispIsString(m, arg1)){
+			if(lispStringCompare(m, arg0, arg1) < 0)
+				m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
+		} else {
+			fprintf(stderr, "less?: unsupported types\n");
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		return 0;
+	}
+	case LISP_BUILTIN_ISERROR:{ // (error? ...)
+		m->expr = lispCdr(m, m->expr);
+		m->expr = lispCar(m, m->expr);
+		if(lispIsError(m, m->expr))
+			m->value =  lispBuiltin(m, LISP_BUILTIN_TRUE);
+		else
+			m->value =  lispBuiltin(m, LISP_BUILTIN_FALSE);
+		return 0;
+	}
+	case LISP_BUILTIN_SETCAR:
+	case LISP_BUILTIN_SETCDR:{
+		LispRef *cons = lispRegister(m, lispCdr(m, m->expr));
+		LispRef *val = lispRegister(m, lispCdr(m, *cons));
+		*cons = lispCar(m, *cons); // cons
+		*val = lispCar(m, *val); // val
+		if(!lispIsCons(m, *cons)){
+			// the first cell of a string or a number is its header.
+			fprintf(stderr, "%s: not a pair\n", bltnames[blt]);
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+		} else if(blt == LISP_BUILTIN_SETCAR)
+			lispSetCar(m, *cons, *val);
+		else
+			lispSetCdr(m, *cons, *val);
+		lispRelease(m, cons);
+		lispRelease(m, val);
+		return 0;
+	}
+	case LISP_BUILTIN_GCSTATS:{
+		// counters that don't fit a fixnum are bignums.
+		LispStats st;
+		lispGetStats(m, &st);
+		struct {
+			char *name;
+			uint64_t val;
+		} fields[] = {
+			{ "collections", st.collections },
+			{ "minor-collections", st.minors },
+			{ "pauses", st.pauses },
+			{ "pause-ns", st.pausens },
+			{ "max-pause-ns", st.maxpausens },
+			{ "copied-bytes", st.copied },
+			{ "allocated-cells", st.allocated },
+			{ "heap-grows", st.grows },
+			{ "steps", st.steps },
+			{ "heap-bytes", st.heapbytes },
+			{ "extrefs", st.extrefs },
+			{ "string-bytes", st.strings },
+		};
+		LispRef *list = lispRegister(m, LISP_NIL);
+		LispRef *val = lispRegister(m, LISP_NIL);
+		for(size_t i = sizeof fields / sizeof fields[0]; i-- > 0;){
+			*val = lispBigNumber(m, fields[i].val);
+			LispRef pair = lispCons(m, lispSymbol(m, fields[i].name), *val);
+			*list = lispCons(m, pair, *list);
+		}
+		m->value = *list;
+		lispRelease(m, val);
+		lispRelease(m, list);
+		return 0;
+	}
+	case LISP_BUILTIN_CAR:{
+		LispRef tmp = lispCdr(m, m->expr); // ('car thing.. -> (thing..
+		tmp = lispCar(m, tmp); // (thing.. -> thing
+		if(!lispIsCons(m, tmp))
+			goto notpair;
+		m->value = lispCar(m, tmp); // (car thing)
+		return 0;
+	}
+	case LISP_BUILTIN_CDR:{
+		LispRef tmp = lispCdr(m, m->expr);
+		tmp = lispCar(m, tmp);
+		if(!lispIsCons(m, tmp))
+			goto notpair;
+		m->value = lispCdr(m, tmp);
+		return 0;
+	}
+	notpair:
+		fprintf(stderr, "%s: not a pair\n", bltnames[blt]);
+		m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+		return 0;
+	case LISP_BUILTIN_MAKEVECTOR:{
+		// (make-vector len) or (make-vector len fill)
+		LispRef args = lispCdr(m, m->expr);
+		LispRef len = lispCar(m, args);
+		LispRef fill = lispCdr(m, args) != LISP_NIL ? lispCar(m, lispCdr(m, args)) : LISP_NIL;
+		if(!lispIsNumber(m, len) || lispGetInt(m, len) < 0){
+			fprintf(stderr, "make-vector: the length is not a number\n");
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		m->value = lispVector(m, lispGetInt(m, len), fill);
+		return 0;
+	}
+	case LISP_BUILTIN_VECTORREF:
+	case LISP_BUILTIN_VECTORSET:{
+		// (vector-ref vec i), (vector-set! vec i val)
+		LispRef args = lispCdr(m, m->expr);
+		LispRef vec = lispCar(m, args);
+		args = lispCdr(m, args);
+		LispRef i = lispCar(m, args);
+		if(!lispIsVector(m, vec) || !lispIsNumber(m, i) || (size_t)lispGetInt(m, i) >= lispVectorLength(m, vec)){
+			fprintf(stderr, "%s: index out of range or not a vector\n", bltnames[blt]);
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		if(blt == LISP_BUILTIN_VECTORREF){
+			m->value = lispVectorRef(m, vec, lispGetInt(m, i));
+		} else {
+			m->value = lispCar(m, lispCdr(m, args));
+			lispVectorSet(m, vec, lispGetInt(m, i), m->value);
+		}
+		return 0;
+	}
+	case LISP_BUILTIN_VECTORLENGTH:{
+		LispRef vec = lispCar(m, lispCdr(m, m->expr));
+		if(!lispIsVector(m, vec)){
+			fprintf(stderr, "vector-length: not a vector\n");
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		m->value = lispNumber(m, lispVectorLength(m, vec));
+		return 0;
+	}
+	case LISP_BUILTIN_STRINGLENGTH:{
+		LispRef str = lispCar(m, lispCdr(m, m->expr));
+		if(!lispIsString(m, str)){
+			fprintf(stderr, "string-length: not a string\n");
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		m->value = lispNumber(m, lispStringLength(m, str));
+		return 0;
+	}
+	case LISP_BUILTIN_STRINGREF:{
+		// (string-ref str i), the byte at i.
+		LispRef args = lispCdr(m, m->expr);
+		LispRef str = lispCar(m, args);
+		LispRef i = lispCar(m, lispCdr(m, args));
+		if(!lispIsString(m, str) || !lispIsNumber(m, i) || (size_t)lispGetInt(m, i) >= lispStringLength(m, str)){
+			fprintf(stderr, "string-ref: index out of range or not a string\n");
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			return 0;
+		}
+		m->value = lispNumber(m, lispStringByte(m, str, lispGetInt(m, i)));
+		return 0;
+	}
+	case LISP_BUILTIN_CONS:{
+		LispRef tmp0 = lispCdr(m, m->expr);
+		LispRef tmp1 = lispCdr(m, tmp0);
+		tmp0 = lispCar(m, tmp0);
+		tmp1 = lispCar(m, tmp1);
+		m->value = lispCons(m, tmp0, tmp1);
+		return 0;
+	}
+	case LISP_BUILTIN_CALLCC:{
+		m->expr = lispCdr(m, m->expr);
+		LispRef *tmp0 = lispRegister(m, lispCaptureStack(m));
+		LispRef *tmp1 = lispRegister(m, lispCons(m, *tmp0, LISP_NIL));
+		m->expr = lispCons(m, lispCar(m, m->expr), *tmp1);
+		lispRelease(m, tmp0);
+		lispRelease(m, tmp1);
+		lispGoto(m, LISP_STATE_EVAL);
+		return 2;
+	}
+	case LISP_BUILTIN_PRINT1:{
+		LispRef rest = lispCdr(m, m->expr);
+		LispRef port = lispCar(m, rest);
+		rest = lispCdr(m, rest);
+		m->value = lispCar(m, rest);
+		if(lispIsExtRef(m, m->value)){
+			// escape extref printing
+			lispGoto(m, LISP_STATE_CONTINUE);
+			return 1;
+		}
+		lispPrint1(m, m->value, lispGetInt(m, port));
+		return 0;
+	}
+	case LISP_BUILTIN_EVAL:{
+		m->expr = lispCar(m, lispCdr(m, m->expr)); // expr = cdar expr
+		lispGoto(m, LISP_STATE_EVAL);
+		return 2;
+	}
+	}
+	fprintf(stderr, "apply: builtin is not a function\n");
+	m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+	return 0;
+}
+
+// the extref type of native functions, see lispNative. the functions
+// themselves can't go to heap images, they read as #error after
+// lispLoadImage.
+static LispExtType lispNativeType = {"native", NULL};
+
+// apply the native function in the evaluated form at m->expr, if it is one.
+static int
+lispApplyNative(LispMachine *m)
+{
+	LispNative *native;
+	void *type;
+	lispExtGet(m, lispCar(m, m->expr), (void **)&native, &type);
+	if(type != &lispNativeType)
+		return -1;
+	m->value = native->fn(m, lispCdr(m, m->expr));
+	return 0;
+}
+
+static int
+lispApplySymLookup(LispMachine *m)
+{
+	switch(lispGetBuiltin(m, m->inst)){
+	default:
+		abort();
+	case LISP_STATE_SYM_LOOKUP0:
+		if(m->expr == m->globals.head){
+			// the rest is in the index.
+			LispRef sym = m->stack.p[m->stack.len-3];
+			m->value = lispGlobalLookup(m, sym);
+			if(m->value == LISP_NIL)
+				m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+			lispReturn(m);
+			return 0;
+		} else if(m->expr == LISP_NIL){
+			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR); // not found
+			lispReturn(m);
+			return 0;
+		} else {
+			LispRef envr = m->expr;
+			// the symbol is below the return frame.
+			LispRef sym = m->stack.p[m->stack.len-3];
+			LispRef pair = lispCar(m, envr);
+			if(lispIsPair(m, pair)){
+				LispRef key = lispCar(m, pair);
+				if(key == sym){
+					m->value = pair;
+					lispReturn(m);
+					return 0;
+				}
+			}
+			envr = lispCdr(m, envr);
+			m->expr = envr;
+			return 0;
+		}
+	}
+}
+
+static int
+lispEvalArgs(LispMachine *m)
+{
+	switch(lispGetBuiltin(m, m->inst)){
+	default:
+		abort();
+	case LISP_STATE_EVAL_ARGS0:{
+			// construct evaluation state: (expr . (expr-cell . value-cell))
+			LispRef *state = lispRegister(m, lispCons(m, LISP_NIL, LISP_NIL));
+			// push the first (expr-cell . value-cell) pair
+			// cdr of this holds the return value once entire list is evaluated.
+			lispPush(m, *state);
+			*state = lispCons(m, m->expr, *state);
+			lispPush(m, *state);
+			lispRelease(m, state);
+			lispGoto(m, LISP_STATE_EVAL_ARGS1);
+			return 0;
+		}
+	case LISP_STATE_EVAL_ARGS1:{
+			// load top of stack to state.
+			LispRef *state = lispRegister(m, lispPeek(m));
+			// store latest m->value to value-cell.
+			lispSetCar(m, lispCdr(m, *state), m->value);
+			// load expr-cell to register
+			LispRef *exprCell = lispRegister(m, lispCar(m, *state)); // expr-cell = car(state)
+			if(lispIsPair(m, *exprCell)){
+				lispRelease(m, state);
+				lispRelease(m, exprCell);
+				lispGoto(m, LISP_STATE_EVAL_ARGS3);
+				return 0;
+			}
+			// this following bit is non-standard, it allows one to call a function
+			// with the notation (fn . args) or (fn arg1 arg2 . rest), effectively
+			// splicing a list 'args' in to the argument list, analogous to how
+			// varargs are declared in standard scheme functions. by allowing the
+			// dotted notation for apply, there is no need an apply built-in.
+			// unfortunately, of course the dotted tail must not be a literal list,
+			// so defining apply as a function is still going to be necessary.
+			if(*exprCell != LISP_NIL){
+				m->expr = *exprCell;
+				lispSetCar(m, *state, LISP_NIL);
+				lispRelease(m, state);
+				lispRelease(m, exprCell);
+				lispCall(m, LISP_STATE_EVAL_ARGS2, LISP_STATE_EVAL);
+				return 0;
+			}
+
+			// arg list evaluation is done
+			assert(*exprCell == LISP_NIL);
+			lispRelease(m, state);
+			lispRelease(m, exprCell);
+			lispPop(m);
+			m->value = lispCdr(m, lispPop(m));
+			lispReturn(m);
+			return 0;
+		}
+	case LISP_STATE_EVAL_ARGS3:{
+			// exprcell is a pair (a list)
+			LispRef *state = lispRegister(m, lispPeek(m));
+			LispRef *exprCell = lispRegister(m, lispCar(m, *state)); // expr-cell = car(state)
+			// load new expr from expr-cell and set expr-cell to next expr.
+			m->expr = lispCar(m, *exprCell); // expr = (car expr-cell)
+			*exprCell = lispCdr(m, *exprCell); // expr-cell = (cdr expr-cell)
+			lispSetCar(m, *state, *exprCell); //  car(state) = (cdr expr-cell)
+
+			// allocate new value-cell, link cdr of current value-cell to it and set value-cell to the new one.
+			LispRef *valueCell = lispRegister(m, lispCons(m, LISP_NIL, LISP_NIL));
+			*exprCell = lispCdr(m, *state);
+			lispSetCdr(m, *exprCell, *valueCell);
+			lispSetCdr(m, *state, *valueCell);
+
+			// release registers
+			lispRelease(m, state);
+			lispRelease(m, exprCell);
+			lispRelease(m, valueCell);
+			// call "apply" on the current expr and have it return to ARGS1
+			// state.
+			lispCall(m, LISP_STATE_EVAL_ARGS1, LISP_STATE_EVAL);
+			return 0;
+		}
+	case LISP_STATE_EVAL_ARGS2:{
+			// load top of stack to state.
+			LispRef *state = lispRegister(m, lispPeek(m));
+			// store new m->value to the rest of value chain.
+			// vast majority of time m->value is nil, except for the
+			// non-standard arg splicing situation from above.
+			lispSetCdr(m, lispCdr(m, *state), m->value);
+			lispRelease(m, state);
+			// pop evaluation state
+			lispPop(m);
+			// pop the head and return its value-cell.
+			m->value = lispCdr(m, lispPop(m));
+			lispReturn(m);
+		}
+	}
+}
+
+/*
+ *	Lambda bodies get compiled the first time they are applied. Compiled code
+ *	is a list of instructions, each one an opcode and an argument:
+ *	(op arg op arg ...). Code is built back to front, so an instruction
+ *	is consed onto the code that runs after it, and the two branches of an
+ *	if share the code following the if as their tail. The value being
+ *	computed is kept in m->value, and arguments are pushed on m->stack.
+ *
+ *	Calls out of compiled code use ordinary lispCall frames that return to
+ *	LISP_STATE_VM_RETURN, with the activation and the code of the caller
+ *	to continue at pushed below, so call/cc and the extref escapes work
+ *	across compiled code like they do in the interpreter. The code in the
+ *	frame is the exact resume point, so a continuation comes back to the
+ *	middle of a form however often it is resumed. Only the progress
+ *	through the body is shared: like the body cell of BETA3, the
+ *	activation in m->act, (form . code), counts the forms of the body that
+ *	have been started and holds the code of the next one, and LISP_OP_SEQ
+ *	between two forms goes on where the activation is. Forms the compiler
+ *	doesn't handle are left to the interpreter with LISP_OP_EVAL.
+ *
+ *	The head and the arguments of a call are pushed on the stack, and
+ *	applying a function turns them into its frame in place: the function
+ *	becomes the environment it closed over, and each argument the
+ *	(sym . value) pair binding its parameter, in the order of the parameter
+ *	list. The pairs are the ones in the environment, which closures, set!
+ *	and the ('x obj) accessors keep using, so a slot and the environment
+ *	always agree. References to a parameter compile to LISP_OP_LOCAL with
+ *	its distance from the top of the stack, which the compiler knows from
+ *	the number of values pushed for the calls around it. A parameter that
+ *	the body may define again with let is looked up by name.
+ *
+ *	Any other symbol compiles to LISP_OP_GLOBAL, which caches the binding
+ *	it finds in the top-level frame, along with the closed over environment
+ *	it was found from and the epoch of the global index. The cache holds
+ *	as long as both match: a let that could shadow the global bumps the
+ *	epoch, and set! changes the value in the cached pair itself.
+ *
+ *	The lexical addressing stops at the frame of the lambda itself: a free
+ *	variable that an enclosing lambda binds also goes through
+ *	LISP_OP_GLOBAL, finds its pair by name, and isn't cached. Its place in
+ *	the environment isn't known when the lambda is compiled. The closures
+ *	of one lambda share its code, and the environments they captured have
+ *	whatever pairs the lets their creators ran on the way added in front.
+ *	Addressing those by (depth, index) would need frames the lets can't
+ *	grow, which the environment as a list of pairs doesn't have.
+ *
+ *	Special forms are recognized when the lambda is compiled, by looking up
+ *	the head symbol in the environment of the function being applied,
+ *	unless the lambda binds the symbol itself. A head that only turns out to
+ *	be a special form when it is evaluated is caught by LISP_OP_HEAD.
+ */
+static LispRef
+lispAssq(LispMachine *m, LispRef envr, LispRef sym)
+{
+	if(!m->incremental.active){
+		// no read barrier to honour, walk the cells directly.
+		LispRef *mem = m->mem.ref;
+		while(envr != LISP_NIL){
+			if(envr == m->globals.head)
+				return lispGlobalLookup(m, sym);
+			LispRef pair = mem[tagval(envr, LISP_TAG_PAIR) + LISP_CAR_OFFSET];
+			if(hastag(pair, LISP_TAG_PAIR) && pair != LISP_NIL && mem[tagval(pair, LISP_TAG_PAIR) + LISP_CAR_OFFSET] == sym)
+				return pair;
+			envr = mem[tagval(envr, LISP_TAG_PAIR) + LISP_CDR_OFFSET];
+		}
+		return LISP_NIL;
+	}
+	while(envr != LISP_NIL){
+		if(envr == m->globals.head)
+			return lispGlobalLookup(m, sym);
+		LispRef pair = lispCar(m, envr);
+		if(lispIsPair(m, pair) && lispCar(m, pair) == sym)
+			return pair;
+		envr = lispCdr(m, envr);
+	}
+	return LISP_NIL;
+}
+
+static int
+lispIsSpecial(LispMachine *m, LispRef ref)
+{
+	if(!lispIsBuiltinTag(m, ref))
+		return 0;
+	switch(lispGetBuiltin(m, ref)){
+	case LISP_BUILTIN_IF:
+	case LISP_BUILTIN_FUNCTION:
+	case LISP_BUILTIN_CONTINUE:
+	case LISP_BUILTIN_LET:
+	case LISP_BUILTIN_SET:
+	case LISP_BUILTIN_SCOPE:
+	case LISP_BUILTIN_LAMBDA:
+	case LISP_BUILTIN_QUOTE:
+		return 1;
+	}
+	return 0;
+}
+
+// the nth element of list, or LISP_NIL if the list is shorter.
+static LispRef
+lispNth(LispMachine *m, LispRef list, size_t n)
+{
+	for(; n > 0 && lispIsPair(m, list); n--)
+		list = lispCdr(m, list);
+	return lispIsPair(m, list) ? lispCar(m, list) : LISP_NIL;
+}
+
+// number of elements in list, or -1 if it is not a proper list.
+static long
+lispLength(LispMachine *m, LispRef list)
+{
+	long n = 0;
+	for(; lispIsPair(m, list); list = lispCdr(m, list))
+		n++;
+	return list == LISP_NIL ? n : -1;
+}
+
+// does body have a (let sym ...) or (let (sym ...) ...) anywhere in it.
+static int
+lispDefines(LispMachine *m, LispRef body, LispRef sym, LispRef letsym)
+{
+	for(; lispIsPair(m, body); body = lispCdr(m, body)){
+		LispRef form = lispCar(m, body);
+		if(!lispIsPair(m, form))
+			continue;
+		LispRef head = lispCar(m, form);
+		if((head == letsym || lispIsBuiltin(m, head, LISP_BUILTIN_LET)) && lispIsPair(m, lispCdr(m, form))){
+			LispRef name = lispCar(m, lispCdr(m, form));
+			if(lispIsPair(m, name))
+				name = lispCar(m, name);
+			if(name == sym)
+				return 1;
+		}
+		if(lispDefines(m, form, sym, letsym))
+			return 1;
+	}
+	return 0;
+}
+
+// does lambda bind sym itself, as a parameter or with a let in its body.
+static int
+lispBindsSym(LispMachine *m, LispRef sym, LispRef lambda)
+{
+	LispRef names = lispCdr(m, lambda);
+	if(lispIsPair(m, names))
+		names = lispCar(m, names);
+	for(; lispIsPair(m, names); names = lispCdr(m, names))
+		if(lispCar(m, names) == sym)
+			return 1;
+	if(names == sym)
+		return 1;
+	return lispDefines(m, lispCdr(m, lispCdr(m, lambda)), sym, lispSymbol(m, bltnames[LISP_BUILTIN_LET]));
+}
+
+// the special form builtin the head of a form in lambda stands for, or -1.
+static int
+lispSpecialForm(LispMachine *m, LispRef head, LispRef lambda, LispRef cenv)
+{
+	if(lispIsSymbol(m, head)){
+		if(lispBindsSym(m, head, lambda))
+			return -1;
+		LispRef pair = lispAssq(m, cenv, head);
+		if(pair == LISP_NIL)
+			return -1;
+		head = lispCdr(m, pair);
+	}
+	return lispIsSpecial(m, head) ? lispGetBuiltin(m, head) : -1;
+}
+
+// number of parameters of lambda, counting a rest parameter.
+static long
+lispFrameSize(LispMachine *m, LispRef lambda)
+{
+	long n = 0;
+	LispRef names = lispCdr(m, lambda);
+	if(lispIsPair(m, names))
+		names = lispCar(m, names);
+	for(; lispIsPair(m, names); names = lispCdr(m, names))
+		n++;
+	return names != LISP_NIL ? n+1 : n;
+}
+
+// the distance from the top of the frame of the slot of sym, or 0 if it
+// has to be looked up by name.
+static long
+lispLocalSlot(LispMachine *m, LispRef sym, LispRef lambda)
+{
+	long n = lispFrameSize(m, lambda), i = 0, slot = -1;
+	LispRef names = lispCdr(m, lambda);
+	if(lispIsPair(m, names))
+		names = lispCar(m, names);
+	// the last of repeated names is the one that is bound.
+	for(; lispIsPair(m, names); names = lispCdr(m, names), i++)
+		if(lispCar(m, names) == sym)
+			slot = i;
+	if(names == sym)
+		slot = i;
+	if(slot == -1 || lispDefines(m, lispCdr(m, lispCdr(m, lambda)), sym, lispSymbol(m, bltnames[LISP_BUILTIN_LET])))
+		return 0;
+	return n - slot;
+}
+
+static LispRef
+lispEmit(LispMachine *m, int op, LispRef arg, LispRef next)
+{
+	LispRef rest = lispCons(m, arg, next);
+	return lispCons(m, lispBuiltin(m, op), rest);
+}
+
+static LispRef lispCompileExpr(LispMachine *m, LispRef expr, LispRef next, LispRef *lambda, LispRef *cenv, long depth);
+
+// compile the forms of body, the first of them being form number n. every
+// form but the first starts with a boundary, (n . code of the next one).
+static LispRef
+lispCompileSeq(LispMachine *m, LispRef body, LispRef next, LispRef *lambda, LispRef *cenv, long depth, long n)
+{
+	if(!lispIsPair(m, body))
+		return next;
+	LispRef *bodyp = lispRegister(m, body);
+	LispRef *code = lispRegister(m, lispCompileSeq(m, lispCdr(m, body), next, lambda, cenv, depth, n+1));
+	LispRef res = lispCompileExpr(m, lispCar(m, *bodyp), *code, lambda, cenv, depth);
+	if(n > 0){
+		LispRef *resp = lispRegister(m, res);
+		*code = lispCons(m, lispNumber(m, n), *code);
+		res = lispEmit(m, LISP_OP_SEQ, *code, *resp);
+		lispRelease(m, resp);
+	}
+	lispRelease(m, bodyp);
+	lispRelease(m, code);
+	return res;
+}
+
+static LispRef
+lispCompileExpr(LispMachine *m, LispRef expr, LispRef next, LispRef *lambda, LispRef *cenv, long depth)
+{
+	size_t scope = lispRegisterScope(m);
+	LispRef *exprp = lispRegister(m, expr);
+	LispRef *nextp = lispRegister(m, next);
+	LispRef *code = lispRegister(m, LISP_NIL);
+
+	if(lispIsSymbol(m, expr)){
+		long slot = lispLocalSlot(m, expr, *lambda);
+		if(slot != 0){
+			*code = lispEmit(m, LISP_OP_LOCAL, lispNumber(m, depth+slot), *nextp);
+		} else if(lispBindsSym(m, *exprp, *lambda)){
+			*code = lispEmit(m, LISP_OP_LOOKUP, *exprp, *nextp);
+		} else {
+			// (sym frame-size cenv epoch . pair), an empty cache.
+			*code = lispCons(m, lispBuiltin(m, LISP_BUILTIN_FALSE), LISP_NIL);
+			*code = lispCons(m, LISP_NIL, *code);
+			*code = lispCons(m, lispNumber(m, depth+lispFrameSize(m, *lambda)+1), *code);
+			*code = lispCons(m, *exprp, *code);
+			*code = lispEmit(m, LISP_OP_GLOBAL, *code, *nextp);
+		}
+		goto done;
+	}
+	if(!lispIsCons(m, expr)){
+		*code = lispEmit(m, lispIsAtom(m, expr) ? LISP_OP_CONST : LISP_OP_EVAL, expr, next);
+		goto done;
+	}
+	long len = lispLength(m, expr);
+	switch(lispSpecialForm(m, lispCar(m, expr), *lambda, *cenv)){
+	case LISP_BUILTIN_QUOTE:
+		if(len < 2)
+			break;
+		*code = lispEmit(m, LISP_OP_CONST, lispNth(m, expr, 1), next);
+		goto done;
+	case LISP_BUILTIN_FUNCTION:
+	case LISP_BUILTIN_CONTINUE:
+		// these evaluate to themselves.
+		*code = lispEmit(m, LISP_OP_CONST, expr, next);
+		goto done;
+	case LISP_BUILTIN_LAMBDA:
+		*code = lispEmit(m, LISP_OP_CLOSURE, expr, next);
+		goto done;
+	case LISP_BUILTIN_IF:{
+		// (if cond then else): the branch gets the else code, the code
+		// after the if, and the form to hand to the interpreter when the
+		// condition is an extref.
+		if(len < 4)
+			break;
+		LispRef *then = lispRegister(m, lispCompileExpr(m, lispNth(m, *exprp, 2), *nextp, lambda, cenv, depth));
+		LispRef *arg = lispRegister(m, lispCompileExpr(m, lispNth(m, *exprp, 3), *nextp, lambda, cenv, depth));
+		*code = lispCons(m, *nextp, *exprp);
+		*arg = lispCons(m, *arg, *code);
+		*code = lispEmit(m, LISP_OP_BRANCH, *arg, *then);
+		*code = lispCompileExpr(m, lispNth(m, *exprp, 1), *code, lambda, cenv, depth);
+		goto done;
+	}
+	case LISP_BUILTIN_LET:{
+		if(len < 2)
+			break;
+		LispRef sym = lispNth(m, expr, 1);
+		if(lispIsPair(m, sym)){
+			// (let (name args...) body...) defines (lambda (args...) body...)
+			*code = lispCons(m, lispCdr(m, sym), lispCdr(m, lispCdr(m, expr)));
+			*code = lispCons(m, lispBuiltin(m, LISP_BUILTIN_LAMBDA), *code);
+			*code = lispEmit(m, LISP_OP_CLOSURE, *code, lispEmit(m, LISP_OP_DEFINE, lispCar(m, lispNth(m, *exprp, 1)), *nextp));
+			goto done;
+		}
+		if(len < 3)
+			break;
+		*code = lispEmit(m, LISP_OP_DEFINE, sym, next);
+		*code = lispCompileExpr(m, lispNth(m, *exprp, 2), *code, lambda, cenv, depth);
+		goto done;
+	}
+	case LISP_BUILTIN_SET:
+		// the (set! ('field obj) value) form is left to the interpreter.
+		if(len < 3 || !lispIsSymbol(m, lispNth(m, expr, 1)))
+			break;
+		long slot = lispLocalSlot(m, lispNth(m, expr, 1), *lambda);
+		if(slot != 0)
+			*code = lispEmit(m, LISP_OP_SETLOCAL, lispNumber(m, depth+slot), *nextp);
+		else
+			*code = lispEmit(m, LISP_OP_SETVAR, lispNth(m, *exprp, 1), *nextp);
+		*code = lispCompileExpr(m, lispNth(m, *exprp, 2), *code, lambda, cenv, depth);
+		goto done;
+	case LISP_BUILTIN_SCOPE:
+		break;
+	default:{
+		// a call: evaluate the head and the arguments onto the stack, and
+		// apply. calls with a dotted argument list go to the interpreter.
+		if(len < 0)
+			break;
+		*code = lispEmit(m, LISP_OP_CALL, lispNumber(m, len-1), next);
+		for(long i = len-1; i > 0; i--){
+			*code = lispEmit(m, LISP_OP_PUSH, LISP_NIL, *code);
+			*code = lispCompileExpr(m, lispNth(m, *exprp, i), *code, lambda, cenv, depth+i);
+		}
+		LispRef arg = lispCons(m, *exprp, *nextp);
+		*code = lispEmit(m, LISP_OP_HEAD, arg, *code);
+		*code = lispCompileExpr(m, lispCar(m, *exprp), *code, lambda, cenv, depth);
+		goto done;
+	}
+	}
+	*code = lispEmit(m, LISP_OP_EVAL, *exprp, *nextp);
+done:
+	expr = *code;
+	lispReleaseScope(m, scope);
+	return expr;
+}
+
+// compile the body of lambda, or return LISP_NIL if it is malformed.
+static LispRef
+lispCompile(LispMachine *m, LispRef lambda, LispRef cenv)
+{
+	if(!lispIsPair(m, lambda) || !lispIsPair(m, lispCdr(m, lambda)) || lispLength(m, lispCdr(m, lispCdr(m, lambda))) < 0)
+		return LISP_NIL;
+	LispRef *lambdap = lispRegister(m, lambda);
+	LispRef *cenvp = lispRegister(m, cenv);
+	// the return pops the frame, its argument is the frame size.
+	LispRef *ret = lispRegister(m, lispEmit(m, LISP_OP_RET, lispNumber(m, lispFrameSize(m, lambda)+1), LISP_NIL));
+	LispRef code = lispCompileSeq(m, lispCdr(m, lispCdr(m, *lambdap)), *ret, lambdap, cenvp, 0, 0);
+	lispRelease(m, lambdap);
+	lispRelease(m, cenvp);
+	lispRelease(m, ret);
+	return code;
+}
+
+/*
+ *	An optional pass over parsed forms before they are evaluated, see
+ *	lispOptimize. It folds calls of pure builtins on constants, drops the
+ *	branch of an if that a constant condition doesn't take, and inlines
+ *	small lambdas where they are applied. The builtins are taken to keep
+ *	their names, unless the form being optimized lets or set!s them itself
+ *	or a local shadows them. Functions defined at top level can be
+ *	redefined, so calls of them are only inlined in code that runs right
+ *	away, outside of lambdas.
+ */
+
+// the lambdas, and let defined functions, around a form being optimized.
+typedef struct LispOptScope LispOptScope;
+struct LispOptScope {
+	LispRef lambda;
+	LispOptScope *up;
+};
+
+typedef struct {
+	LispRef top; // the form being optimized, as a body for lispDefines.
+	LispRef letsym;
+	LispRef setsym;
+} LispOpt;
+
+static LispRef lispOptExpr(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef expr);
+
+// the value of the global sym where scope is, if the form can't change it.
+static int
+lispOptGlobal(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef sym, LispRef *val)
+{
+	if(!lispIsSymbol(m, sym))
+		return 0;
+	for(; scope != NULL; scope = scope->up)
+		if(lispBindsSym(m, sym, scope->lambda))
+			return 0;
+	LispRef pair = lispGlobalLookup(m, sym);
+	if(pair == LISP_NIL || lispDefines(m, o->top, sym, o->letsym) || lispDefines(m, o->top, sym, o->setsym))
+		return 0;
+	*val = lispCdr(m, pair);
+	return 1;
+}
+
+// the builtin that head stands for by its own name, or -1.
+static int
+lispOptBuiltin(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef head)
+{
+	if(lispIsSymbol(m, head)){
+		LispRef val;
+		if(!lispOptGlobal(m, o, scope, head, &val) || !lispIsBuiltinTag(m, val))
+			return -1;
+		if(lispGetBuiltin(m, val) >= LISP_NUM_BUILTINS || head != lispSymbol(m, bltnames[lispGetBuiltin(m, val)]))
+			return -1;
+		head = val;
+	}
+	return lispIsBuiltinTag(m, head) ? lispGetBuiltin(m, head) : -1;
+}
+
+// is expr a constant, with the value it evaluates to in *val.
+static int
+lispOptConst(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef expr, LispRef *val)
+{
+	if(lispIsAtom(m, expr) || expr == LISP_NIL){
+		*val = expr;
+		return 1;
+	}
+	if(lispIsCons(m, expr) && lispLength(m, expr) == 2 && lispOptBuiltin(m, o, scope, lispCar(m, expr)) == LISP_BUILTIN_QUOTE){
+		*val = lispNth(m, expr, 1);
+		return 1;
+	}
+	return 0;
+}
+
+// a form that evaluates to val.
+static LispRef
+lispOptQuote(LispMachine *m, LispRef val)
+{
+	if(lispIsAtom(m, val) || val == LISP_NIL)
+		return val;
+	return lispCons(m, lispBuiltin(m, LISP_BUILTIN_QUOTE), lispCons(m, val, LISP_NIL));
+}
+
+// the call of the builtin blt in expr, folded if its arguments are
+// constants it can't fail on.
+static LispRef
+lispOptFold(LispMachine *m, LispOpt *o, LispOptScope *scope, int blt, LispRef expr)
+{
+	long len = lispLength(m, expr), want = 2;
+	int numbers = 0;
+	switch(blt){
+	case LISP_BUILTIN_ADD:
+	case LISP_BUILTIN_SUB:
+	case LISP_BUILTIN_MUL:
+	case LISP_BUILTIN_DIV:
+		numbers = 1;
+		want = len < 2 ? 2 : len;
+		break;
+	case LISP_BUILTIN_ISEQUAL:
+	case LISP_BUILTIN_ISLESS:
+		numbers = 1;
+		want = 3;
+		break;
+	case LISP_BUILTIN_CAR:
+	case LISP_BUILTIN_CDR:
+	case LISP_BUILTIN_ISPAIR:
+		break;
+	default:
+		return expr;
+	}
+	if(len != want)
+		return expr;
+	LispRef form = lispCons(m, lispBuiltin(m, blt), LISP_NIL), prev = form, val;
+	for(LispRef args = lispCdr(m, expr); args != LISP_NIL; args = lispCdr(m, args)){
+		if(!lispOptConst(m, o, scope, lispCar(m, args), &val))
+			return expr;
+		// the arithmetic goes on to bignums, division by zero is an #error.
+		if(numbers && !lispIsReal(m, val))
+			return expr;
+		if((blt == LISP_BUILTIN_CAR || blt == LISP_BUILTIN_CDR) && !lispIsCons(m, val))
+			return expr;
+		LispRef cell = lispCons(m, val, LISP_NIL);
+		lispSetCdr(m, prev, cell);
+		prev = cell;
+	}
+	val = lispApply(m, form);
+	if(lispIsBuiltin(m, val, LISP_BUILTIN_ERROR))
+		return expr;
+	return lispOptQuote(m, val);
+}
+
+// is sym the name of a special form.
+static int
+lispOptSpecialName(LispMachine *m, LispRef sym)
+{
+	for(int i = 0; i < LISP_NUM_BUILTINS; i++)
+		if(lispIsSpecial(m, lispBuiltin(m, i)) && sym == lispSymbol(m, bltnames[i]))
+			return 1;
+	return 0;
+}
+
+static int
+lispOptMember(LispMachine *m, LispRef list, LispRef sym)
+{
+	for(; lispIsPair(m, list); list = lispCdr(m, list))
+		if(lispCar(m, list) == sym)
+			return 1;
+	return 0;
+}
+
+// can expr, the body of a function with params, take the place of a call:
+// it only calls builtins, and when the function is global, the call
+// doesn't shadow the globals it refers to.
+static int
+lispOptSimple(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef params, LispRef expr, int global)
+{
+	LispRef val;
+	if(lispIsSymbol(m, expr))
+		return !global || lispOptMember(m, params, expr) || lispOptGlobal(m, o, scope, expr, &val);
+	if(!lispIsCons(m, expr))
+		return 1;
+	long len = lispLength(m, expr);
+	if(len < 0 || lispOptMember(m, params, lispCar(m, expr)))
+		return 0;
+	if(lispOptConst(m, o, scope, expr, &val))
+		return 1;
+	int blt = lispOptBuiltin(m, o, scope, lispCar(m, expr));
+	if(blt == -1 || blt == LISP_BUILTIN_CALLCC || blt == LISP_BUILTIN_EVAL)
+		return 0;
+	if(blt == LISP_BUILTIN_IF ? len != 4 : lispIsSpecial(m, lispBuiltin(m, blt)))
+		return 0;
+	for(expr = lispCdr(m, expr); expr != LISP_NIL; expr = lispCdr(m, expr))
+		if(!lispOptSimple(m, o, scope, params, lispCar(m, expr), global))
+			return 0;
+	return 1;
+}
+
+// a copy of expr with params replaced by args, but not in quoted data.
+static LispRef
+lispOptSubst(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef params, LispRef args, LispRef expr)
+{
+	LispRef val;
+	if(lispIsSymbol(m, expr)){
+		for(; lispIsPair(m, params); params = lispCdr(m, params), args = lispCdr(m, args))
+			if(lispCar(m, params) == expr)
+				return lispCar(m, args);
+		return expr;
+	}
+	if(!lispIsCons(m, expr) || lispOptConst(m, o, scope, expr, &val))
+		return expr;
+	LispRef head = LISP_NIL, prev = LISP_NIL;
+	for(; lispIsPair(m, expr); expr = lispCdr(m, expr)){
+		LispRef cell = lispCons(m, lispOptSubst(m, o, scope, params, args, lispCar(m, expr)), LISP_NIL);
+		if(prev != LISP_NIL)
+			lispSetCdr(m, prev, cell);
+		else
+			head = cell;
+		prev = cell;
+	}
+	return head;
+}
+
+// the body of the function expr calls in place of the call, or expr. the
+// arguments have to be constants or variables, as the body may evaluate
+// them in another order or not at all.
+static LispRef
+lispOptInline(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef expr)
+{
+	LispRef head = lispCar(m, expr), lambda, val;
+	int global = 0;
+	if(lispIsPair(m, head) && lispOptBuiltin(m, o, scope, lispCar(m, head)) == LISP_BUILTIN_LAMBDA){
+		lambda = head;
+	} else if(scope == NULL && lispOptGlobal(m, o, scope, head, &val) && lispIsPair(m, val) && lispIsBuiltin(m, lispCar(m, val), LISP_BUILTIN_FUNCTION)
+			&& lispIsPair(m, lispCdr(m, val)) && lispCdr(m, lispCdr(m, val)) == m->globals.head){
+		lambda = lispCar(m, lispCdr(m, val));
+		global = 1;
+	} else {
+		return expr;
+	}
+	if(lispLength(m, lambda) != 3)
+		return expr;
+	LispRef params = lispNth(m, lambda, 1), body = lispNth(m, lambda, 2);
+	if(lispLength(m, params) != lispLength(m, expr) - 1)
+		return expr;
+	for(LispRef p = params; p != LISP_NIL; p = lispCdr(m, p))
+		if(!lispIsSymbol(m, lispCar(m, p)) || lispOptMember(m, lispCdr(m, p), lispCar(m, p)))
+			return expr;
+	for(LispRef a = lispCdr(m, expr); a != LISP_NIL; a = lispCdr(m, a))
+		if(!lispIsSymbol(m, lispCar(m, a)) && !lispOptConst(m, o, scope, lispCar(m, a), &val))
+			return expr;
+	if(!lispOptSimple(m, o, scope, params, body, global))
+		return expr;
+	return lispOptExpr(m, o, scope, lispOptSubst(m, o, scope, params, lispCdr(m, expr), body));
+}
+
+// the forms in list, each optimized, sharing the list if none changed.
+static LispRef
+lispOptList(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef list)
+{
+	if(!lispIsPair(m, list))
+		return list;
+	LispRef first = lispOptExpr(m, o, scope, lispCar(m, list));
+	LispRef rest = lispOptList(m, o, scope, lispCdr(m, list));
+	if(first == lispCar(m, list) && rest == lispCdr(m, list))
+		return list;
+	return lispCons(m, first, rest);
+}
+
+static LispRef
+lispOptExpr(LispMachine *m, LispOpt *o, LispOptScope *scope, LispRef expr)
+{
+	LispRef val;
+	if(lispIsSymbol(m, expr)){
+		// #true and the like, unless they are rebound.
+		int blt = lispOptBuiltin(m, o, scope, expr);
+		if(blt >= LISP_BUILTIN_TRUE && blt <= LISP_BUILTIN_BELOW)
+			return lispBuiltin(m, blt);
+		return expr;
+	}
+	if(!lispIsCons(m, expr))
+		return expr;
+	long len = lispLength(m, expr);
+	if(len < 0)
+		return expr;
+	LispOptScope inner = {expr, scope};
+	int blt = lispOptBuiltin(m, o, scope, lispCar(m, expr));
+	switch(blt){
+	case LISP_BUILTIN_QUOTE:
+	case LISP_BUILTIN_FUNCTION:
+	case LISP_BUILTIN_CONTINUE:
+	case LISP_BUILTIN_SCOPE:
+		return expr;
+	case LISP_BUILTIN_IF:{
+		if(len != 4)
+			return expr;
+		LispRef cond = lispOptExpr(m, o, scope, lispNth(m, expr, 1));
+		if(lispOptConst(m, o, scope, cond, &val))
+			return lispOptExpr(m, o, scope, lispNth(m, expr, lispIsBuiltin(m, val, LISP_BUILTIN_FALSE) ? 3 : 2));
+		LispRef rest = lispOptList(m, o, scope, lispCdr(m, lispCdr(m, expr)));
+		if(cond == lispNth(m, expr, 1) && rest == lispCdr(m, lispCdr(m, expr)))
+			return expr;
+		return lispCons(m, lispCar(m, expr), lispCons(m, cond, rest));
+	}
+	case LISP_BUILTIN_LAMBDA:
+	case LISP_BUILTIN_LET:
+		if(len < 3)
+			return expr;
+		// the parameters and lets of a body shadow the globals.
+		if(blt != LISP_BUILTIN_LET || lispIsPair(m, lispNth(m, expr, 1)))
+			scope = &inner;
+		else if(len != 3)
+			return expr;
+		val = lispOptList(m, o, scope, lispCdr(m, lispCdr(m, expr)));
+		if(val == lispCdr(m, lispCdr(m, expr)))
+			return expr;
+		return lispCons(m, lispCar(m, expr), lispCons(m, lispNth(m, expr, 1), val));
+	case LISP_BUILTIN_SET:
+		if(len != 3)
+			return expr;
+		val = lispOptExpr(m, o, scope, lispNth(m, expr, 2));
+		if(val == lispNth(m, expr, 2))
+			return expr;
+		return lispCons(m, lispCar(m, expr), lispCons(m, lispNth(m, expr, 1), lispCons(m, val, LISP_NIL)));
+	}
+	// a call: the head stays as it is, the interpreter may have to see it.
+	// what may still be a special form is left alone.
+	if(blt == -1 && lispOptSpecialName(m, lispCar(m, expr)))
+		return expr;
+	LispRef args = lispOptList(m, o, scope, lispCdr(m, expr));
+	LispRef head = lispCar(m, expr);
+	if(lispIsPair(m, head))
+		head = lispOptExpr(m, o, scope, head);
+	if(head != lispCar(m, expr) || args != lispCdr(m, expr))
+		expr = lispCons(m, head, args);
+	if(blt != -1)
+		return lispOptFold(m, o, scope, blt, expr);
+	return lispOptInline(m, o, scope, expr);
+}
+
+LispRef
+lispOptimize(LispMachine *m, LispRef expr)
+{
+	// the pass holds refs while it allocates, so nothing may move: finish
+	// an incremental collection, and hold off the next like lispParse.
+	LispRef *exprp = lispRegister(m, expr);
+	lispCollectStep(m, SIZE_MAX);
+	m->gclock++;
+	LispOpt o;
+	o.top = lispCons(m, *exprp, LISP_NIL);
+	o.letsym = lispSymbol(m, bltnames[LISP_BUILTIN_LET]);
+	o.setsym = lispSymbol(m, bltnames[LISP_BUILTIN_SET]);
+	expr = lispOptExpr(m, &o, NULL, *exprp);
+	m->gclock--;
+	lispRelease(m, exprp);
+	return expr;
+}
+
+static size_t
+lispCodeSlot(LispMachine *m, LispRef lambda)
+{
+	size_t mask = m->code.cap - 1;
+	size_t i = ((uint32_t)lambda * 2654435761u >> 12) & mask;
+	while(m->code.lambda[i] != LISP_NIL && m->code.lambda[i] != lambda)
+		i = (i + 1) & mask;
+	return i;
+}
+
+// put the code cache in order after a collection moved it, or grow it to cap.
+static void
+lispRehashCode(LispMachine *m, size_t cap)
+{
+	LispRef *lambda = m->code.lambda;
+	LispRef *code = m->code.code;
+	uint32_t *calls = m->code.calls;
+	size_t oldcap = m->code.cap;
+	m->code.lambda = malloc(cap * sizeof m->code.lambda[0]);
+	m->code.code = malloc(cap * sizeof m->code.code[0]);
+	m->code.calls = malloc(cap * sizeof m->code.calls[0]);
+	if(m->code.lambda == NULL || m->code.code == NULL || m->code.calls == NULL){
+		fprintf(stderr, "lispRehashCode: malloc failed\n");
+		abort();
+	}
+	lispMemSet(m->code.lambda, LISP_NIL, cap);
+	m->code.cap = cap;
+	m->code.moved = 0;
+	for(size_t i = 0; i < oldcap; i++){
+		if(lambda[i] != LISP_NIL){
+			size_t j = lispCodeSlot(m, lambda[i]);
+			m->code.lambda[j] = lambda[i];
+			m->code.code[j] = code[i];
+			m->code.calls[j] = calls[i];
+		}
+	}
+	free(lambda);
+	free(code);
+	free(calls);
+}
+
+static void
+lispClearCode(LispMachine *m)
+{
+	lispMemSet(m->code.lambda, LISP_NIL, m->code.cap);
+	m->code.len = 0;
+}
+
+#if LISP_JIT
+static void lispJitCompile(LispMachine *m, LispRef code);
+#endif
+
+// the compiled body of lambda, compiling it if it isn't in the cache.
+static LispRef
+lispCodeOf(LispMachine *m, LispRef lambda, LispRef cenv)
+{
+	if(m->code.moved)
+		lispRehashCode(m, m->code.cap);
+	if(m->code.cap != 0){
+		size_t i = lispCodeSlot(m, lambda);
+		if(m->code.lambda[i] != LISP_NIL){
+#if LISP_JIT
+			if(++m->code.calls[i] == LISP_JIT_HOT){
+				// the translation changes the code in place.
+				LispRef *code = lispRegister(m, m->code.code[i]);
+				lispJitCompile(m, *code);
+				lambda = *code;
+				lispRelease(m, code);
+				return lambda;
+			}
+#endif
+			return m->code.code[i];
+		}
+	}
+	LispRef *lambdap = lispRegister(m, lambda);
+	LispRef *code = lispRegister(m, lispCompile(m, lambda, cenv));
+	if(*code != LISP_NIL){
+		if(m->code.moved)
+			lispRehashCode(m, m->code.cap);
+		if(4*(m->code.len+1) > 3*m->code.cap){
+			if(m->code.cap >= LISP_CODE_CACHE)
+				lispClearCode(m);
+			else
+				lispRehashCode(m, m->code.cap == 0 ? 64 : 2*m->code.cap);
+		}
+		size_t i = lispCodeSlot(m, *lambdap);
+		m->code.lambda[i] = *lambdap;
+		m->code.code[i] = *code;
+		m->code.calls[i] = 0;
+		m->code.len++;
+	}
+	lambda = *code;
+	lispRelease(m, lambdap);
+	lispRelease(m, code);
+	return lambda;
+}
+
+/*
+ *	Apply the function at m->stack.p[base] to the arguments pushed after
+ *	it, by binding them like BETA0..BETA2 do, and start its compiled body
+ *	with the function and the arguments as its frame. Returns -1 if the
+ *	body can't be compiled, with the stack untouched.
+ */
+static int
+lispEnter(LispMachine *m, size_t base)
+{
+	LispRef function = m->stack.p[base];
+	LispRef code = lispCodeOf(m, lispCar(m, lispCdr(m, function)), lispCdr(m, lispCdr(m, function)));
+	if(code == LISP_NIL)
+		return -1;
+	LispRef *codep = lispRegister(m, code);
+	function = m->stack.p[base];
+	m->envr = lispCdr(m, lispCdr(m, function));
+	m->stack.p[base] = m->envr;
+	LispRef *argnames = lispRegister(m, lispCdr(m, lispCar(m, lispCdr(m, function))));
+	if(lispIsPair(m, *argnames))
+		*argnames = lispCar(m, *argnames);
+	size_t i = base+1;
+	for(; lispIsPair(m, *argnames) && i < m->stack.len; i++){
+		LispRef pair = lispCons(m, lispCar(m, *argnames), m->stack.p[i]);
+		m->stack.p[i] = pair;
+		m->envr = lispCons(m, pair, m->envr);
+		*argnames = lispCdr(m, *argnames);
+	}
+	if(*argnames != LISP_NIL && !lispIsPair(m, *argnames)){
+		// the rest parameter takes the arguments left over.
+		LispRef *rest = lispRegister(m, LISP_NIL);
+		while(m->stack.len > i)
+			*rest = lispCons(m, lispPop(m), *rest);
+		LispRef pair = lispCons(m, *argnames, *rest);
+		lispPush(m, pair);
+		m->envr = lispCons(m, pair, m->envr);
+		lispRelease(m, rest);
+	} else if(*argnames != LISP_NIL || i < m->stack.len){
+		fprintf(stderr, "mismatch in number of function args\n");
+		m->stack.len = base;
+		m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+		lispRelease(m, codep);
+		lispRelease(m, argnames);
+		lispReturn(m);
+		return 0;
+	}
+	m->envr = lispCons(m, LISP_NIL, m->envr);
+	m->expr = *codep;
+	m->act = lispCons(m, lispNumber(m, 1), LISP_NIL);
+	lispRelease(m, codep);
+	lispRelease(m, argnames);
+	lispGoto(m, LISP_STATE_VM);
+	return 0;
+}
+
+// pop the values pushed from base up into a list in m->value.
+static void
+lispPopForm(LispMachine *m, size_t base)
+{
+	m->value = LISP_NIL;
+	while(m->stack.len > base)
+		m->value = lispCons(m, lispPop(m), m->value);
+}
+
+static int
+lispIsReturn(LispMachine *m, LispRef code)
+{
+	return lispIsBuiltin(m, lispCar(m, code), LISP_OP_RET);
+}
+
+// the argument and the successor of the instruction at m->expr.
+static LispRef
+lispCodeArg(LispMachine *m)
+{
+	return lispCarUnchecked(m, lispCdrUnchecked(m, m->expr));
+}
+
+static LispRef
+lispCodeNext(LispMachine *m)
+{
+	return lispCdrUnchecked(m, lispCdrUnchecked(m, m->expr));
+}
+
+// the size of the frame popped by ret, the return of the code.
+static size_t
+lispFrameOf(LispMachine *m, LispRef ret)
+{
+	return lispGetInt(m, lispCar(m, lispCdr(m, ret)));
+}
+
+// go to interpreter state inst, which returns to code. if code is the
+// return, it's a tail call and the frame is done.
+static void
+lispCallState(LispMachine *m, LispRef code, int inst)
+{
+	if(lispIsReturn(m, code)){
+		m->stack.len -= lispFrameOf(m, code);
+		lispGoto(m, inst);
+	} else {
+		lispPush(m, m->act);
+		lispPush(m, code);
+		lispCall(m, LISP_STATE_VM_RETURN, inst);
+	}
+}
+
+// pop what lispCallState pushed and continue at the code. the stack is as
+// deep as it was when the code was pushed, in a resumed continuation too.
+static void
+lispResume(LispMachine *m)
+{
+	m->expr = lispPop(m);
+	m->act = lispPop(m);
+}
+
+// start the form after the boundary (form . code), or return 0 if a
+// resumed continuation has been past it before.
+static int
+lispOpSeq(LispMachine *m, LispRef arg)
+{
+	if(lispCar(m, m->act) != lispCar(m, arg))
+		return 0;
+	lispSetCar(m, m->act, lispNumber(m, lispGetInt(m, lispCar(m, arg))+1));
+	lispSetCdr(m, m->act, lispCdr(m, arg));
+	return 1;
+}
+
+// the instructions that look up and set variables by name, for
+// lispRunCode and lispJitOp.
+static void
+lispOpLookup(LispMachine *m, LispRef arg)
+{
+	LispRef pair = lispAssq(m, m->envr, arg);
+	if(pair == LISP_NIL){
+		fprintf(stderr, "symbol %s not found\n", lispStringPointer(m, arg));
+		m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+	} else {
+		m->value = lispCdr(m, pair);
+	}
+}
+
+static void
+lispOpGlobal(LispMachine *m, LispRef arg)
+{
+	LispRef cache = lispCdr(m, arg);
+	LispRef cenv = m->stack.p[m->stack.len - lispGetInt(m, lispCar(m, cache))];
+	cache = lispCdr(m, cache);
+	if(lispCar(m, cache) == cenv && m->globals.epoch < LISP_EPOCH_MAX){
+		LispRef rest = lispCdr(m, cache);
+		if(lispCar(m, rest) == lispNumber(m, m->globals.epoch)){
+			m->value = lispCdr(m, lispCdr(m, rest));
+			return;
+		}
+	}
+	LispRef sym = lispCar(m, arg);
+	LispRef pair = lispAssq(m, m->envr, sym);
+	if(pair == LISP_NIL){
+		fprintf(stderr, "symbol %s not found\n", lispStringPointer(m, sym));
+		m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+		return;
+	}
+	m->value = lispCdr(m, pair);
+	if(pair == lispGlobalLookup(m, sym) && m->globals.epoch < LISP_EPOCH_MAX){
+		// fill the cache, nothing here allocates.
+		lispSetCar(m, cache, cenv);
+		LispRef rest = lispCdr(m, cache);
+		lispSetCar(m, rest, lispNumber(m, m->globals.epoch));
+		lispSetCdr(m, rest, pair);
+	}
+}
+
+static void
+lispOpSetVar(LispMachine *m, LispRef arg)
+{
+	LispRef pair = lispAssq(m, m->envr, arg);
+	if(pair != LISP_NIL)
+		lispSetCdr(m, pair, m->value);
+	else
+		fprintf(stderr, "set!: undefined symbol %s\n", (char *)lispStringPointer(m, arg));
+	m->value = LISP_NIL;
+}
+
+/*
+ *	Run the builtins that compiled code calls most on the arguments pushed
+ *	after the head at m->stack.p[base], without making a form for them.
+ *	Returns 0 with the result in m->value and the call popped, or -1 to
+ *	leave it to lispApplyBuiltin: other builtins, other numbers of
+ *	arguments, and arguments that need more, like extrefs and strings.
+ */
+static int
+lispInlineBuiltin(LispMachine *m, size_t base)
+{
+	size_t n = m->stack.len-1 - base;
+	LispRef a = n > 0 ? m->stack.p[base+1] : LISP_NIL;
+	LispRef b = n > 1 ? m->stack.p[base+2] : LISP_NIL;
+	LispRef c = n > 2 ? m->stack.p[base+3] : LISP_NIL;
+	LispRef blt = lispGetBuiltin(m, m->stack.p[base]);
+	switch(blt){
+	default:
+		return -1;
+	case LISP_BUILTIN_CAR:
+	case LISP_BUILTIN_CDR:
+		if(n != 1 || !lispIsCons(m, a))
+			return -1;
+		m->value = blt == LISP_BUILTIN_CAR ? lispCar(m, a) : lispCdr(m, a);
+		break;
+	case LISP_BUILTIN_VECTORREF:
+	case LISP_BUILTIN_VECTORSET:
+		if(n != (blt == LISP_BUILTIN_VECTORREF ? 2 : 3) || !lispIsVector(m, a) || !lispIsNumber(m, b) || (size_t)lispGetInt(m, b) >= lispVectorLength(m, a))
+			return -1;
+		if(blt == LISP_BUILTIN_VECTORREF){
+			m->value = lispVectorRef(m, a, lispGetInt(m, b));
 		} else {
-			fprintf(stderr, "equal?: unsupported types %d %d\n", reftag(arg0), reftag(arg));
-			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
-			lispReturn(m);
-			return 0;
+			lispVectorSet(m, a, lispGetInt(m, b), c);
+			m->value = c;
 		}
-		m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
-	eqdone:
-		lispReturn(m);
+		break;
+	case LISP_BUILTIN_VECTORLENGTH:
+		if(n != 1 || !lispIsVector(m, a))
+			return -1;
+		m->value = lispNumber(m, lispVectorLength(m, a));
+		break;
+	case LISP_BUILTIN_CONS:
+		if(n != 2)
+			return -1;
+		m->value = lispCons(m, a, b);
+		break;
+	case LISP_BUILTIN_ADD:
+	case LISP_BUILTIN_SUB:
+	case LISP_BUILTIN_MUL:
+	case LISP_BUILTIN_DIV:
+		if(n != 2)
+			return -1;
+		if(lispIsNumber(m, a) && lispIsNumber(m, b) && blt <= LISP_BUILTIN_SUB){
+			// fixnums that can't overflow the LispInt, bignums are for lispArith.
+			LispInt r = blt == LISP_BUILTIN_ADD ? lispGetInt(m, a) + lispGetInt(m, b) : lispGetInt(m, a) - lispGetInt(m, b);
+			if(r < LISP_FIXNUM_MIN || r > LISP_FIXNUM_MAX)
+				return -1;
+			m->value = lispNumber(m, r);
+		} else if((lispIsFloat(m, a) || lispIsFloat(m, b)) && lispIsReal(m, a) && lispIsReal(m, b))
+			m->value = lispFloat(m, lispFloatOp(blt, lispGetFloat(m, a), lispGetFloat(m, b)));
+		else
+			return -1;
+		break;
+	case LISP_BUILTIN_ISLESS:
+		if(n != 2 || !lispIsReal(m, a) || !lispIsReal(m, b))
+			return -1;
+		if(lispIsNumber(m, a) && lispIsNumber(m, b))
+			m->value = lispBuiltin(m, lispGetInt(m, a) < lispGetInt(m, b) ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);
+		else if(lispIsFloat(m, a) || lispIsFloat(m, b))
+			m->value = lispBuiltin(m, lispGetFloat(m, a) < lispGetFloat(m, b) ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);
+		else
+			return -1;
+		break;
+	case LISP_BUILTIN_ISEQUAL:
+		// numbers by value, lists by identity.
+		if(n != 2)
+			return -1;
+		if(lispIsNumber(m, a) && lispIsNumber(m, b))
+			m->value = lispBuiltin(m, lispGetInt(m, a) == lispGetInt(m, b) ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);
+		else if(lispIsFloat(m, a) && lispIsFloat(m, b))
+			m->value = lispBuiltin(m, lispGetFloat(m, a) == lispGetFloat(m, b) ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);
+		else if(lispIsList(m, a) && lispIsList(m, b) && !lispIsString(m, a) && !lispIsString(m, b) && !lispIsBignum(m, a) && !lispIsBignum(m, b))
+			m->value = lispBuiltin(m, a == b ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);
+		else
+			return -1;
+		break;
+	case LISP_BUILTIN_ISPAIR:
+		if(n != 1)
+			return -1;
+		m->value = lispBuiltin(m, lispIsCons(m, a) ? LISP_BUILTIN_TRUE : LISP_BUILTIN_FALSE);
+		break;
+	}
+	m->stack.len = base;
+	return 0;
+}
+
+#if LISP_JIT
+/*
+ *	The JIT translates the compiled code of a lambda that has been applied
+ *	LISP_JIT_HOT times to x86-64 machine code, a template per instruction.
+ *	A translation keeps everything in the machine like the VM does, with m
+ *	in rbx, so any template can hand its instruction to lispJitOp instead.
+ *	Constants, locals, pushes and branches are done inline, and so are the
+ *	fixnum sums, differences and comparisons of +, -, less? and equal?,
+ *	behind guards on the head and on the tags of the operands. What the
+ *	translation can't do, calls and returns included, deoptimizes: it sets
+ *	m->expr to the instruction and returns to the VM.
+ *
+ *	The VM comes back into a translation at the start of the body and after
+ *	calls. The instructions there are turned into LISP_OP_NATIVE in place,
+ *	(native n . copy), where n is the entry and copy is the instruction as
+ *	it was, which is where the translation deoptimizes to. A translation
+ *	only knows the instructions through its block in m->jit.refs, which the
+ *	collector keeps up to date.
+ */
+enum {
+	LISP_RAX,
+	LISP_RCX,
+	LISP_RDX,
+	LISP_RBX,
+	LISP_RSP,
+	LISP_RBP,
+	LISP_RSI,
+	LISP_RDI,
+};
+
+// condition codes of jcc.
+enum {
+	LISP_CC_B = 2,
+	LISP_CC_AE,
+	LISP_CC_E,
+	LISP_CC_NE,
+};
+
+// room for the largest template, and for an entry.
+#define LISP_JIT_TEMPLATE 256
+#define LISP_JIT_ENTRY 16
+
+#define LISP_JIT_OFF(field) offsetof(LispMachine, field)
+
+// run the instruction insn for a translation, or return 1 if it has to go
+// back to the VM for it.
+static int
+lispJitOp(LispMachine *m, LispRef insn)
+{
+	LispRef arg = lispCar(m, lispCdr(m, insn));
+	switch(lispGetBuiltin(m, lispCar(m, insn))){
+	case LISP_OP_CONST:
+		m->value = arg;
 		return 0;
-	} else if(blt == LISP_BUILTIN_ISLESS){
-		LispRef args = lispCdr(m, m->expr);
-		LispRef arg0 = lispCar(m, args);
-		args = lispCdr(m, args);
-		LispRef arg1 = lispCar(m, args);
-		m->value = lispBuiltin(m, LISP_BUILTIN_FALSE); // default to false.
-		if(lispIsExtRef(m, arg0) || lispIsExtRef(m, arg1)){
-			lispGoto(m, LISP_STATE_CONTINUE);
-			return 1;
-		} else if(lispIsNumber(m, arg0) && lispIsNumber(m, arg1)){
-			if(lispGetInt(m, arg0) < lispGetInt(m, arg1))
-				m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
-		} else if(lispIsSymbol(m, arg0) && lispIsSymbol(m, arg1)){
-			if(strcmp(lispStringPointer(m, arg0), lispStringPointer(m, arg1)) < 0)
-				m->value = lispBuiltin(m, LISP_BUILTIN_TRUE);
-		} else {
-			fprintf(stderr, "less?: unsupported types\n");
-			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
-			lispReturn(m);
-			return 0;
-		}
-		lispReturn(m);
+	case LISP_OP_LOOKUP:
+		lispOpLookup(m, arg);
 		return 0;
-	} else if(blt == LISP_BUILTIN_ISERROR){ // (error? ...)
-		m->expr = lispCdr(m, m->expr);
-		m->expr = lispCar(m, m->expr);
-		if(lispIsError(m, m->expr))
-			m->value =  lispBuiltin(m, LISP_BUILTIN_TRUE);
-		else
-			m->value =  lispBuiltin(m, LISP_BUILTIN_FALSE);
-		lispReturn(m);
+	case LISP_OP_LOCAL:
+		m->value = lispCdrUnchecked(m, m->stack.p[m->stack.len - lispGetInt(m, arg)]);
 		return 0;
-	} else if(blt == LISP_BUILTIN_SETCAR || blt == LISP_BUILTIN_SETCDR){
-		LispRef *cons = lispRegister(m, lispCdr(m, m->expr));
-		LispRef *val = lispRegister(m, lispCdr(m, *cons));
-		*cons = lispCar(m, *cons); // cons
-		*val = lispCar(m, *val); // val
-		if(blt == LISP_BUILTIN_SETCAR)
-			lispSetCar(m, *cons, *val);
-		else
-			lispSetCdr(m, *cons, *val);
-		lispRelease(m, cons);
-		lispRelease(m, val);
-		lispReturn(m);
+	case LISP_OP_GLOBAL:
+		lispOpGlobal(m, arg);
 		return 0;
-	} else if(blt == LISP_BUILTIN_CAR){
-		LispRef tmp = lispCdr(m, m->expr); // ('car thing.. -> (thing..
-		tmp = lispCar(m, tmp); // (thing.. -> thing
-		m->value = lispCar(m, tmp); // (car thing)
-		lispReturn(m);
+	case LISP_OP_SETLOCAL:
+		lispSetCdr(m, m->stack.p[m->stack.len - lispGetInt(m, arg)], m->value);
+		m->value = LISP_NIL;
 		return 0;
-	} else if(blt == LISP_BUILTIN_CDR){
-		LispRef tmp = lispCdr(m, m->expr);
-		tmp = lispCar(m, tmp);
-		m->value = lispCdr(m, tmp);
-		lispReturn(m);
+	case LISP_OP_PUSH:
+		lispPush(m, m->value);
 		return 0;
-	} else if(blt == LISP_BUILTIN_CONS){
-		LispRef tmp0 = lispCdr(m, m->expr);
-		LispRef tmp1 = lispCdr(m, tmp0);
-		tmp0 = lispCar(m, tmp0);
-		tmp1 = lispCar(m, tmp1);
-		m->value = lispCons(m, tmp0, tmp1);
-		lispReturn(m);
+	case LISP_OP_CLOSURE:{
+		LispRef tmp = lispCons(m, arg, m->envr);
+		m->value = lispCons(m, lispBuiltin(m, LISP_BUILTIN_FUNCTION), tmp);
 		return 0;
-	} else if(blt == LISP_BUILTIN_CALLCC){
-		m->expr = lispCdr(m, m->expr);
-		LispRef *tmp0 = lispRegister(m, lispCons(m, lispBuiltin(m, LISP_BUILTIN_CONTINUE), m->stack));
-		LispRef *tmp1 = lispRegister(m, lispCons(m, *tmp0, LISP_NIL));
-		m->expr = lispCons(m, lispCar(m, m->expr), *tmp1);
-		lispRelease(m, tmp0);
-		lispRelease(m, tmp1);
-		lispGoto(m, LISP_STATE_EVAL);
+	}
+	case LISP_OP_DEFINE:
+		lispBind(m, lispCons(m, arg, m->value));
 		return 0;
-	} else if(blt == LISP_BUILTIN_PRINT1){
-		LispRef rest = lispCdr(m, m->expr);
-		LispRef port = lispCar(m, rest);
-		rest = lispCdr(m, rest);
-		m->value = lispCar(m, rest);
-		if(lispIsExtRef(m, m->value)){
-			// escape extref printing
-			lispGoto(m, LISP_STATE_CONTINUE);
+	case LISP_OP_SETVAR:
+		lispOpSetVar(m, arg);
+		return 0;
+	case LISP_OP_HEAD:
+		if(lispIsSpecial(m, m->value))
 			return 1;
+		lispPush(m, m->value);
+		return 0;
+	case LISP_OP_CALL:{
+		size_t base = m->stack.len-1 - lispGetInt(m, arg);
+		if(lispIsBuiltinTag(m, m->stack.p[base]) && lispInlineBuiltin(m, base) == 0)
+			return 0;
+		return 1;
+	}
+	case LISP_OP_SEQ:
+		// the jump of a resumed continuation is left to the VM.
+		return !lispOpSeq(m, arg);
+	}
+	return 1;
+}
+
+static void
+lispJitEmit(LispMachine *m, const char *code, size_t len)
+{
+	memcpy(m->jit.mem + m->jit.len, code, len);
+	m->jit.len += len;
+}
+
+static void
+lispJitU32(LispMachine *m, uint32_t v)
+{
+	memcpy(m->jit.mem + m->jit.len, &v, sizeof v);
+	m->jit.len += sizeof v;
+}
+
+static void
+lispJitU64(LispMachine *m, uint64_t v)
+{
+	memcpy(m->jit.mem + m->jit.len, &v, sizeof v);
+	m->jit.len += sizeof v;
+}
+
+// an instruction with reg and [rbx+off] as operands. rex is 0x48 for a
+// 64-bit operand, or 0.
+static void
+lispJitField(LispMachine *m, int rex, int op, int reg, size_t off)
+{
+	if(rex != 0)
+		m->jit.mem[m->jit.len++] = rex;
+	m->jit.mem[m->jit.len++] = op;
+	m->jit.mem[m->jit.len++] = 0x80 | reg<<3 | LISP_RBX;
+	lispJitU32(m, off);
+}
+
+// a jcc with condition code cc, or a jmp if cc is -1. returns where its
+// displacement goes, for lispJitPatch.
+static size_t
+lispJitJump(LispMachine *m, int cc)
+{
+	if(cc < 0){
+		m->jit.mem[m->jit.len++] = 0xe9;
+	} else {
+		m->jit.mem[m->jit.len++] = 0x0f;
+		m->jit.mem[m->jit.len++] = 0x80 | cc;
+	}
+	size_t at = m->jit.len;
+	lispJitU32(m, 0);
+	return at;
+}
+
+static void
+lispJitPatch(LispMachine *m, size_t at, size_t target)
+{
+	uint32_t rel = target - (at + 4);
+	memcpy(m->jit.mem + at, &rel, sizeof rel);
+}
+
+// load the reference at p, which the collector keeps up to date, to reg.
+static void
+lispJitLoad(LispMachine *m, int reg, LispRef *p)
+{
+	lispJitEmit(m, "\x48\xb8", 2); // mov rax, p
+	lispJitU64(m, (uintptr_t)p);
+	m->jit.mem[m->jit.len++] = 0x8b; // mov reg, [rax]
+	m->jit.mem[m->jit.len++] = reg<<3 | LISP_RAX;
+}
+
+// go back to the VM at the instruction at p, which counts its step again.
+static void
+lispJitDeopt(LispMachine *m, LispRef *p, size_t exit)
+{
+	lispJitField(m, 0x48, 0x83, 5, LISP_JIT_OFF(stats.steps)); // sub qword [rbx+steps], 1
+	m->jit.mem[m->jit.len++] = 1;
+	lispJitLoad(m, LISP_RAX, p);
+	lispJitField(m, 0, 0x89, LISP_RAX, LISP_JIT_OFF(expr));
+	lispJitPatch(m, lispJitJump(m, -1), exit);
+}
+
+// run the instruction at p with lispJitOp, or go back to the VM at it.
+static void
+lispJitGeneric(LispMachine *m, LispRef *p, size_t exit)
+{
+	lispJitEmit(m, "\x48\x89\xdf", 3); // mov rdi, rbx
+	lispJitLoad(m, LISP_RSI, p);
+	lispJitEmit(m, "\x48\xb8", 2); // mov rax, lispJitOp
+	lispJitU64(m, (uintptr_t)lispJitOp);
+	lispJitEmit(m, "\xff\xd0\x85\xc0", 4); // call rax; test eax, eax
+	size_t ok = lispJitJump(m, LISP_CC_E);
+	lispJitDeopt(m, p, exit);
+	lispJitPatch(m, ok, m->jit.len);
+}
+
+// (blt a b) on two fixnums, for a call to a head that evaluated to blt.
+static void
+lispJitArith(LispMachine *m, LispRef *p, int blt, size_t exit)
+{
+	uint32_t mask = LISP_VAL_MASK >> LISP_TAG_INTEGER;
+	size_t slow[4], n = 0;
+	lispJitField(m, 0x48, 0x8b, LISP_RCX, LISP_JIT_OFF(stack.len));
+	lispJitField(m, 0x48, 0x8b, LISP_RAX, LISP_JIT_OFF(stack.p));
+	lispJitEmit(m, "\x81\x7c\x88\xf4", 4); // cmp dword [rax+rcx*4-12], blt
+	lispJitU32(m, lispBuiltin(m, blt));
+	slow[n++] = lispJitJump(m, LISP_CC_NE);
+	lispJitEmit(m, "\x8b\x54\x88\xf8", 4); // mov edx, [rax+rcx*4-8]
+	lispJitEmit(m, "\x8b\x74\x88\xfc", 4); // mov esi, [rax+rcx*4-4]
+	// a fixnum has the tag bits 01, and the ones here are not negative
+	// either, so they compare and add unsigned.
+	lispJitEmit(m, "\x89\xd7\xc1\xef\x1d\x83\xff\x02", 8); // mov edi, edx; shr edi, 29; cmp edi, 2
+	slow[n++] = lispJitJump(m, LISP_CC_NE);
+	lispJitEmit(m, "\x89\xf7\xc1\xef\x1d\x83\xff\x02", 8); // mov edi, esi; shr edi, 29; cmp edi, 2
+	slow[n++] = lispJitJump(m, LISP_CC_NE);
+	lispJitEmit(m, "\x81\xe2", 2); // and edx, mask
+	lispJitU32(m, mask);
+	lispJitEmit(m, "\x81\xe6", 2); // and esi, mask
+	lispJitU32(m, mask);
+	switch(blt){
+	case LISP_BUILTIN_ADD:
+	case LISP_BUILTIN_SUB:
+		// results that don't fit a fixnum are left to lispNumber.
+		if(blt == LISP_BUILTIN_ADD){
+			lispJitEmit(m, "\x01\xf2\x81\xfa", 4); // add edx, esi; cmp edx, max+1
+			lispJitU32(m, LISP_FIXNUM_MAX+1);
+			slow[n++] = lispJitJump(m, LISP_CC_AE);
 		} else {
-			lispPrint1(m, m->value, lispGetInt(m, port));
-			lispReturn(m);
+			lispJitEmit(m, "\x29\xf2", 2); // sub edx, esi
+			slow[n++] = lispJitJump(m, LISP_CC_B);
 		}
-		return 0;
-	} else if(blt == LISP_BUILTIN_EVAL){
-		m->expr = lispCar(m, lispCdr(m, m->expr)); // expr = cdar expr
-		lispGoto(m, LISP_STATE_EVAL);
-		return 0;
+		lispJitEmit(m, "\x81\xca", 2); // or edx, tag
+		lispJitU32(m, mask+1);
+		lispJitField(m, 0, 0x89, LISP_RDX, LISP_JIT_OFF(value));
+		break;
+	default:{
+		lispJitEmit(m, "\x39\xf2", 2); // cmp edx, esi
+		lispJitField(m, 0, 0xc7, 0, LISP_JIT_OFF(value));
+		lispJitU32(m, lispBuiltin(m, LISP_BUILTIN_FALSE));
+		size_t no = lispJitJump(m, blt == LISP_BUILTIN_ISLESS ? LISP_CC_AE : LISP_CC_NE);
+		lispJitField(m, 0, 0xc7, 0, LISP_JIT_OFF(value));
+		lispJitU32(m, lispBuiltin(m, LISP_BUILTIN_TRUE));
+		lispJitPatch(m, no, m->jit.len);
+		break;
+	}
 	}
+	lispJitEmit(m, "\x48\x83\xe9\x03", 4); // sub rcx, 3
+	lispJitField(m, 0x48, 0x89, LISP_RCX, LISP_JIT_OFF(stack.len));
+	size_t done = lispJitJump(m, -1);
+	while(n > 0)
+		lispJitPatch(m, slow[--n], m->jit.len);
+	lispJitGeneric(m, p, exit);
+	lispJitPatch(m, done, m->jit.len);
 }
 
-static int
-lispApplySymLookup(LispMachine *m)
+// the template of the instruction at p. head is the builtin the head of a
+// call is expected to be, or -1.
+static void
+lispJitTemplate(LispMachine *m, LispRef *p, int head, size_t exit)
 {
-	switch(lispGetBuiltin(m, m->inst)){
+	LispRef arg = lispCar(m, lispCdr(m, *p));
+	lispJitField(m, 0x48, 0x83, 0, LISP_JIT_OFF(stats.steps)); // add qword [rbx+steps], 1
+	m->jit.mem[m->jit.len++] = 1;
+	switch(lispGetBuiltin(m, lispCar(m, *p))){
 	default:
+		lispJitGeneric(m, p, exit);
+		break;
+	case LISP_OP_EVAL:
+	case LISP_OP_NATIVE:
+	case LISP_OP_RET:
+		lispJitDeopt(m, p, exit);
+		break;
+	case LISP_OP_CONST:
+		// only pairs move.
+		if(reftag(arg) == LISP_TAG_PAIR && arg != LISP_NIL){
+			lispJitGeneric(m, p, exit);
+			break;
+		}
+		lispJitField(m, 0, 0xc7, 0, LISP_JIT_OFF(value));
+		lispJitU32(m, arg);
+		break;
+	case LISP_OP_LOCAL:{
+		// the cdr of the slot, unless the incremental collector needs its
+		// read barrier.
+		lispJitField(m, 0, 0x83, 7, LISP_JIT_OFF(incremental.active)); // cmp dword [rbx+active], 0
+		m->jit.mem[m->jit.len++] = 0;
+		size_t slow = lispJitJump(m, LISP_CC_NE);
+		lispJitField(m, 0x48, 0x8b, LISP_RAX, LISP_JIT_OFF(stack.p));
+		lispJitField(m, 0x48, 0x8b, LISP_RCX, LISP_JIT_OFF(stack.len));
+		lispJitEmit(m, "\x8b\x84\x88", 3); // mov eax, [rax+rcx*4-4*slot]
+		lispJitU32(m, -4 * lispGetInt(m, arg));
+		lispJitEmit(m, "\x25", 1); // and eax, mask
+		lispJitU32(m, LISP_VAL_MASK >> LISP_TAG_PAIR);
+		lispJitField(m, 0x48, 0x8b, LISP_RDX, LISP_JIT_OFF(mem.ref));
+		lispJitEmit(m, "\x8b\x44\x82", 3); // mov eax, [rdx+rax*4+cdr]
+		m->jit.mem[m->jit.len++] = 4 * LISP_CDR_OFFSET;
+		lispJitField(m, 0, 0x89, LISP_RAX, LISP_JIT_OFF(value));
+		size_t done = lispJitJump(m, -1);
+		lispJitPatch(m, slow, m->jit.len);
+		lispJitGeneric(m, p, exit);
+		lispJitPatch(m, done, m->jit.len);
+		break;
+	}
+	case LISP_OP_PUSH:{
+		lispJitField(m, 0x48, 0x8b, LISP_RCX, LISP_JIT_OFF(stack.len));
+		lispJitField(m, 0x48, 0x3b, LISP_RCX, LISP_JIT_OFF(stack.cap));
+		size_t slow = lispJitJump(m, LISP_CC_AE);
+		lispJitField(m, 0x48, 0x8b, LISP_RAX, LISP_JIT_OFF(stack.p));
+		lispJitField(m, 0, 0x8b, LISP_RDX, LISP_JIT_OFF(value));
+		lispJitEmit(m, "\x89\x14\x88\x48\x83\xc1\x01", 7); // mov [rax+rcx*4], edx; add rcx, 1
+		lispJitField(m, 0x48, 0x89, LISP_RCX, LISP_JIT_OFF(stack.len));
+		size_t done = lispJitJump(m, -1);
+		lispJitPatch(m, slow, m->jit.len);
+		lispJitGeneric(m, p, exit);
+		lispJitPatch(m, done, m->jit.len);
+		break;
+	}
+	case LISP_OP_BRANCH:{
+		// extrefs escape in the VM. the jump to the else code is left to
+		// lispJitCompile.
+		lispJitField(m, 0, 0x8b, LISP_RAX, LISP_JIT_OFF(value));
+		lispJitEmit(m, "\xc1\xe8\x1d\x83\xf8\x01", 6); // shr eax, 29; cmp eax, 1
+		size_t ok = lispJitJump(m, LISP_CC_NE);
+		lispJitDeopt(m, p, exit);
+		lispJitPatch(m, ok, m->jit.len);
+		lispJitField(m, 0, 0x81, 7, LISP_JIT_OFF(value)); // cmp dword [rbx+value], #false
+		lispJitU32(m, lispBuiltin(m, LISP_BUILTIN_FALSE));
+		break;
+	}
+	case LISP_OP_CALL:
+		if(head != -1 && lispGetInt(m, arg) == 2)
+			lispJitArith(m, p, head, exit);
+		else
+			lispJitGeneric(m, p, exit);
+		break;
+	}
+}
+
+static int
+lispJitFind(LispRef *cells, size_t n, LispRef cell)
+{
+	for(size_t i = 0; i < n; i++)
+		if(cells[i] == cell)
+			return i;
+	return -1;
+}
+
+// drop all translations, the LISP_OP_NATIVE left behind go on with the
+// copy of their instruction.
+static void
+lispJitReset(LispMachine *m)
+{
+	for(size_t i = 0; i < m->jit.nrefs; i++)
+		free(m->jit.refs[i].p);
+	m->jit.nrefs = 0;
+	m->jit.base += m->jit.nentry;
+	m->jit.nentry = 0;
+	m->jit.len = 0;
+}
+
+static void
+lispJitCompile(LispMachine *m, LispRef code)
+{
+	if(m->jit.off || lispIsReturn(m, code))
+		return;
+	if(m->jit.mem == NULL){
+		void *p = mmap(NULL, LISP_JIT_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED){
+			m->jit.off = 1;
+			return;
+		}
+		m->jit.mem = p;
+		m->jit.cap = LISP_JIT_SIZE;
+	}
+
+	// the instructions, each one's successor following it where possible.
+	// the second half of cells gets the copies of the entries.
+	LispRef *cells = malloc(2*LISP_JIT_OPS * sizeof cells[0]);
+	LispRef *todo = malloc(LISP_JIT_OPS * sizeof todo[0]);
+	size_t *labels = malloc(LISP_JIT_OPS * sizeof labels[0]);
+	struct {
+		size_t at;
+		size_t cell;
+	} *fixups = malloc(2*LISP_JIT_OPS * sizeof fixups[0]);
+	char *entry = calloc(LISP_JIT_OPS, 1);
+	int *heads = malloc(LISP_JIT_OPS * sizeof heads[0]);
+	if(cells == NULL || todo == NULL || labels == NULL || fixups == NULL || entry == NULL || heads == NULL){
+		fprintf(stderr, "lispJitCompile: malloc failed\n");
 		abort();
-	case LISP_STATE_SYM_LOOKUP0:
-		if(m->expr == LISP_NIL){
-			m->value = lispBuiltin(m, LISP_BUILTIN_ERROR); // not found
-			lispReturn(m);
-			return 0;
-		} else {
-			LispRef envr = m->expr;
-			LispRef sym = lispCdr(m, m->stack);
-			sym = lispCdr(m, sym);
-			sym = lispCar(m, sym);
-			LispRef pair = lispCar(m, envr);
-			if(lispIsPair(m, pair)){
-				LispRef key = lispCar(m, pair);
-				if(key == sym){
-					m->value = pair;
-					lispReturn(m);
-					return 0;
-				}
-			}
-			envr = lispCdr(m, envr);
-			m->expr = envr;
-			return 0;
+	}
+	size_t n = 0, ntodo = 0, nentry = 1;
+	todo[ntodo++] = code;
+	entry[0] = 1;
+	while(ntodo > 0){
+		LispRef cell = todo[--ntodo];
+		while(lispJitFind(cells, n, cell) == -1){
+			if(n == LISP_JIT_OPS)
+				goto done;
+			cells[n++] = cell;
+			int op = lispGetBuiltin(m, lispCar(m, cell));
+			if(op == LISP_OP_RET || op == LISP_OP_NATIVE)
+				break;
+			if(op == LISP_OP_BRANCH)
+				todo[ntodo++] = lispCar(m, lispCar(m, lispCdr(m, cell)));
+			cell = lispCdr(m, lispCdr(m, cell));
+		}
+	}
+	// the VM comes back after calls.
+	for(size_t i = 0; i < n; i++){
+		int op = lispGetBuiltin(m, lispCar(m, cells[i]));
+		if(op != LISP_OP_CALL && op != LISP_OP_EVAL)
+			continue;
+		size_t j = lispJitFind(cells, n, lispCdr(m, lispCdr(m, cells[i])));
+		op = lispGetBuiltin(m, lispCar(m, cells[j]));
+		if(!entry[j] && op != LISP_OP_RET && op != LISP_OP_NATIVE){
+			entry[j] = 1;
+			nentry++;
+		}
+	}
+	size_t need = n * LISP_JIT_TEMPLATE + nentry * LISP_JIT_ENTRY + 2;
+	if(m->jit.len + need > m->jit.cap)
+		lispJitReset(m);
+	if(need > m->jit.cap || mprotect(m->jit.mem, m->jit.cap, PROT_READ|PROT_WRITE) == -1)
+		goto done;
+	size_t start = m->jit.len;
+
+	// the builtins that the heads of calls name, if they are ones the
+	// templates do.
+	int blts[] = {LISP_BUILTIN_ADD, LISP_BUILTIN_SUB, LISP_BUILTIN_ISLESS, LISP_BUILTIN_ISEQUAL};
+	LispRef syms[nelem(blts)];
+	for(size_t i = 0; i < nelem(blts); i++)
+		syms[i] = lispSymbol(m, bltnames[blts[i]]);
+
+	lispJitEmit(m, "\x5b\xc3", 2); // exit: pop rbx; ret
+	size_t nfix = 0, nheads = 0;
+	for(size_t i = 0; i < n; i++){
+		labels[i] = m->jit.len;
+		int op = lispGetBuiltin(m, lispCar(m, cells[i]));
+		int head = -1;
+		if(op == LISP_OP_HEAD){
+			LispRef sym = lispCar(m, lispCar(m, lispCar(m, lispCdr(m, cells[i]))));
+			heads[nheads] = -1;
+			for(size_t j = 0; j < nelem(blts); j++)
+				if(sym == syms[j])
+					heads[nheads] = blts[j];
+			nheads++;
+		} else if(op == LISP_OP_CALL && nheads > 0){
+			head = heads[--nheads];
+		}
+		lispJitTemplate(m, cells + i, head, start);
+		if(op == LISP_OP_BRANCH){
+			fixups[nfix].at = lispJitJump(m, LISP_CC_E);
+			fixups[nfix++].cell = lispJitFind(cells, n, lispCar(m, lispCar(m, lispCdr(m, cells[i]))));
 		}
+		if(op == LISP_OP_RET || op == LISP_OP_NATIVE || op == LISP_OP_EVAL)
+			continue;
+		int next = lispJitFind(cells, n, lispCdr(m, lispCdr(m, cells[i])));
+		if(next != (int)i+1){
+			fixups[nfix].at = lispJitJump(m, -1);
+			fixups[nfix++].cell = next;
+		}
+	}
+	for(size_t i = 0; i < nfix; i++)
+		lispJitPatch(m, fixups[i].at, labels[fixups[i].cell]);
+
+	// the entries: push rbx; mov rbx, rdi; jmp label.
+	if(m->jit.nentry + nentry > m->jit.entrycap){
+		m->jit.entrycap = 2*(m->jit.nentry + nentry);
+		m->jit.entry = realloc(m->jit.entry, m->jit.entrycap * sizeof m->jit.entry[0]);
+	}
+	if(m->jit.nrefs == m->jit.refscap){
+		m->jit.refscap = m->jit.refscap == 0 ? 16 : 2*m->jit.refscap;
+		m->jit.refs = realloc(m->jit.refs, m->jit.refscap * sizeof m->jit.refs[0]);
+	}
+	if(m->jit.entry == NULL || m->jit.refs == NULL){
+		fprintf(stderr, "lispJitCompile: realloc failed\n");
+		abort();
+	}
+	size_t first = m->jit.base + m->jit.nentry;
+	for(size_t i = 0; i < LISP_JIT_OPS; i++){
+		if(i >= n)
+			cells[i] = LISP_NIL;
+		cells[LISP_JIT_OPS+i] = LISP_NIL;
+		if(i >= n || !entry[i])
+			continue;
+		m->jit.entry[m->jit.nentry++] = (void (*)(LispMachine *))(m->jit.mem + m->jit.len);
+		lispJitEmit(m, "\x53\x48\x89\xfb", 4);
+		lispJitPatch(m, lispJitJump(m, -1), labels[i]);
+	}
+	mprotect(m->jit.mem, m->jit.cap, PROT_READ|PROT_EXEC);
+
+	// the block is a root from here on, then the entries are spliced in.
+	m->jit.refs[m->jit.nrefs].p = cells;
+	m->jit.refs[m->jit.nrefs++].len = 2*LISP_JIT_OPS;
+	cells = NULL;
+	LispRef *blk = m->jit.refs[m->jit.nrefs-1].p;
+	for(size_t i = 0, k = first; i < n; i++){
+		if(!entry[i])
+			continue;
+		blk[LISP_JIT_OPS+i] = lispCons(m, lispCar(m, blk[i]), lispCdr(m, blk[i]));
+		LispRef rest = lispCons(m, lispNumber(m, k++), blk[LISP_JIT_OPS+i]);
+		lispSetCar(m, blk[i], lispBuiltin(m, LISP_OP_NATIVE));
+		lispSetCdr(m, blk[i], rest);
+		blk[i] = blk[LISP_JIT_OPS+i];
+	}
+done:
+	free(cells);
+	free(todo);
+	free(labels);
+	free(fixups);
+	free(entry);
+	free(heads);
+}
+
+// run the translation at entry n, unless a reset dropped it.
+static void
+lispJitRun(LispMachine *m, size_t n)
+{
+	if(n < m->jit.base){
+		m->expr = lispCdr(m, lispCdr(m, m->expr));
+		return;
 	}
+	m->jit.entry[n - m->jit.base](m);
 }
+#endif
 
+/*
+ *	Run the code at m->expr until it leaves for the interpreter. Like the
+ *	other lispStep helpers, returns 1 for an extref escape.
+ */
 static int
-lispEvalArgs(LispMachine *m)
+lispRunCode(LispMachine *m)
 {
-	switch(lispGetBuiltin(m, m->inst)){
-	default:
-		abort();
-	case LISP_STATE_EVAL_ARGS0:{
-			// construct evaluation state: (expr . (expr-cell . value-cell))
-			LispRef *state = lispRegister(m, lispCons(m, LISP_NIL, LISP_NIL));
-			// push the first (expr-cell . value-cell) pair
-			// cdr of this holds the return value once entire list is evaluated.
-			lispPush(m, *state);
-			*state = lispCons(m, m->expr, *state);
-			lispPush(m, *state);
-			lispRelease(m, state);
-			lispGoto(m, LISP_STATE_EVAL_ARGS1);
-			return 0;
-		}
-	case LISP_STATE_EVAL_ARGS1:{
-			// load top of stack to state.
-			LispRef *state = lispRegister(m, lispPeek(m));
-			// store latest m->value to value-cell.
-			lispSetCar(m, lispCdr(m, *state), m->value);
-			// load expr-cell to register
-			LispRef *exprCell = lispRegister(m, lispCar(m, *state)); // expr-cell = car(state)
-			if(lispIsPair(m, *exprCell)){
-				lispRelease(m, state);
-				lispRelease(m, exprCell);
-				lispGoto(m, LISP_STATE_EVAL_ARGS3);
+	LispRef arg;
+#if LISP_THREADED
+	static void *const ops[LISP_OP_RET+1] = {
+		[0 ... LISP_OP_RET] = &&badop,
+		LISP_LABEL(LISP_OP_CONST),
+		LISP_LABEL(LISP_OP_LOOKUP),
+		LISP_LABEL(LISP_OP_LOCAL),
+		LISP_LABEL(LISP_OP_GLOBAL),
+		LISP_LABEL(LISP_OP_SETLOCAL),
+		LISP_LABEL(LISP_OP_PUSH),
+		LISP_LABEL(LISP_OP_BRANCH),
+		LISP_LABEL(LISP_OP_CLOSURE),
+		LISP_LABEL(LISP_OP_DEFINE),
+		LISP_LABEL(LISP_OP_SETVAR),
+		LISP_LABEL(LISP_OP_HEAD),
+		LISP_LABEL(LISP_OP_CALL),
+		LISP_LABEL(LISP_OP_EVAL),
+		LISP_LABEL(LISP_OP_NATIVE),
+		LISP_LABEL(LISP_OP_SEQ),
+		LISP_LABEL(LISP_OP_RET),
+	};
+#define LISP_DISPATCH_OP() do { \
+		size_t op = bltval(lispCarUnchecked(m, m->expr)); \
+		m->stats.steps++; \
+		arg = lispCodeArg(m); \
+		if(op > LISP_OP_RET) \
+			goto badop; \
+		goto *ops[op]; \
+	} while(0)
+#define LISP_NEXT_OP() do { m->expr = lispCodeNext(m); LISP_DISPATCH_OP(); } while(0)
+#else
+#define LISP_DISPATCH_OP() continue
+#define LISP_NEXT_OP() goto next
+#endif
+
+	for(;;){
+		m->stats.steps++;
+		arg = lispCodeArg(m);
+		switch(bltval(lispCarUnchecked(m, m->expr))){
+		default:
+#if LISP_THREADED
+		badop:
+#endif
+			fprintf(stderr, "lispRunCode: invalid instruction\n");
+			abort();
+		LISP_TARGET(LISP_OP_CONST)
+			m->value = arg;
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_LOOKUP)
+			lispOpLookup(m, arg);
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_LOCAL)
+			m->value = lispCdrUnchecked(m, m->stack.p[m->stack.len - lispGetInt(m, arg)]);
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_GLOBAL)
+			lispOpGlobal(m, arg);
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_SETLOCAL)
+			lispSetCdr(m, m->stack.p[m->stack.len - lispGetInt(m, arg)], m->value);
+			m->value = LISP_NIL;
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_PUSH)
+			lispPush(m, m->value);
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_BRANCH)
+			// arg is (else-code after-code . if-form)
+			if(lispIsExtRef(m, m->value)){
+				// let IF1 do the escape.
+				lispCallState(m, lispCar(m, lispCdr(m, arg)), LISP_STATE_IF1);
+				lispPush(m, lispCdr(m, lispCdr(m, lispCodeArg(m))));
 				return 0;
 			}
-			// this following bit is non-standard, it allows one to call a function
-			// with the notation (fn . args) or (fn arg1 arg2 . rest), effectively
-			// splicing a list 'args' in to the argument list, analogous to how
-			// varargs are declared in standard scheme functions. by allowing the
-			// dotted notation for apply, there is no need an apply built-in.
-			// unfortunately, of course the dotted tail must not be a literal list,
-			// so defining apply as a function is still going to be necessary.
-			if(*exprCell != LISP_NIL){
-				m->expr = *exprCell;
-				lispSetCar(m, *state, LISP_NIL);
-				lispRelease(m, state);
-				lispRelease(m, exprCell);
-				lispCall(m, LISP_STATE_EVAL_ARGS2, LISP_STATE_EVAL);
+			if(m->value == lispBuiltin(m, LISP_BUILTIN_FALSE)){
+				m->expr = lispCar(m, arg);
+				LISP_DISPATCH_OP();
+			}
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_CLOSURE){
+			// (lambda args body) -> (function (lambda args body) envr)
+			LispRef tmp = lispCons(m, arg, m->envr);
+			m->value = lispCons(m, lispBuiltin(m, LISP_BUILTIN_FUNCTION), tmp);
+			LISP_NEXT_OP();
+		}
+		LISP_TARGET(LISP_OP_DEFINE)
+			// like LET1, (sym . value) goes below the environment head.
+			lispBind(m, lispCons(m, arg, m->value));
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_SETVAR)
+			lispOpSetVar(m, arg);
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_HEAD)
+			// arg is (form . after-code)
+			if(lispIsSpecial(m, m->value)){
+				lispCallState(m, lispCdr(m, arg), LISP_STATE_EVAL);
+				m->expr = lispCar(m, lispCodeArg(m));
 				return 0;
 			}
-
-			// arg list evaluation is done
-			assert(*exprCell == LISP_NIL);
-			lispRelease(m, state);
-			lispRelease(m, exprCell);
-			lispPop(m);
-			m->value = lispCdr(m, lispPop(m));
-			lispReturn(m);
+			lispPush(m, m->value);
+			LISP_NEXT_OP();
+		LISP_TARGET(LISP_OP_CALL){
+			// the head and the arguments are on top of the stack.
+			size_t base = m->stack.len-1 - lispGetInt(m, arg);
+			LispRef head = m->stack.p[base];
+			if(lispIsPair(m, head) && lispIsBuiltin(m, lispCar(m, head), LISP_BUILTIN_FUNCTION)){
+				// they become the frame of the function: moved down over
+				// the frame of this one for a tail call, or up to make
+				// room for the return frame below them.
+				LispRef next = lispCodeNext(m);
+				size_t n = m->stack.len - base;
+				if(lispIsReturn(m, next)){
+					base -= lispFrameOf(m, next);
+					memmove(m->stack.p + base, m->stack.p + m->stack.len - n, n * sizeof m->stack.p[0]);
+					m->stack.len = base + n;
+				} else {
+					// the activation, the code and the lispCall frame.
+					LispRef ret[4];
+					lispCallState(m, next, LISP_STATE_VM);
+					LispRef *p = m->stack.p + base;
+					memcpy(ret, p + n, sizeof ret);
+					memmove(p + 4, p, n * sizeof *p);
+					memcpy(p, ret, sizeof ret);
+					base += 4;
+				}
+				if(lispEnter(m, base) == -1){
+					lispPopForm(m, base);
+					m->expr = m->value;
+					lispGoto(m, LISP_STATE_BETA0);
+				}
+				if(!lispIsBuiltin(m, m->inst, LISP_STATE_VM))
+					return 0;
+				LISP_DISPATCH_OP();
+			}
+			if(lispIsBuiltinTag(m, head) && lispInlineBuiltin(m, base) == 0)
+				LISP_NEXT_OP();
+			lispPopForm(m, base);
+			if(lispIsBuiltinTag(m, head) && !lispIsBuiltin(m, head, LISP_BUILTIN_CALLCC) && !lispIsBuiltin(m, head, LISP_BUILTIN_EVAL)){
+				// the builtins that don't evaluate anything need no frame,
+				// unless they escape.
+				LispRef *pc = lispRegister(m, m->expr);
+				m->expr = m->value;
+				int r = lispApplyBuiltin(m);
+				LispRef *form = lispRegister(m, m->expr);
+				m->expr = lispCdr(m, lispCdr(m, *pc));
+				if(r == 0){
+					lispRelease(m, form);
+					lispRelease(m, pc);
+					LISP_DISPATCH_OP();
+				}
+				lispCallState(m, m->expr, LISP_STATE_CONTINUE);
+				m->expr = *form;
+				lispRelease(m, form);
+				lispRelease(m, pc);
+				return 1;
+			}
+			lispCallState(m, lispCodeNext(m), LISP_STATE_APPLY);
 			return 0;
 		}
-	case LISP_STATE_EVAL_ARGS3:{
-			// exprcell is a pair (a list)
-			LispRef *state = lispRegister(m, lispPeek(m));
-			LispRef *exprCell = lispRegister(m, lispCar(m, *state)); // expr-cell = car(state)
-			// load new expr from expr-cell and set expr-cell to next expr.
-			m->expr = lispCar(m, *exprCell); // expr = (car expr-cell)
-			*exprCell = lispCdr(m, *exprCell); // expr-cell = (cdr expr-cell)
-			lispSetCar(m, *state, *exprCell); //  car(state) = (cdr expr-cell)
-
-			// allocate new value-cell, link cdr of current value-cell to it and set value-cell to the new one.
-			LispRef *valueCell = lispRegister(m, lispCons(m, LISP_NIL, LISP_NIL));
-			*exprCell = lispCdr(m, *state);
-			lispSetCdr(m, *exprCell, *valueCell);
-			lispSetCdr(m, *state, *valueCell);
-
-			// release registers
-			lispRelease(m, state);
-			lispRelease(m, exprCell);
-			lispRelease(m, valueCell);
-			// call "apply" on the current expr and have it return to ARGS1
-			// state.
-			lispCall(m, LISP_STATE_EVAL_ARGS1, LISP_STATE_EVAL);
+		LISP_TARGET(LISP_OP_EVAL)
+			lispCallState(m, lispCodeNext(m), LISP_STATE_EVAL);
+			m->expr = lispCodeArg(m);
 			return 0;
-		}
-	case LISP_STATE_EVAL_ARGS2:{
-			// load top of stack to state.
-			LispRef *state = lispRegister(m, lispPeek(m));
-			// store new m->value to the rest of value chain.
-			// vast majority of time m->value is nil, except for the
-			// non-standard arg splicing situation from above.
-			lispSetCdr(m, lispCdr(m, *state), m->value);
-			lispRelease(m, state);
-			// pop evaluation state
-			lispPop(m);
-			// pop the head and return its value-cell.
-			m->value = lispCdr(m, lispPop(m));
+		LISP_TARGET(LISP_OP_NATIVE)
+#if LISP_JIT
+			lispJitRun(m, lispGetInt(m, arg));
+			LISP_DISPATCH_OP();
+#else
+			LISP_NEXT_OP();
+#endif
+		LISP_TARGET(LISP_OP_SEQ)
+			if(lispOpSeq(m, arg))
+				LISP_NEXT_OP();
+			m->expr = lispCdr(m, m->act);
+			LISP_DISPATCH_OP();
+		LISP_TARGET(LISP_OP_RET)
+			m->stack.len -= lispFrameOf(m, m->expr);
 			lispReturn(m);
+			if(!lispIsBuiltin(m, m->inst, LISP_STATE_VM_RETURN))
+				return 0;
+			lispResume(m);
+			LISP_DISPATCH_OP();
 		}
+#if !LISP_THREADED
+	next:
+		m->expr = lispCodeNext(m);
+#endif
 	}
+#undef LISP_DISPATCH_OP
+#undef LISP_NEXT_OP
 }
 
 int
 lispStep(LispMachine *m)
 {
+#if LISP_THREADED
+	static void *const states[LISP_STATE_VM_RETURN+1] = {
+		[0 ... LISP_STATE_VM_RETURN] = &&badstate,
+		LISP_LABEL(LISP_STATE_IF0),
+		LISP_LABEL(LISP_STATE_IF1),
+		LISP_LABEL(LISP_STATE_LET0),
+		LISP_LABEL(LISP_STATE_LET1),
+		LISP_LABEL(LISP_STATE_SYM_LOOKUP0),
+		LISP_LABEL(LISP_STATE_SYM_LOOKUP1),
+		LISP_LABEL(LISP_STATE_SET0),
+		LISP_LABEL(LISP_STATE_SET1),
+		LISP_LABEL(LISP_STATE_SET2),
+		LISP_LABEL(LISP_STATE_SET3),
+		LISP_LABEL(LISP_STATE_EVAL_ARGS0),
+		LISP_LABEL(LISP_STATE_EVAL_ARGS1),
+		LISP_LABEL(LISP_STATE_EVAL_ARGS2),
+		LISP_LABEL(LISP_STATE_EVAL_ARGS3),
+		LISP_LABEL(LISP_STATE_BUILTIN0),
+		LISP_LABEL(LISP_STATE_VM_RETURN),
+		LISP_LABEL(LISP_STATE_VM),
+		LISP_LABEL(LISP_STATE_CONTINUE),
+		LISP_LABEL(LISP_STATE_RETURN),
+		LISP_LABEL(LISP_STATE_EVAL),
+		LISP_LABEL(LISP_STATE_SPECIAL_FORMS),
+		LISP_LABEL(LISP_STATE_APPLY),
+		LISP_LABEL(LISP_STATE_BETA0),
+		LISP_LABEL(LISP_STATE_BETA1),
+		LISP_LABEL(LISP_STATE_BETA2),
+		LISP_LABEL(LISP_STATE_BETA3),
+	};
+#define LISP_DISPATCH() do { \
+		size_t state = bltval(m->inst); \
+		m->stats.steps++; \
+		if(state > LISP_STATE_VM_RETURN) \
+			goto badstate; \
+		goto *states[state]; \
+	} while(0)
+#else
+#define LISP_DISPATCH() goto again
+#endif
+
+#if !LISP_THREADED
 again:
+#endif
+	m->stats.steps++;
 	if(!lispIsBuiltinTag(m, m->inst)){
 		fprintf(stderr, "lispStep: inst is not built-in, stack corruption?\n");
 		abort();
 	}
 	switch(lispGetBuiltin(m, m->inst)){
 	default:
+#if LISP_THREADED
+	badstate:
+		if(!lispIsBuiltinTag(m, m->inst)){
+			fprintf(stderr, "lispStep: inst is not built-in, stack corruption?\n");
+			abort();
+		}
+#endif
 		fprintf(stderr, "lispStep: invalid instruction %zd, bailing out.\n", refval(m->inst));
+		abort();
 
-	case LISP_STATE_IF0:
-	case LISP_STATE_IF1:
+	LISP_TARGET(LISP_STATE_IF0)
+	LISP_TARGET(LISP_STATE_IF1)
 		if(lispApplyIf(m) == 1)
 			return 1;
-		goto again;
-	case LISP_STATE_LET0:
-	case LISP_STATE_LET1:
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_LET0)
+	LISP_TARGET(LISP_STATE_LET1)
 		if(lispApplyLet(m) == 1)
 			return 1;
-		goto again;
-	case LISP_STATE_SYM_LOOKUP0:
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_SYM_LOOKUP0)
 		if(lispApplySymLookup(m) == 1)
 			return 1;
-		goto again;
-	case LISP_STATE_SYM_LOOKUP1:{
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_SYM_LOOKUP1){
 			LispRef sym = lispPop(m);
 			if(m->value == lispBuiltin(m, LISP_BUILTIN_ERROR)){
 				fprintf(stderr, "symbol %s not found\n", lispStringPointer(m, sym));
@@ -1460,45 +4999,58 @@ again:
 				m->value = lispCdr(m, m->value);
 			}
 			lispReturn(m);
-			goto again;
+			LISP_DISPATCH();
 		}
-	case LISP_STATE_SET0:
-	case LISP_STATE_SET1:
-	case LISP_STATE_SET2:
-	case LISP_STATE_SET3:
+	LISP_TARGET(LISP_STATE_SET0)
+	LISP_TARGET(LISP_STATE_SET1)
+	LISP_TARGET(LISP_STATE_SET2)
+	LISP_TARGET(LISP_STATE_SET3)
 		if(lispApplySet(m) == 1)
 			return 1;
-		goto again;
-	case LISP_STATE_EVAL_ARGS0:
-	case LISP_STATE_EVAL_ARGS1:
-	case LISP_STATE_EVAL_ARGS2:
-	case LISP_STATE_EVAL_ARGS3:
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_EVAL_ARGS0)
+	LISP_TARGET(LISP_STATE_EVAL_ARGS1)
+	LISP_TARGET(LISP_STATE_EVAL_ARGS2)
+	LISP_TARGET(LISP_STATE_EVAL_ARGS3)
 		if(lispEvalArgs(m) == 1)
 			return 1;
-		goto again;
-	case LISP_STATE_BUILTIN0:
-		if(lispApplyBuiltin(m) == 1)
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_BUILTIN0)
+		switch(lispApplyBuiltin(m)){
+		case 0:
+			lispReturn(m);
+			break;
+		case 1:
 			return 1;
-		goto again;
-	case LISP_STATE_CONTINUE:
+		}
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_VM_RETURN)
+		lispResume(m);
+		// fall through
+	LISP_TARGET(LISP_STATE_VM)
+		if(lispRunCode(m) == 1)
+			return 1;
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_CONTINUE)
 		lispReturn(m);
-		goto again;
-	case LISP_STATE_RETURN:
+		LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_RETURN)
 		return 0;
-	case LISP_STATE_EVAL:
+	LISP_TARGET(LISP_STATE_EVAL)
 		if(lispIsAtom(m, m->expr)){
 			// atom evaluates to itself, these are currently
-			// numbers, #true, #false, #greater, #equal, #less
+			// numbers, strings, vectors, #true, #false, #greater,
+			// #equal, #less
 			m->value = m->expr;
 			lispReturn(m);
-			goto again;
+			LISP_DISPATCH();
 		} else if(lispIsSymbol(m, m->expr)){
 			// symbol evaluates to the looked up value in
 			// current environment
 			lispPush(m, m->expr); // push the symbol to look for
 			m->expr = m->envr; // environment to find it in.
 			lispCall(m, LISP_STATE_SYM_LOOKUP1, LISP_STATE_SYM_LOOKUP0);
-			goto again;
+			LISP_DISPATCH();
 		} else if(lispIsPair(m, m->expr)){
 			// form is (something), so this is 'application'
 			// evaluate list head first, it is typically a lambda or a symbol.
@@ -1507,9 +5059,9 @@ again:
 			lispPush(m, m->expr);
 			m->expr = lispCar(m, m->expr);
 			lispCall(m, LISP_STATE_SPECIAL_FORMS, LISP_STATE_EVAL);
-			goto again;
+			LISP_DISPATCH();
 		}
-	case LISP_STATE_SPECIAL_FORMS:{
+	LISP_TARGET(LISP_STATE_SPECIAL_FORMS){
 			// list head is evaluated in m->value, rest of the list is
 			// un-evaluated.
 			LispRef head = m->value;
@@ -1522,31 +5074,31 @@ again:
 				if(blt == LISP_BUILTIN_IF){
 					// (if cond then else)
 					lispGoto(m, LISP_STATE_IF0);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(blt == LISP_BUILTIN_FUNCTION){
 					// (function (lambda args body) envr): return self.
 					m->value = m->expr;
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(blt == LISP_BUILTIN_CONTINUE){
 					// continuation: return self.
 					m->value = m->expr;
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(blt == LISP_BUILTIN_LET){
 					// (let sym value)
 					// (let (sym args) body)
 					lispGoto(m, LISP_STATE_LET0);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(blt == LISP_BUILTIN_SET){
 					// (set! sym value)
 					// (set! ('field obj) value)
 					lispGoto(m, LISP_STATE_SET0);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(blt == LISP_BUILTIN_SCOPE){
 					// (scope vars body)
@@ -1578,7 +5130,7 @@ again:
 					lispRelease(m, newenvr);
 					lispRelease(m, body);
 					lispGoto(m, LISP_STATE_EVAL);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(blt == LISP_BUILTIN_LAMBDA){
 					// (lambda args body) -> (function (lambda args body) envr)
@@ -1586,27 +5138,31 @@ again:
 					m->value = lispCons(m, lispBuiltin(m, LISP_BUILTIN_FUNCTION), *tmp);
 					lispRelease(m, tmp);
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(blt == LISP_BUILTIN_QUOTE){
 					// (quote args) -> args
 					m->value = lispCar(m, lispCdr(m, m->expr)); // expr = cdar expr
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 			}
 
 			// at this point we know it is a list, and that it is
 			// not a special form. evaluate args, then apply.
 			lispCall(m, LISP_STATE_APPLY, LISP_STATE_EVAL_ARGS0);
-			goto again;
-	case LISP_STATE_APPLY:
+			LISP_DISPATCH();
+	LISP_TARGET(LISP_STATE_APPLY)
 			m->expr = m->value;
 			head = lispCar(m, m->expr);
 			if(lispIsBuiltinTag(m, head)){
 				lispGoto(m, LISP_STATE_BUILTIN0);
-				goto again;
+				LISP_DISPATCH();
 			} else if(lispIsExtRef(m, head)){
+				if(lispApplyNative(m) == 0){
+					lispReturn(m);
+					LISP_DISPATCH();
+				}
 				// we are applying an external object to lisp arguments..
 				lispGoto(m, LISP_STATE_CONTINUE);
 				return 1;
@@ -1626,7 +5182,7 @@ again:
 				if(function == LISP_NIL){
 					m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(lispIsExtRef(m, function)){
 					m->expr = lispCons(m, function, LISP_NIL);
@@ -1634,6 +5190,12 @@ again:
 					lispGoto(m, LISP_STATE_CONTINUE);
 					return 1;
 				}
+				// numbers index vectors: (3 vec) is (vector-ref vec 3).
+				if(lispIsVector(m, function)){
+					m->value = lispIsNumber(m, head) ? lispVectorRef(m, function, lispGetInt(m, head)) : lispBuiltin(m, LISP_BUILTIN_ERROR);
+					lispReturn(m);
+					LISP_DISPATCH();
+				}
 				// if it is a function (created by lambda), search the symbol
 				// in its captured environment
 				LispRef functionHead = lispCar(m, function);
@@ -1641,12 +5203,12 @@ again:
 					m->expr = lispCdr(m, lispCdr(m, function));
 					lispPush(m, head);
 					lispCall(m, LISP_STATE_SYM_LOOKUP1, LISP_STATE_SYM_LOOKUP0);
-					goto again;
+					LISP_DISPATCH();
 				} else {
 					fprintf(stderr, "symbol finding in a non-object\n");
 					m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 
 			} else if(lispIsPair(m, head)){
@@ -1660,40 +5222,49 @@ again:
 				if(function == LISP_NIL){
 					m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 				head = lispCar(m, function);
 				if(!lispIsBuiltinTag(m, head)){
 					m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
 				}
 				if(lispIsBuiltin(m, head, LISP_BUILTIN_CONTINUE)){
 					// ((continue . stack) return-value)
-					m->stack = lispCdr(m, function);
+					lispRestoreStack(m, lispCdr(m, function));
 					m->value = lispCdr(m, m->expr);
 					if(lispIsPair(m, m->value))
 						m->value = lispCar(m, m->value);
 					lispReturn(m);
-					goto again; 
+					LISP_DISPATCH(); 
 				} else if(lispIsBuiltin(m, head, LISP_BUILTIN_FUNCTION)){
-					lispGoto(m, LISP_STATE_BETA0);
-					goto again;
+					// bind the arguments from the stack, the interpreter
+					// takes a dotted form.
+					size_t base = m->stack.len;
+					LispRef args = m->expr;
+					for(; lispIsPair(m, args); args = lispCdr(m, args))
+						lispPush(m, lispCar(m, args));
+					if(args != LISP_NIL || lispEnter(m, base) == -1){
+						m->stack.len = base;
+						lispGoto(m, LISP_STATE_BETA0);
+					}
+					LISP_DISPATCH();
 				} else {
 					if(refval(head) != LISP_BUILTIN_FUNCTION){
 						fprintf(stderr, "applying list with non-function head\n");
 						m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
 						lispReturn(m);
-						goto again;
+						LISP_DISPATCH();
 					}
 				}
 			} else {
 				fprintf(stderr, "apply: head element has unrecognized form\n");
 				lispReturn(m);
-				goto again;
+				LISP_DISPATCH();
 			}
 
-	case LISP_STATE_BETA0:{
+	LISP_TARGET(LISP_STATE_BETA0){
 				LispRef function = lispCar(m, m->expr);
 				LispRef lambda = lispCar(m, lispCdr(m, function));
 				m->envr = lispCdr(m, lispCdr(m, function));
@@ -1707,17 +5278,17 @@ again:
 					lispRelease(m, argnames);
 					lispRelease(m, args);
 					lispGoto(m, LISP_STATE_BETA1);
-					goto again;
+					LISP_DISPATCH();
 				} else {
 					lispPush(m, *argnames);
 					lispPush(m, *args);
 					lispRelease(m, argnames);
 					lispRelease(m, args);
 					lispGoto(m, LISP_STATE_BETA2);
-					goto again;
+					LISP_DISPATCH();
 				}
 			}
-	case LISP_STATE_BETA1:{
+	LISP_TARGET(LISP_STATE_BETA1){
 				// loop over argnames and args simultaneously, cons
 				// them as pairs to the environment
 				LispRef *args = lispRegister(m, lispPop(m)); // args = cdr expr
@@ -1735,17 +5306,17 @@ again:
 					lispRelease(m, args);
 					lispRelease(m, pair);
 					lispGoto(m, LISP_STATE_BETA1);
-					goto again;
+					LISP_DISPATCH();
 				} else {
 					lispPush(m, *argnames);
 					lispPush(m, *args);
 					lispRelease(m, argnames);
 					lispRelease(m, args);
 					lispGoto(m, LISP_STATE_BETA2);
-					goto again;
+					LISP_DISPATCH();
 				}
 			}
-	case LISP_STATE_BETA2:{
+	LISP_TARGET(LISP_STATE_BETA2){
 				// scheme-style variadic: if argnames list terminates in a
 				// symbol instead of LISP_NIL, associate the rest of argslist
 				// with it. notice: (lambda x (body)) also lands here.
@@ -1759,87 +5330,646 @@ again:
 					fprintf(stderr, "mismatch in number of function args\n");
 					m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
 					lispReturn(m);
-					goto again;
+					LISP_DISPATCH();
+				}
+
+				// push a new 'environment head' in.
+				m->envr = lispCons(m, LISP_NIL, m->envr);
+				// clear the registers.
+				lispRelease(m, argnames);
+				lispRelease(m, args);
+
+				// parameters are bound, pull body from lambda to m->expr.
+				LispRef function = lispCar(m, m->expr); // function = car expr
+				LispRef lambda = lispCar(m, lispCdr(m, function));
+				m->expr = lispCdr(m, lispCdr(m, lambda));
+				lispPush(m, lispCons(m, m->expr, LISP_NIL));
+				lispGoto(m, LISP_STATE_BETA3);
+				LISP_DISPATCH();
+			}
+	LISP_TARGET(LISP_STATE_BETA3){
+				// the rest of the body is kept in a cell, see lispCaptureStack.
+				LispRef body = lispPeek(m);
+				LispRef tmp = lispCar(m, body);
+				if(tmp != LISP_NIL){
+					m->expr = lispCar(m, tmp);
+					tmp = lispCdr(m, tmp);
+					lispSetCar(m, body, tmp);
+					if(tmp != LISP_NIL){
+						lispCall(m, LISP_STATE_BETA3, LISP_STATE_EVAL);
+						LISP_DISPATCH();
+					} else { // tail call
+						lispPop(m);
+						lispGoto(m, LISP_STATE_EVAL);
+						LISP_DISPATCH();
+					}
 				}
+				lispPop(m); // pop expr.
+				lispReturn(m);
+				LISP_DISPATCH();
+			}
+		}
+		fprintf(stderr, "lispStep eval: unrecognized form: ");
+		//eval_print(m);
+		fprintf(stderr, "\n");
+		m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
+		lispReturn(m);
+		LISP_DISPATCH();
+	}
+#undef LISP_DISPATCH
+}
+
+/*
+ *	Extrefs are traced by the full collections. Every extref the collection
+ *	comes across gets its slot marked, and the ones that were not reached by
+ *	the end are finalized and their slots go on the free list.
+ */
+static void
+lispMarkExt(LispMachine *m, LispRef ref)
+{
+	size_t i = refval(ref);
+	m->extrefs.marks[i / 32] |= (uint32_t)1 << (i % 32);
+}
+
+static void
+lispClearExt(LispMachine *m)
+{
+	if(m->extrefs.marks != NULL)
+		memset(m->extrefs.marks, 0, (m->extrefs.cap + 31) / 32 * sizeof m->extrefs.marks[0]);
+}
+
+static void
+lispSweepExt(LispMachine *m)
+{
+	for(size_t i = 0; i < m->extrefs.len; i++){
+		if(m->extrefs.p[i].free || (m->extrefs.marks[i / 32] & ((uint32_t)1 << (i % 32))) != 0)
+			continue;
+		LispExtType *type = m->extrefs.p[i].type;
+		if(type != NULL && type->finalize != NULL)
+			type->finalize(m, m->extrefs.p[i].obj);
+		m->extrefs.p[i].obj = NULL;
+		m->extrefs.p[i].type = NULL;
+		m->extrefs.p[i].free = 1;
+		m->extrefs.p[i].next = m->extrefs.free;
+		m->extrefs.free = i + 1;
+		m->extrefs.count--;
+	}
+	m->extrefs.live = m->extrefs.count;
+}
+
+/*
+ *	The following routines implement a copying garbage collector.
+ *
+ *	During a collection, the old cells are in m->copy and the survivors are
+ *	appended to m->mem. LispCopy takes a reference to an old cell. If the cell
+ *	is a forwarding entry, return what the forwarding entry has. Else, append
+ *	the (unmodified) pair to m->mem and change the old cell into a forwarding
+ *	entry to the pair's new location.
+ *
+ *	Symbol names and their index are eternal constants which can be freed
+ *	entirely if printing of symbol names isn't required and memory is somehow
+ *	really that scarce. Strings are blocks like vectors, see lispString.
+ */
+static LispRef
+lispCopy(LispMachine *m, LispRef ref)
+{
+	if(reftag(ref) == LISP_TAG_EXTREF)
+		lispMarkExt(m, ref);
+	if(reftag(ref) != LISP_TAG_PAIR || ref == LISP_NIL)
+		return ref;
+	LispRef *old = m->copy.ref + urefval(ref);
+	if(lispIsBuiltin(m, old[LISP_CAR_OFFSET], LISP_BUILTIN_FORWARD))
+		return old[LISP_CDR_OFFSET];
+	// a vector or a string is copied in one piece.
+	size_t num = lispBlockSize(m, old[LISP_CAR_OFFSET], old[LISP_CDR_OFFSET]);
+	// this is the copy phase: any references in the new cell will point to
+	// something in the old space until the scan gets to it. only the
+	// incremental collector can run out of room here, since it shares the
+	// new space with the allocator.
+	while(m->mem.cap - m->mem.len < num)
+		lispGrow(m);
+	LispRef newref = mkref(m->mem.len, LISP_TAG_PAIR);
+	memcpy(m->mem.ref + m->mem.len, old, num * sizeof old[0]);
+	m->mem.len += num;
+	m->stats.copied += num * sizeof m->mem.ref[0];
+	// rewrite the old cell to point to new.
+	old[LISP_CAR_OFFSET] = lispBuiltin(m, LISP_BUILTIN_FORWARD);
+	old[LISP_CDR_OFFSET] = newref;
+	return newref;
+}
+
+/*
+ *	Every collector calls copy on all the vm registers, which form the root
+ *	set, and stores back what it returns.
+ */
+static void
+lispCopyRoots(LispMachine *m, LispRef (*copy)(LispMachine *m, LispRef ref))
+{
+	// free slots hold a builtin, which copies to itself.
+	for(size_t i = 0; i < m->roots.len; i++){
+		LispRef *regp = lispRootSlot(m, i);
+		*regp = copy(m, *regp);
+	}
+
+	m->value = copy(m, m->value);
+	m->expr = copy(m, m->expr);
+	m->envr = copy(m, m->envr);
+	m->act = copy(m, m->act);
+	for(size_t i = 0; i < m->stack.len; i++)
+		m->stack.p[i] = copy(m, m->stack.p[i]);
+
+	m->globals.head = copy(m, m->globals.head);
+	for(size_t i = 0; i < m->globals.cap; i++)
+		if(m->globals.sym[i] != LISP_NIL)
+			m->globals.cell[i] = copy(m, m->globals.cell[i]);
+
+	// the code cache keeps what it has compiled alive.
+	for(size_t i = 0; i < m->code.cap; i++){
+		if(m->code.lambda[i] != LISP_NIL){
+			m->code.lambda[i] = copy(m, m->code.lambda[i]);
+			m->code.code[i] = copy(m, m->code.code[i]);
+		}
+	}
+	m->code.moved = 1;
+
+#if LISP_JIT
+	for(size_t i = 0; i < m->jit.nrefs; i++)
+		for(size_t j = 0; j < m->jit.refs[i].len; j++)
+			m->jit.refs[i].p[j] = copy(m, m->jit.refs[i].p[j]);
+#endif
+}
+
+/*
+ *	After a full collection everything is old, so the nursery is empty and
+ *	there is nothing to remember. The card table is resized to cover the old
+ *	generation.
+ */
+static void
+lispResetNursery(LispMachine *m)
+{
+	for(size_t i = 0; i < m->nursery.len; i++)
+		m->nursery.cards[m->nursery.dirty[i]] = 0;
+	m->nursery.len = 0;
+	m->nursery.oldlen = m->mem.len;
+	size_t ncards = (m->nursery.oldlen >> LISP_CARD_BITS) + 1;
+	if(ncards > m->nursery.ncards){
+		void *p = realloc(m->nursery.cards, ncards * sizeof m->nursery.cards[0]);
+		if(p == NULL){
+			fprintf(stderr, "lispResetNursery: realloc failed\n");
+			abort();
+		}
+		m->nursery.cards = p;
+		memset(m->nursery.cards + m->nursery.ncards, 0, ncards - m->nursery.ncards);
+		m->nursery.ncards = ncards;
+	}
+}
+
+/*
+ *	Flip starts a collection: the two semispaces are exchanged and the root
+ *	set is copied over. The old cells stay in m->copy until the collection is
+ *	over.
+ */
+static void
+lispFlip(LispMachine *m)
+{
+	// There are two "memories" within m, namely m->mem and m->copy. They
+	// get exchanged here. It's a waste of memory, but it avoids one big
+	// malloc per gc.
+	LispMachine oldm;
+	memcpy(&oldm.mem, &m->mem, sizeof oldm.mem);
+	memcpy(&m->mem, &m->copy, sizeof m->mem);
+	memcpy(&m->copy, &oldm.mem, sizeof m->copy);
+	lispPauseBegin(m);
+	if(m->mem.cap != m->copy.cap)
+		lispResizeSpace(&m->mem, m->copy.cap);
+	// never return LISP_NIL by accident.
+	lispMemSet(m->mem.ref, LISP_NIL, 2);
+	m->mem.len = 2;
+	m->gclock++;
+	lispClearExt(m);
+
+	if(m->gcmode == LISP_GC_INCREMENTAL){
+		lispResizeBlack(m);
+		memset(m->incremental.black, 0, m->incremental.len * sizeof m->incremental.black[0]);
+		m->incremental.scan = 2;
+		m->incremental.active = 1;
+	}
+	lispCopyRoots(m, lispCopy);
+	m->gclock--;
+	lispPauseEnd(m);
+}
+
+/*
+ *	The mark-compact collector needs no second semispace. Live cells are
+ *	marked in a bitmap, and slid down to the bottom of the heap in their
+ *	original order. The new address of a cell is its rank among the marked
+ *	cells, which is found from a table of marked cells below each bitmap
+ *	word and a popcount, so no forwarding pointers are stored in the heap.
+ */
+static int
+lispIsMarked(LispMachine *m, size_t off)
+{
+	size_t cell = off / 2;
+	return (m->compact.marks[cell / 64] >> (cell % 64)) & 1;
+}
+
+static LispRef
+lispMark(LispMachine *m, LispRef ref)
+{
+	if(reftag(ref) == LISP_TAG_EXTREF)
+		lispMarkExt(m, ref);
+	if(reftag(ref) != LISP_TAG_PAIR || ref == LISP_NIL)
+		return ref;
+	size_t cell = urefval(ref) / 2;
+	uint64_t bit = (uint64_t)1 << (cell % 64);
+	if((m->compact.marks[cell / 64] & bit) != 0)
+		return ref;
+	m->compact.marks[cell / 64] |= bit;
+	// the rest of a block is marked with it, so that it slides as one.
+	LispRef *p = m->mem.ref + urefval(ref);
+	size_t end = cell + lispBlockSize(m, p[LISP_CAR_OFFSET], p[LISP_CDR_OFFSET]) / 2;
+	for(size_t i = cell + 1; i < end; i++)
+		m->compact.marks[i / 64] |= (uint64_t)1 << (i % 64);
+	if(m->compact.sp == m->compact.cap){
+		size_t cap = m->compact.cap != 0 ? 2*m->compact.cap : LISP_MARK_STACK;
+		LispRef *p = realloc(m->compact.stack, cap * sizeof p[0]);
+		if(p == NULL){
+			// a marked cell that doesn't fit on the stack gets its fields
+			// marked when the heap is rescanned.
+			m->compact.overflow = 1;
+			if(urefval(ref) < m->compact.low)
+				m->compact.low = urefval(ref);
+			return ref;
+		}
+		m->compact.stack = p;
+		m->compact.cap = cap;
+	}
+	m->compact.stack[m->compact.sp++] = ref;
+	return ref;
+}
+
+static void
+lispMarkStack(LispMachine *m)
+{
+	while(m->compact.sp > 0){
+		size_t off = urefval(m->compact.stack[--m->compact.sp]);
+		size_t num = lispBlockSize(m, m->mem.ref[off + LISP_CAR_OFFSET], m->mem.ref[off + LISP_CDR_OFFSET]);
+		for(size_t i = 0; i < num; i++)
+			lispMark(m, m->mem.ref[off + i]);
+	}
+}
+
+static LispRef
+lispRelocate(LispMachine *m, LispRef ref)
+{
+	if(reftag(ref) != LISP_TAG_PAIR || ref == LISP_NIL)
+		return ref;
+	size_t cell = urefval(ref) / 2;
+	uint64_t below = ((uint64_t)1 << (cell % 64)) - 1;
+	size_t rank = m->compact.ranks[cell / 64] + __builtin_popcountll(m->compact.marks[cell / 64] & below);
+	return mkref(2 + 2*rank, LISP_TAG_PAIR);
+}
 
-				// push a new 'environment head' in.
-				m->envr = lispCons(m, LISP_NIL, m->envr);
-				// clear the registers.
-				lispRelease(m, argnames);
-				lispRelease(m, args);
+static void
+lispCompact(LispMachine *m)
+{
+	size_t len = (m->mem.len/2 + 63) / 64;
 
-				// parameters are bound, pull body from lambda to m->expr.
-				LispRef function = lispCar(m, m->expr); // function = car expr
-				LispRef lambda = lispCar(m, lispCdr(m, function));
-				m->expr = lispCdr(m, lispCdr(m, lambda));
-				lispPush(m, m->expr);
-				lispGoto(m, LISP_STATE_BETA3);
-				goto again;
-			}
-	case LISP_STATE_BETA3:{
-				LispRef tmp = lispPeek(m);
-				if(tmp != LISP_NIL){
-					m->expr = lispCar(m, tmp);
-					tmp = lispCdr(m, tmp);
-					lispSetCar(m, m->stack, tmp);
-					if(tmp != LISP_NIL){
-						lispCall(m, LISP_STATE_BETA3, LISP_STATE_EVAL);
-						goto again;
-					} else { // tail call
-						lispPop(m);
-						lispGoto(m, LISP_STATE_EVAL);
-						goto again;
-					}
-				}
-				lispPop(m); // pop expr.
-				lispReturn(m);
-				goto again;
+	if(len > m->compact.len){
+		void *p = realloc(m->compact.marks, len * sizeof m->compact.marks[0]);
+		void *q = realloc(m->compact.ranks, len * sizeof m->compact.ranks[0]);
+		if(p == NULL || q == NULL){
+			fprintf(stderr, "lispCompact: realloc failed\n");
+			abort();
+		}
+		m->compact.marks = p;
+		m->compact.ranks = q;
+		m->compact.len = len;
+	}
+	memset(m->compact.marks, 0, len * sizeof m->compact.marks[0]);
+	lispClearExt(m);
+	m->compact.sp = 0;
+	m->compact.overflow = 0;
+	m->compact.low = SIZE_MAX;
+	m->gclock++;
+
+	// mark everything reachable from the roots.
+	lispCopyRoots(m, lispMark);
+	lispMarkStack(m);
+	while(m->compact.overflow){
+		size_t low = m->compact.low;
+		m->compact.overflow = 0;
+		m->compact.low = SIZE_MAX;
+		for(size_t off = low; off < m->mem.len; off += 2){
+			if(lispIsMarked(m, off)){
+				lispMark(m, m->mem.ref[off + LISP_CAR_OFFSET]);
+				lispMark(m, m->mem.ref[off + LISP_CDR_OFFSET]);
+				lispMarkStack(m);
 			}
 		}
-		fprintf(stderr, "lispStep eval: unrecognized form: ");
-		//eval_print(m);
-		fprintf(stderr, "\n");
-		m->value = lispBuiltin(m, LISP_BUILTIN_ERROR);
-		lispReturn(m);
-		goto again;
 	}
+
+	// count the marked cells below each word.
+	size_t rank = 0;
+	for(size_t i = 0; i < len; i++){
+		m->compact.ranks[i] = rank;
+		rank += __builtin_popcountll(m->compact.marks[i]);
+	}
+
+	// point everything to the new addresses, then slide the cells down.
+	lispCopyRoots(m, lispRelocate);
+	for(size_t off = 2; off < m->mem.len; off += 2){
+		if(lispIsMarked(m, off)){
+			LispRef *p = m->mem.ref + off;
+			LispRef *q = lispCellPointer(m, lispRelocate(m, mkref(off, LISP_TAG_PAIR)));
+			q[LISP_CAR_OFFSET] = lispRelocate(m, p[LISP_CAR_OFFSET]);
+			q[LISP_CDR_OFFSET] = lispRelocate(m, p[LISP_CDR_OFFSET]);
+			if(q != p)
+				m->stats.copied += 2 * sizeof m->mem.ref[0];
+		}
+	}
+	m->mem.len = 2 + 2*rank;
+	m->stats.collections++;
+	lispSweepExt(m);
+	lispTrim(m);
+	m->gclock--;
 }
 
+#if LISP_USE_THREADS
 /*
- *	The following two routines implement a copying garbage collector.
- *
- *	Lispcopy takes two machines as parameters, and a reference in oldm.
- *	If the element is a pair, check whether it is a forwarding entry or not.
- *	If yes, return what the forwarding entry has.
- *	Else, append the (unmodified) pair to newm and change the pair in oldm into
- *	a forwarding entry to the pair's location in newm.
- *
- *	Strings, symbol names and their index are eternal constants which can be
- *	freed entirely if printing of constants or symbol names isn't required and
- *	memory is somehow really that scarce.
+ *	The parallel collector splits the Cheney scan between worker threads.
+ *	Each worker copies into a private chunk of the new space and publishes
+ *	the chunk on its queue when it is full, or when the worker runs out of
+ *	other work. Workers scan ranges from their own queue first, and steal
+ *	from the other queues. An old cell is claimed by swapping its car to
+ *	busy, and becomes a forwarding entry once the copy is in place. It is
+ *	off unless m->gcthreads asks for two workers or more: the claims and
+ *	the queues cost more than they save on a single core.
  */
+typedef struct LispRange LispRange;
+typedef struct LispWorker LispWorker;
+typedef struct LispParallel LispParallel;
+
+struct LispRange {
+	size_t start;
+	size_t end;
+};
+
+struct LispWorker {
+	LispParallel *par;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	LispRange *queue;
+	size_t head;
+	size_t len;
+	size_t cap;
+	// the chunk being copied to: cells from base to fill are unpublished.
+	size_t base;
+	size_t fill;
+	size_t end;
+	size_t copied;
+};
+
+struct LispParallel {
+	LispMachine *m;
+	LispWorker *workers;
+	int n;
+	size_t top;
+	size_t pending;
+	int idle;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void
+lispPushRange(LispWorker *w, size_t start, size_t end)
+{
+	LispParallel *par = w->par;
+	pthread_mutex_lock(&w->lock);
+	if(w->len == w->cap){
+		w->cap = (w->cap == 0) ? 64 : 2*w->cap;
+		void *p = realloc(w->queue, w->cap * sizeof w->queue[0]);
+		if(p == NULL){
+			fprintf(stderr, "lispPushRange: realloc failed\n");
+			abort();
+		}
+		w->queue = p;
+	}
+	w->queue[w->len].start = start;
+	w->queue[w->len].end = end;
+	w->len++;
+	pthread_mutex_unlock(&w->lock);
+	__atomic_add_fetch(&par->pending, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&par->idle, __ATOMIC_SEQ_CST) > 0){
+		pthread_mutex_lock(&par->lock);
+		pthread_cond_broadcast(&par->cond);
+		pthread_mutex_unlock(&par->lock);
+	}
+}
+
+static int
+lispPopRange(LispWorker *w, LispRange *r, int steal)
+{
+	int found = 0;
+	pthread_mutex_lock(&w->lock);
+	if(w->head < w->len){
+		// the owner takes the newest range, thieves take the oldest.
+		if(steal)
+			*r = w->queue[w->head++];
+		else
+			*r = w->queue[--w->len];
+		if(w->head == w->len)
+			w->head = w->len = 0;
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	if(found)
+		__atomic_sub_fetch(&w->par->pending, 1, __ATOMIC_SEQ_CST);
+	return found;
+}
+
+static size_t
+lispWorkerAlloc(LispWorker *w, size_t num)
+{
+	if(w->fill == w->end){
+		if(w->fill != w->base)
+			lispPushRange(w, w->base, w->fill);
+		w->base = __atomic_fetch_add(&w->par->top, LISP_GC_CHUNK, __ATOMIC_RELAXED);
+		w->fill = w->base;
+		w->end = w->base + LISP_GC_CHUNK;
+	}
+	size_t off = w->fill;
+	w->fill += num;
+	w->copied += num;
+	return off;
+}
+
 static LispRef
-lispCopy(LispMachine *newm, LispMachine *oldm, LispRef ref)
+lispCopyParallel(LispWorker *w, LispRef ref)
 {
-	if(lispIsList(oldm, ref)){
-		if(ref == LISP_NIL)
-			return LISP_NIL;
-		if(lispIsBuiltin(oldm, lispCar(oldm, ref), LISP_BUILTIN_FORWARD))
-			return lispCdr(oldm, ref);
-		// load from old, cons in new. this is the copy phase: any references in
-		// the new cell will point to something in oldm.
-		LispRef newref = lispCons(newm, lispCar(oldm, ref), lispCdr(oldm, ref));
-		// rewrite oldm to point to new.
-		lispSetCar(oldm, ref, lispBuiltin(oldm, LISP_BUILTIN_FORWARD));
-		lispSetCdr(oldm, ref, newref);
-		return newref;
+	LispMachine *m = w->par->m;
+	if(reftag(ref) == LISP_TAG_EXTREF){
+		size_t i = refval(ref);
+		__atomic_fetch_or(&m->extrefs.marks[i / 32], (uint32_t)1 << (i % 32), __ATOMIC_RELAXED);
 	}
-	return ref;
+	if(reftag(ref) != LISP_TAG_PAIR || ref == LISP_NIL)
+		return ref;
+	LispRef *old = m->copy.ref + urefval(ref);
+	LispRef forward = lispBuiltin(m, LISP_BUILTIN_FORWARD);
+	LispRef busy = lispBuiltin(m, LISP_BUILTIN_BUSY);
+	LispRef car = __atomic_load_n(&old[LISP_CAR_OFFSET], __ATOMIC_ACQUIRE);
+	for(;;){
+		if(car == forward)
+			return __atomic_load_n(&old[LISP_CDR_OFFSET], __ATOMIC_RELAXED);
+		if(car == busy){
+			// another worker is copying it, the forwarding entry is
+			// about to appear.
+			car = __atomic_load_n(&old[LISP_CAR_OFFSET], __ATOMIC_ACQUIRE);
+			continue;
+		}
+		if(__atomic_compare_exchange_n(&old[LISP_CAR_OFFSET], &car, busy, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			break;
+	}
+	// a vector or a string that doesn't fit in the chunk gets a block of
+	// its own at the top, which is published once it has been copied.
+	size_t num = lispBlockSize(m, car, old[LISP_CDR_OFFSET]), off;
+	int own = 0;
+	if(w->end - w->fill < num && num > 2){
+		off = __atomic_fetch_add(&w->par->top, num, __ATOMIC_RELAXED);
+		w->copied += num;
+		own = 1;
+	} else
+		off = lispWorkerAlloc(w, num);
+	m->mem.ref[off + LISP_CAR_OFFSET] = car;
+	memcpy(m->mem.ref + off + 1, old + 1, (num - 1) * sizeof old[0]);
+	LispRef newref = mkref(off, LISP_TAG_PAIR);
+	__atomic_store_n(&old[LISP_CDR_OFFSET], newref, __ATOMIC_RELAXED);
+	__atomic_store_n(&old[LISP_CAR_OFFSET], forward, __ATOMIC_RELEASE);
+	if(own)
+		lispPushRange(w, off, off + num);
+	return newref;
+}
+
+static void *
+lispWorkerMain(void *arg)
+{
+	LispWorker *w = arg;
+	LispParallel *par = w->par;
+	LispMachine *m = par->m;
+	int self = w - par->workers;
+	LispRange r;
+
+	for(;;){
+		int found = lispPopRange(w, &r, 0);
+		for(int i = 1; !found && i < par->n; i++)
+			found = lispPopRange(&par->workers[(self+i) % par->n], &r, 1);
+		if(found){
+			for(size_t i = r.start; i < r.end; i++)
+				m->mem.ref[i] = lispCopyParallel(w, m->mem.ref[i]);
+			continue;
+		}
+		if(w->fill != w->base){
+			lispPushRange(w, w->base, w->fill);
+			w->base = w->fill;
+			continue;
+		}
+		// out of work. the collection is over when every worker is idle
+		// and there is nothing left on the queues.
+		pthread_mutex_lock(&par->lock);
+		__atomic_add_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+		while(!par->done && __atomic_load_n(&par->pending, __ATOMIC_SEQ_CST) == 0){
+			if(__atomic_load_n(&par->idle, __ATOMIC_SEQ_CST) == par->n){
+				par->done = 1;
+				pthread_cond_broadcast(&par->cond);
+				break;
+			}
+			pthread_cond_wait(&par->cond, &par->lock);
+		}
+		if(par->done){
+			pthread_mutex_unlock(&par->lock);
+			break;
+		}
+		__atomic_sub_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&par->lock);
+	}
+	return NULL;
+}
+
+/*
+ *	Scan the new space with m->gcthreads workers, the calling thread being
+ *	one of them. The roots have been copied by lispFlip, and they seed the
+ *	work queues. Returns 0 if the heap is too small to bother.
+ */
+static int
+lispScanParallel(LispMachine *m)
+{
+	// even if everything survives, the new space needs room for the unused
+	// chunk tails (see lispHeadroom).
+	size_t need = m->copy.len + (m->gcthreads+1) * LISP_GC_CHUNK;
+	if(m->gcthreads < 2 || m->copy.cap < LISP_PARALLEL_MIN || m->mem.cap < need)
+		return 0;
+
+	LispParallel par;
+	memset(&par, 0, sizeof par);
+	par.m = m;
+	par.n = m->gcthreads;
+	par.workers = calloc(par.n, sizeof par.workers[0]);
+	if(par.workers == NULL)
+		return 0;
+	pthread_mutex_init(&par.lock, NULL);
+	pthread_cond_init(&par.cond, NULL);
+
+	for(int i = 0; i < par.n; i++){
+		par.workers[i].par = &par;
+		pthread_mutex_init(&par.workers[i].lock, NULL);
+	}
+	for(size_t i = 2, j = 0; i < m->mem.len; i += LISP_GC_CHUNK, j++){
+		size_t end = i + LISP_GC_CHUNK < m->mem.len ? i + LISP_GC_CHUNK : m->mem.len;
+		lispPushRange(&par.workers[j % par.n], i, end);
+	}
+	par.top = m->mem.len;
+
+	int started = 1;
+	for(int i = 1; i < par.n; i++, started++)
+		if(pthread_create(&par.workers[i].thread, NULL, lispWorkerMain, &par.workers[i]) != 0)
+			break;
+	if(started < par.n){
+		// a worker that failed to start counts as permanently idle.
+		pthread_mutex_lock(&par.lock);
+		__atomic_add_fetch(&par.idle, par.n - started, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&par.cond);
+		pthread_mutex_unlock(&par.lock);
+	}
+	lispWorkerMain(&par.workers[0]);
+	for(int i = 1; i < started; i++)
+		pthread_join(par.workers[i].thread, NULL);
+
+	// fill the unused chunk tails with nil pairs.
+	for(int i = 0; i < par.n; i++){
+		LispWorker *w = &par.workers[i];
+		lispMemSet(m->mem.ref + w->fill, LISP_NIL, w->end - w->fill);
+		m->stats.copied += w->copied * sizeof m->mem.ref[0];
+		pthread_mutex_destroy(&w->lock);
+		free(w->queue);
+	}
+	m->mem.len = par.top;
+	pthread_mutex_destroy(&par.lock);
+	pthread_cond_destroy(&par.cond);
+	free(par.workers);
+	return 1;
 }
+#else
+static int
+lispScanParallel(LispMachine *m)
+{
+	return 0;
+}
+#endif
 
 /*
  *	This is the main garbage collector routine. The idea is to create the root
- *	set from vm registers using lispCopy to an otherwise empty machine.
+ *	set from vm registers using lispCopy to an otherwise empty memory.
  *	After the root set is formed, it proceeds in a breath-first manner, calling
  *	lispCopy on all of its memory locations until everything has been collapsed.
  */
@@ -1849,46 +5979,480 @@ lispCollect(LispMachine *m)
 	if(m->mem.len == 0)
 		return;
 
-	size_t oldlen = m->mem.len;
-	// There are two "memories" within m, namely m->mem and m->copy.
-	// we create a copy of m called oldm here, and then exchange m->mem and
-	// m->copy. It's a waste of memory, but it avoids one big malloc per gc.
-	LispMachine oldm;
-	memcpy(&oldm, m, sizeof oldm);
-	memcpy(&m->mem, &oldm.copy, sizeof m->mem);
-	if(m->mem.cap != oldm.mem.cap){
-		fprintf(stderr, "resizing from %zu to %zu\n", m->mem.cap, oldm.mem.cap);
-		m->mem.cap = oldm.mem.cap;
-		void *p = realloc(m->mem.ref, m->mem.cap * sizeof m->mem.ref[0]);
-		if(p == NULL){
-			fprintf(stderr, "realloc failed during garbage collection. whoops\n");
-			abort();
-		}
-		m->mem.ref = p;
-		lispMemSet(m->mem.ref, LISP_NIL, m->mem.cap);
+	lispPauseBegin(m);
+	if(m->gcmode == LISP_GC_COMPACT){
+		lispCompact(m);
+		lispPauseEnd(m);
+		return;
 	}
-	m->mem.len = 0;
-	memcpy(&m->copy, &oldm.mem, sizeof m->copy);
+
+	// finish an incremental collection in progress before starting over.
+	if(m->incremental.active)
+		lispCollectStep(m, SIZE_MAX);
+
+	lispFlip(m);
+	m->incremental.active = 0;
 	m->gclock++;
+	if(!lispScanParallel(m))
+		for(size_t i = 2; i < m->mem.len; i++)
+			m->mem.ref[i] = lispCopy(m, m->mem.ref[i]);
+
+	m->stats.collections++;
+	lispSweepExt(m);
+	lispTrim(m);
+	if(m->gcmode == LISP_GC_GENERATIONAL)
+		lispResetNursery(m);
+	m->gclock--;
+	lispPauseEnd(m);
+}
 
-	// copy the "dynamic" registers.
-	uint32_t reguse = oldm.reguse;
-	for(size_t i = 0; i < nelem(m->regs); i++)
-		if((reguse & (1<<i)) != 0)
-			m->regs[i] = lispCopy(m, &oldm, oldm.regs[i]);
-	m->reguse = reguse;
+/*
+ *	One slice of an incremental collection. The scan picks up where the
+ *	previous slice left off, and stops after looking at budget references.
+ *	Allocation calls this, but a program driving lispStep can call it between
+ *	steps too. Returns 1 if the collection is still in progress.
+ */
+int
+lispCollectStep(LispMachine *m, size_t budget)
+{
+	if(!m->incremental.active)
+		return 0;
+	lispPauseBegin(m);
+	m->gclock++;
+	size_t work = 0;
+	while(m->incremental.scan < m->mem.len && work < budget){
+		if(lispIsGray(m, m->incremental.scan))
+			lispScanCell(m, m->incremental.scan);
+		m->incremental.scan += 2;
+		work += 2;
+	}
+	if(m->incremental.scan >= m->mem.len){
+		m->incremental.active = 0;
+		m->stats.collections++;
+		lispSweepExt(m);
+		lispTrim(m);
+	}
+	m->gclock--;
+	lispPauseEnd(m);
+	return m->incremental.active;
+}
 
-	m->value = lispCopy(m, &oldm, oldm.value);
-	m->expr = lispCopy(m, &oldm, oldm.expr);
-	m->envr = lispCopy(m, &oldm, oldm.envr);
-	m->stack = lispCopy(m, &oldm, oldm.stack);
+/*
+ *	Lispcopy for minor collections. References to the old generation are
+ *	returned as is. Nursery cells are copied to the scratch space in m->copy,
+ *	but they are given addresses as if they had been appended to the old
+ *	generation, which is where they are moved once the minor collection is
+ *	done.
+ */
+static LispRef
+lispPromote(LispMachine *m, LispRef ref)
+{
+	if(reftag(ref) != LISP_TAG_PAIR || urefval(ref) < m->nursery.oldlen)
+		return ref;
+	LispRef *young = m->mem.ref + urefval(ref);
+	if(lispIsBuiltin(m, young[LISP_CAR_OFFSET], LISP_BUILTIN_FORWARD))
+		return young[LISP_CDR_OFFSET];
+	size_t num = lispBlockSize(m, young[LISP_CAR_OFFSET], young[LISP_CDR_OFFSET]);
+	LispRef newref = mkref(m->nursery.oldlen + m->copy.len, LISP_TAG_PAIR);
+	memcpy(m->copy.ref + m->copy.len, young, num * sizeof young[0]);
+	m->copy.len += num;
+	young[LISP_CAR_OFFSET] = lispBuiltin(m, LISP_BUILTIN_FORWARD);
+	young[LISP_CDR_OFFSET] = newref;
+	return newref;
+}
 
-	for(size_t i = 2; i < m->mem.len; i++)
-		m->mem.ref[i] = lispCopy(m, &oldm, m->mem.ref[i]);
+/*
+ *	A minor collection evacuates the live part of the nursery. The roots are
+ *	the vm registers and the cells on dirty cards, so the work done is
+ *	proportional to the survivors and the remembered set, not the heap.
+ */
+static void
+lispCollectMinor(LispMachine *m)
+{
+	// the first pair is nil, it is old by definition.
+	if(m->nursery.oldlen < 2)
+		m->nursery.oldlen = 2;
+	size_t base = m->nursery.oldlen;
+	if(m->mem.len < base)
+		return;
+	size_t young = m->mem.len - base;
+	if(m->copy.cap < young)
+		lispResizeSpace(&m->copy, m->mem.cap);
+	m->copy.len = 0;
+	lispPauseBegin(m);
+	m->gclock++;
 
-//if(1)fprintf(stderr, "collected: from %zu to %zu\n", oldlen, m->mem.len);
+	lispCopyRoots(m, lispPromote);
+	for(size_t i = 0; i < m->nursery.len; i++){
+		size_t card = m->nursery.dirty[i];
+		size_t end = (card+1) << LISP_CARD_BITS;
+		if(end > base)
+			end = base;
+		for(size_t j = card << LISP_CARD_BITS; j < end; j++)
+			m->mem.ref[j] = lispPromote(m, m->mem.ref[j]);
+	}
+	for(size_t i = 0; i < m->copy.len; i++)
+		m->copy.ref[i] = lispPromote(m, m->copy.ref[i]);
 
+	// the survivors become the tail of the old generation.
+	memcpy(m->mem.ref + base, m->copy.ref, m->copy.len * sizeof m->copy.ref[0]);
+	m->mem.len = base + m->copy.len;
+	m->stats.minors++;
+	m->stats.copied += m->copy.len * sizeof m->copy.ref[0];
+	m->copy.len = 0;
+	lispResetNursery(m);
 	m->gclock--;
+	lispPauseEnd(m);
+}
+
+/*
+ *	Copy out the collector counters, along with the current sizes of the
+ *	heap and the tables next to it.
+ */
+void
+lispGetStats(LispMachine *m, LispStats *stats)
+{
+	*stats = m->stats;
+	stats->heapbytes = m->mem.cap * sizeof m->mem.ref[0];
+	stats->extrefs = m->extrefs.count;
+	stats->strings = m->strings.len;
+}
+
+/*
+ *	A heap image holds what lispInit and the programs loaded after it leave
+ *	behind: the cells, the symbol names and their index, the environment and
+ *	the extref table. References are offsets, so the cells need no
+ *	relocation. The objects behind extrefs are not saved, only the names of
+ *	their types, which are looked up among the types given to lispAddExtType
+ *	when the image is loaded, and the keys the save hooks of the types give
+ *	for them. The cells start at a page aligned offset, so that they can be
+ *	mapped straight into the heap.
+ */
+#define LISP_IMAGE_ALIGN 65536
+#define LISP_IMAGE_NAME 32
+
+// an extref slot in the image: its state, the name of its type and the key
+// of its object.
+#define LISP_IMAGE_EXT (1 + LISP_IMAGE_NAME + LISP_EXT_KEY)
+enum {
+	LISP_IMAGE_FREE,
+	LISP_IMAGE_NOOBJ, // the object was NULL
+	LISP_IMAGE_KEY, // the type restores the object from the key
+	LISP_IMAGE_LOST, // the object couldn't be saved
+};
+
+typedef struct LispImage LispImage;
+struct LispImage {
+	char magic[8];
+	uint32_t check;
+	LispRef envr;
+	uint64_t memoff;
+	uint64_t memlen;
+	uint64_t stroff;
+	uint64_t strlen;
+	uint64_t idxoff;
+	uint64_t idxcap;
+	uint64_t idxlen;
+	uint64_t extoff;
+	uint64_t extlen;
+};
+
+static char lispImageMagic[8] = "blimage";
+
+// images only load into the build that saved them: hash what the references
+// mean.
+static uint32_t
+lispImageCheck(void)
+{
+	uint32_t hval = fnv32a("basiclisp", LISP_STATE_SPECIAL_FORMS);
+	hval = hval*31 + sizeof(LispRef);
+	hval = hval*31 + LISP_LOWTAG;
+	hval = hval*31 + LISP_INLINE_SYMBOL;
+	hval = hval*31 + LISP_IMAGE_EXT;
+	for(size_t i = 0; i < LISP_NUM_BUILTINS; i++)
+		if(bltnames[i] != NULL)
+			hval = fnv32a(bltnames[i], hval);
+	return hval;
+}
+
+int
+lispAddExtType(LispMachine *m, LispExtType *type)
+{
+	if(m->exttypes.len == m->exttypes.cap){
+		m->exttypes.cap = nextPow2(m->exttypes.cap);
+		void *p = realloc(m->exttypes.p, m->exttypes.cap * sizeof m->exttypes.p[0]);
+		if(p == NULL)
+			return -1;
+		m->exttypes.p = p;
+	}
+	m->exttypes.p[m->exttypes.len++] = type;
+	return 0;
+}
+
+/*
+ *	Save the machine to path. It has to be at the top level, with nothing on
+ *	the stack or in registers. A full collection is done first, so that only
+ *	live cells go to the image. The image is written to path.tmp and renamed
+ *	over path once it is on disk, so a machine that has path mapped keeps
+ *	its pages, and a failed save leaves the old image as it was.
+ */
+int
+lispSaveImage(LispMachine *m, char *path)
+{
+	if(m->stack.len != 0 || m->roots.len != 0){
+		fprintf(stderr, "lispSaveImage: machine is busy\n");
+		return -1;
+	}
+	m->value = LISP_NIL;
+	m->expr = LISP_NIL;
+	m->act = LISP_NIL;
+	lispClearCode(m);
+#if LISP_JIT
+	lispJitReset(m);
+#endif
+	lispCollect(m);
+
+	LispImage img;
+	memset(&img, 0, sizeof img);
+	memcpy(img.magic, lispImageMagic, sizeof img.magic);
+	img.check = lispImageCheck();
+	img.envr = m->envr;
+	img.memoff = LISP_IMAGE_ALIGN;
+	img.memlen = m->mem.len;
+	img.stroff = img.memoff + img.memlen * sizeof m->mem.ref[0];
+	img.strlen = m->strings.len;
+	img.idxoff = img.stroff + img.strlen;
+	img.idxcap = m->stringIndex.cap;
+	img.idxlen = m->stringIndex.len;
+	img.extoff = img.idxoff + img.idxcap * sizeof m->stringIndex.ref[0];
+	img.extlen = m->extrefs.len;
+
+	size_t tmplen = strlen(path) + sizeof ".tmp";
+	char *tmp = malloc(tmplen);
+	if(tmp == NULL){
+		fprintf(stderr, "lispSaveImage: out of memory\n");
+		return -1;
+	}
+	snprintf(tmp, tmplen, "%s.tmp", path);
+	FILE *fp = fopen(tmp, "wb");
+	if(fp == NULL){
+		fprintf(stderr, "lispSaveImage: cannot create %s\n", tmp);
+		free(tmp);
+		return -1;
+	}
+	fwrite(&img, sizeof img, 1, fp);
+	fseek(fp, img.memoff, SEEK_SET);
+	fwrite(m->mem.ref, sizeof m->mem.ref[0], img.memlen, fp);
+	fwrite(m->strings.p, 1, img.strlen, fp);
+	fwrite(m->stringIndex.ref, sizeof m->stringIndex.ref[0], img.idxcap, fp);
+	for(size_t i = 0; i < img.extlen; i++){
+		char rec[LISP_IMAGE_EXT];
+		memset(rec, 0, sizeof rec);
+		LispExtType *type = m->extrefs.p[i].type;
+		void *obj = m->extrefs.p[i].obj;
+		if(!m->extrefs.p[i].free){
+			rec[0] = LISP_IMAGE_NOOBJ;
+			if(type != NULL && (type->name == NULL || strlen(type->name) >= LISP_IMAGE_NAME)){
+				fprintf(stderr, "lispSaveImage: extref type without a usable name\n");
+				fclose(fp);
+				remove(tmp);
+				free(tmp);
+				return -1;
+			}
+			if(type != NULL)
+				strcpy(rec + 1, type->name);
+			char *key = rec + 1 + LISP_IMAGE_NAME;
+			if(obj != NULL){
+				rec[0] = LISP_IMAGE_LOST;
+				if(type != NULL && type->save != NULL && type->restore != NULL && type->save(m, obj, key) == 0)
+					rec[0] = LISP_IMAGE_KEY;
+				key[LISP_EXT_KEY-1] = '\0';
+			}
+		}
+		fwrite(rec, sizeof rec, 1, fp);
+	}
+	int err = ferror(fp) || fflush(fp) != 0;
+#if LISP_USE_MMAP
+	err = err || fsync(fileno(fp)) != 0;
+#endif
+	err = fclose(fp) != 0 || err;
+	if(err || rename(tmp, path) != 0){
+		fprintf(stderr, "lispSaveImage: write error on %s\n", tmp);
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+// do n items of size bytes at off fit in an image file of filesize bytes.
+static int
+lispImageFits(uint64_t filesize, uint64_t off, uint64_t n, size_t size)
+{
+	return off <= filesize && n <= (filesize - off) / size;
+}
+
+static void *
+lispImageRead(FILE *fp, uint64_t off, size_t len)
+{
+	void *p = malloc(len > 0 ? len : 1);
+	if(p == NULL)
+		return NULL;
+	if(fseek(fp, off, SEEK_SET) == -1 || fread(p, 1, len, fp) != len){
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ *	Load an image into a machine that has just had its collector selected,
+ *	instead of calling lispInit. The extref types in the image have to be
+ *	given to lispAddExtType first.
+ */
+int
+lispLoadImage(LispMachine *m, char *path)
+{
+	LispImage img;
+	char *ext = NULL;
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL){
+		fprintf(stderr, "lispLoadImage: cannot open %s\n", path);
+		return -1;
+	}
+	if(m->mem.len != 0)
+		goto fail;
+	if(fread(&img, sizeof img, 1, fp) != 1 || memcmp(img.magic, lispImageMagic, sizeof img.magic) != 0)
+		goto fail;
+	if(img.check != lispImageCheck()){
+		fprintf(stderr, "lispLoadImage: %s was saved by a different build\n", path);
+		goto fail;
+	}
+	// a truncated or damaged image mustn't send the reads, or the pages
+	// of the mapping, past the end of the file.
+	long filesize;
+	if(fseek(fp, 0, SEEK_END) == -1 || (filesize = ftell(fp)) == -1)
+		goto fail;
+	if(img.memoff < sizeof img || !lispImageFits(filesize, img.memoff, img.memlen, sizeof m->mem.ref[0])
+			|| !lispImageFits(filesize, img.stroff, img.strlen, 1)
+			|| !lispImageFits(filesize, img.idxoff, img.idxcap, sizeof m->stringIndex.ref[0]) || img.idxlen > img.idxcap
+			|| !lispImageFits(filesize, img.extoff, img.extlen, LISP_IMAGE_EXT)
+			|| !lispIsPair(m, img.envr) || urefval(img.envr) + 2 > img.memlen){
+		fprintf(stderr, "lispLoadImage: %s is truncated or damaged\n", path);
+		goto fail;
+	}
+
+	m->strings.p = lispImageRead(fp, img.stroff, img.strlen);
+	m->stringIndex.ref = lispImageRead(fp, img.idxoff, img.idxcap * sizeof m->stringIndex.ref[0]);
+	ext = lispImageRead(fp, img.extoff, img.extlen * LISP_IMAGE_EXT);
+	if(m->strings.p == NULL || m->stringIndex.ref == NULL || ext == NULL)
+		goto fail;
+	m->strings.len = img.strlen;
+	m->strings.cap = img.strlen;
+	m->stringIndex.len = img.idxlen;
+	m->stringIndex.cap = img.idxcap;
+
+	// the extref table keeps its slot numbers, with the types looked up by
+	// name and the objects restored from their keys.
+	size_t lost = 0;
+	m->extrefs.cap = nextPow2(img.extlen);
+	m->extrefs.p = calloc(m->extrefs.cap, sizeof m->extrefs.p[0]);
+	m->extrefs.marks = calloc((m->extrefs.cap + 31) / 32, sizeof m->extrefs.marks[0]);
+	if(m->extrefs.p == NULL || m->extrefs.marks == NULL)
+		goto fail;
+	m->extrefs.len = img.extlen;
+	for(size_t i = img.extlen; i-- > 0;){
+		char *rec = ext + i * LISP_IMAGE_EXT;
+		char *key = rec + 1 + LISP_IMAGE_NAME;
+		rec[LISP_IMAGE_NAME] = '\0';
+		key[LISP_EXT_KEY-1] = '\0';
+		if(rec[0] == LISP_IMAGE_FREE)
+			continue;
+		m->extrefs.count++;
+		if(rec[1] == '\0')
+			continue;
+		LispExtType *type = NULL;
+		if(!strcmp(rec + 1, lispNativeType.name))
+			type = &lispNativeType;
+		for(size_t j = 0; type == NULL && j < m->exttypes.len; j++)
+			if(m->exttypes.p[j]->name != NULL && !strcmp(m->exttypes.p[j]->name, rec + 1))
+				type = m->exttypes.p[j];
+		if(type == NULL){
+			fprintf(stderr, "lispLoadImage: unknown extref type %s\n", rec + 1);
+			goto fail;
+		}
+		m->extrefs.p[i].type = type;
+		if(rec[0] == LISP_IMAGE_KEY && type->restore != NULL)
+			m->extrefs.p[i].obj = type->restore(m, key);
+		if(rec[0] == LISP_IMAGE_LOST || (rec[0] == LISP_IMAGE_KEY && m->extrefs.p[i].obj == NULL)){
+			rec[0] = LISP_IMAGE_LOST;
+			lost++;
+		}
+	}
+
+	// map the cells if possible, read them if not.
+#if LISP_USE_MMAP
+	if(lispMapSpace(&m->mem, fileno(fp), img.memoff, img.memlen) == -1)
+#endif
+	{
+		lispResizeSpace(&m->mem, img.memlen);
+		if(fseek(fp, img.memoff, SEEK_SET) == -1 || fread(m->mem.ref, sizeof m->mem.ref[0], img.memlen, fp) != img.memlen)
+			goto fail;
+		m->mem.len = img.memlen;
+	}
+	m->envr = img.envr;
+
+	// the references to the extrefs that lost their objects become #error,
+	// and their slots go on the free list with the ones that were free.
+	if(lost > 0){
+		fprintf(stderr, "lispLoadImage: %zu extrefs in %s lost their objects\n", lost, path);
+		for(size_t i = 0; i < m->mem.len; i++){
+			LispRef ref = m->mem.ref[i];
+			if(lispIsExtRef(m, ref) && ext[urefval(ref) * LISP_IMAGE_EXT] == LISP_IMAGE_LOST)
+				m->mem.ref[i] = lispBuiltin(m, LISP_BUILTIN_ERROR);
+		}
+		m->extrefs.count -= lost;
+	}
+	for(size_t i = img.extlen; i-- > 0;){
+		char state = ext[i * LISP_IMAGE_EXT];
+		if(state == LISP_IMAGE_FREE || state == LISP_IMAGE_LOST){
+			m->extrefs.p[i].obj = NULL;
+			m->extrefs.p[i].type = NULL;
+			m->extrefs.p[i].free = 1;
+			m->extrefs.p[i].next = m->extrefs.free;
+			m->extrefs.free = i + 1;
+		}
+	}
+	m->extrefs.live = m->extrefs.count;
+	if(m->gcmode == LISP_GC_GENERATIONAL)
+		lispResetNursery(m);
+	lispIndexGlobals(m, m->envr);
+	free(ext);
+	fclose(fp);
+	return 0;
+fail:
+	fprintf(stderr, "lispLoadImage: cannot load %s\n", path);
+	free(ext);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ *	Select the garbage collector. A full collection is done first, so that
+ *	the new collector starts from a compact heap.
+ */
+void
+lispSetCollector(LispMachine *m, int mode)
+{
+	m->gcmode = mode;
+	lispCollect(m);
+	lispResetNursery(m);
+	if(mode != LISP_GC_GENERATIONAL)
+		m->nursery.oldlen = 0;
+	// the mark-compact collector works in place, release the copy space.
+	if(mode == LISP_GC_COMPACT)
+		lispResizeSpace(&m->copy, 0);
 }
 
 void
@@ -1896,6 +6460,7 @@ lispInit(LispMachine *m)
 {
 	// install initial environment (let built-ins)
 	m->envr = lispCons(m, LISP_NIL, LISP_NIL);
+	m->globals.head = m->envr;
 	for(size_t i = 0; i < LISP_NUM_BUILTINS; i++){
 		LispRef sym = lispSymbol(m, bltnames[i]);
 		lispDefine(m, sym, lispBuiltin(m, i));
@@ -1923,18 +6488,38 @@ lispSetPort(LispMachine *m, LispPort port, int (*writebyte)(int ch, void *ctx),
 LispRef
 lispExtAlloc(LispMachine *m)
 {
-	if(m->extrefs.len == m->extrefs.cap){
-		m->extrefs.cap = nextPow2(m->extrefs.cap);
-		void *p = realloc(m->extrefs.p, m->extrefs.cap * sizeof m->extrefs.p[0]);
-		if(p == NULL){
-			fprintf(stderr, "lispExtAlloc: realloc failed\n");
-			abort();
+	size_t i;
+	if(m->extrefs.free != 0){
+		// reuse a slot the collector has freed.
+		i = m->extrefs.free - 1;
+		m->extrefs.free = m->extrefs.p[i].next;
+	} else {
+		if(m->extrefs.len == m->extrefs.cap){
+			size_t oldwords = (m->extrefs.cap + 31) / 32;
+			m->extrefs.cap = nextPow2(m->extrefs.cap);
+			size_t words = (m->extrefs.cap + 31) / 32;
+			void *p = realloc(m->extrefs.p, m->extrefs.cap * sizeof m->extrefs.p[0]);
+			void *q = realloc(m->extrefs.marks, words * sizeof m->extrefs.marks[0]);
+			if(p == NULL || q == NULL){
+				fprintf(stderr, "lispExtAlloc: realloc failed\n");
+				abort();
+			}
+			m->extrefs.p = p;
+			m->extrefs.marks = q;
+			memset(m->extrefs.marks + oldwords, 0, (words - oldwords) * sizeof m->extrefs.marks[0]);
 		}
-		m->extrefs.p = p;
+		i = m->extrefs.len++;
 	}
-	LispRef ref = mkref(m->extrefs.len, LISP_TAG_EXTREF);
-	assert(urefval(ref) == m->extrefs.len);
-	m->extrefs.len++;
+	m->extrefs.p[i].obj = NULL;
+	m->extrefs.p[i].type = NULL;
+	m->extrefs.p[i].free = 0;
+	m->extrefs.p[i].next = 0;
+	m->extrefs.count++;
+	LispRef ref = mkref(i, LISP_TAG_EXTREF);
+	assert(urefval(ref) == i);
+	// an extref allocated during an incremental collection survives it.
+	if(m->incremental.active)
+		lispMarkExt(m, ref);
 	return ref;
 }
 
@@ -1965,3 +6550,42 @@ lispExtGet(LispMachine *m, LispRef ref, void **obj, void **type)
 	abort();
 	return -1;
 }
+
+/*
+ *	A native function is an extref that the interpreter applies itself, for
+ *	code compiled to C (see aot.c). native has to outlive the machine. It is
+ *	applied to the evaluated arguments without escaping to the host, so it
+ *	must not depend on the host to apply extrefs, and builtins it applies
+ *	go through lispApply.
+ */
+LispRef
+lispNative(LispMachine *m, LispNative *native)
+{
+	LispRef ref = lispExtAlloc(m);
+	lispExtSet(m, ref, native, &lispNativeType);
+	return ref;
+}
+
+// apply the builtin at the head of the evaluated form, for native
+// functions. what would escape to the host or evaluate is an error.
+LispRef
+lispApply(LispMachine *m, LispRef form)
+{
+	LispRef blt = lispCar(m, form);
+	if(!lispIsBuiltinTag(m, blt) || lispIsBuiltin(m, blt, LISP_BUILTIN_CALLCC) || lispIsBuiltin(m, blt, LISP_BUILTIN_EVAL))
+		return lispBuiltin(m, LISP_BUILTIN_ERROR);
+	// lispApplyBuiltin works on the registers of a running machine.
+	LispRef inst = m->inst;
+	LispRef *expr = lispRegister(m, m->expr);
+	LispRef *value = lispRegister(m, m->value);
+	m->expr = form;
+	LispRef result = lispBuiltin(m, LISP_BUILTIN_ERROR);
+	if(lispApplyBuiltin(m) == 0)
+		result = m->value;
+	m->inst = inst;
+	m->expr = *expr;
+	m->value = *value;
+	lispRelease(m, value);
+	lispRelease(m, expr);
+	return result;
+}
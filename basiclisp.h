@@ -1,12 +1,31 @@
 
+// LISP_REF64 makes references 64 bits wide: the tags stay the same, and
+// what is left for the values grows by 32 bits, see the tag comments.
+#if LISP_REF64
+typedef unsigned long long LispRef;
+typedef long long LispInt;
+#else
 typedef unsigned int LispRef;
+typedef int LispInt;
+#endif
 typedef unsigned int LispPort;
 typedef struct LispMachine LispMachine;
+typedef struct LispSpace LispSpace;
+typedef struct LispExtType LispExtType;
+typedef struct LispStats LispStats;
+typedef struct LispNative LispNative;
 
 // these are macros because enums are signed and these fiddle with the MSB.
 #define LISP_TAG_BIT ((LispRef)1<<(8*sizeof(LispRef)-1))
 #define	LISP_VAL_MASK ((LispRef)LISP_TAG_BIT-1)
+#if LISP_LOWTAG
+#define LISP_NIL (LispRef)0
+#else
 #define LISP_NIL (LispRef)(LISP_TAG_BIT>>LISP_TAG_PAIR)
+#endif
+// the range of the fixnums, past it integers are bignums.
+#define LISP_FIXNUM_MAX ((LispInt)(LISP_VAL_MASK >> LISP_TAG_INTEGER >> 1))
+#define LISP_FIXNUM_MIN (-LISP_FIXNUM_MAX-1)
 
 enum {
 	LISP_CAR_OFFSET = 0,
@@ -15,16 +34,26 @@ enum {
 	LISP_TOK_INTEGER = 1000,
 	LISP_TOK_SYMBOL,
 	LISP_TOK_STRING,
+	LISP_TOK_FLOAT,
+
+	// garbage collector modes, see lispCollect
+	LISP_GC_COPYING = 0,
+	LISP_GC_GENERATIONAL,
+	LISP_GC_INCREMENTAL,
+	LISP_GC_COMPACT,
 
 	LISP_INLINE_SYMBOL = 0x110000,  // all single unicode codepoints
 	//LISP_INLINE_SYMBOL = 0x80, // all ascii characters
 	//LISP_INLINE_SYMBOL = 0, // nothing
 
 	LISP_TAG_PAIR = 0,	// 1... .... 32k (2B) cells (pairs)
-	LISP_TAG_INTEGER,	// 01.. .... 16k (1B) unsigned ints
+	LISP_TAG_INTEGER,	// 01.. .... 16k (1B) signed ints
 	LISP_TAG_EXTREF,	// 001. ....  8k (512M) external objects
 	LISP_TAG_SYMBOL,	// 0001 ....  4k (256M) symbols (unicode codepoint or offset to name table)
 	LISP_TAG_BUILTIN,	// 0000 1...  2k (128M) built-in functions (enumerated below)
+	LISP_TAG_FLOAT,		// 0000 01..  1k (64M) floats (high bits of an ieee float, see lispFloat)
+	// the sizes are for 32 bit references, LISP_REF64 has 2^63 cells,
+	// 2^62 integers, and so on.
 
 	LISP_BUILTIN_CALLCC = 0,
 	LISP_BUILTIN_CAR,
@@ -68,11 +97,30 @@ enum {
 	// io
 	LISP_BUILTIN_PRINT1,
 
+	// runtime
+	LISP_BUILTIN_GCSTATS,
+
+	// vectors
+	LISP_BUILTIN_MAKEVECTOR,
+	LISP_BUILTIN_VECTORREF,
+	LISP_BUILTIN_VECTORSET,
+	LISP_BUILTIN_VECTORLENGTH,
+
+	// strings
+	LISP_BUILTIN_STRINGLENGTH,
+	LISP_BUILTIN_STRINGREF,
+
 	// error
 	LISP_BUILTIN_ERROR,
 	LISP_NUM_BUILTINS,
 
 	LISP_BUILTIN_FORWARD,	// special builtin for pointer forwarding
+	LISP_BUILTIN_BUSY,	// forwarding in progress (parallel collector)
+	LISP_BUILTIN_STRING,	// car of a heap string, see lispString
+	LISP_BUILTIN_BIGNUM,	// car of a heap bignum, see lispArith
+	LISP_BUILTIN_VECTOR,	// first word of a heap vector, see lispVector
+	LISP_BUILTIN_FLOAT,	// car of a heap float, see lispFloat
+	LISP_BUILTIN_FREE,	// released slot on the root stack
 
 	// states for lispstep()
 	LISP_STATE_APPLY,
@@ -99,27 +147,105 @@ enum {
 	LISP_STATE_SYM_LOOKUP1,
 	LISP_STATE_BUILTIN0,
 	LISP_STATE_SPECIAL_FORMS,
+	LISP_STATE_VM,	// run compiled code at expr
+	LISP_STATE_VM_RETURN,	// continue the activation pushed below the frame
+
+	// instructions of compiled code, see lispCompile.
+	LISP_OP_CONST,
+	LISP_OP_LOOKUP,
+	LISP_OP_LOCAL,
+	LISP_OP_GLOBAL,
+	LISP_OP_SETLOCAL,
+	LISP_OP_PUSH,
+	LISP_OP_BRANCH,
+	LISP_OP_CLOSURE,
+	LISP_OP_DEFINE,
+	LISP_OP_SETVAR,
+	LISP_OP_HEAD,
+	LISP_OP_CALL,
+	LISP_OP_EVAL,
+	LISP_OP_NATIVE,	// run the machine code translation, see lispJitCompile
+	LISP_OP_SEQ,	// the boundary between two forms of a body
+	LISP_OP_RET,
+
+};
+
+// a cell heap. when reserved is non-zero, the heap lives in a reservation of
+// that many references, which is committed up to cap.
+struct LispSpace {
+	LispRef *ref;
+	size_t len;
+	size_t cap;
+	size_t reserved;
+};
+
+// the type given to lispExtSet, if not NULL, points to a struct that begins
+// with a LispExtType. finalize is called by the garbage collector once the
+// extref is unreachable, so it must not touch the lisp heap. save and
+// restore are optional, for heap images: save writes a nul terminated key
+// of less than LISP_EXT_KEY bytes for obj and returns 0, restore makes the
+// object again from the key, or returns NULL. the extrefs whose objects
+// can't be saved or restored read as #error in a loaded image.
+#define LISP_EXT_KEY 64
+struct LispExtType {
+	char *name; // identifies the type in heap images, see lispAddExtType
+	void (*finalize)(LispMachine *m, void *obj);
+	int (*save)(LispMachine *m, void *obj, char *key);
+	void *(*restore)(LispMachine *m, char *key);
+};
+
+// a function in C, applied by the interpreter like a lambda. fn gets the
+// evaluated arguments as a list, see lispNative.
+struct LispNative {
+	char *name;
+	LispRef (*fn)(LispMachine *m, LispRef args);
+};
 
+// collector and allocator counters, see lispGetStats.
+struct LispStats {
+	uint64_t collections; // full collections, incremental cycles included
+	uint64_t minors; // minor collections of the generational collector
+	uint64_t pauses; // times the program was stopped for the collector
+	uint64_t pausens; // total time spent in the collector
+	uint64_t maxpausens; // longest single pause
+	uint64_t copied; // bytes copied or moved by the collector
+	uint64_t allocated; // cells allocated
+	uint64_t grows; // times the heap was grown
+	uint64_t steps; // states and instructions dispatched by lispStep
+	size_t heapbytes; // capacity of the cell heap
+	size_t extrefs; // extrefs in use
+	size_t strings; // bytes in the string table
 };
 
 struct LispMachine {
 	LispRef inst; // state of the lispstep state machine
 
-	LispRef regs[8];
-	uint32_t reguse;
-	int regCount;
-	int maxRegCount;
+	// the root stack. lispRegister hands out slots from chunks that never
+	// move, so the pointers stay valid until released.
+	struct {
+		LispRef **chunks;
+		size_t nchunks;
+		size_t len;
+	} roots;
 
 	LispRef value; // return value
 	LispRef expr; // expression being evaluated
 	LispRef envr; // current environment, a stack of a-lists
-	LispRef stack; // call stack
+	LispRef act; // activation of the compiled code running, see lispRunCode
+	// call stack, grows by doubling. call/cc copies it to the heap.
+	struct {
+		LispRef *p;
+		size_t len;
+		size_t cap;
+	} stack;
 
 	struct {
 		LispRef *ref;
 		size_t len;
 		size_t cap;
-	} stringIndex, mem, copy;
+	} stringIndex;
+
+	LispSpace mem, copy;
 
 	struct {
 		char *p;
@@ -131,11 +257,71 @@ struct LispMachine {
 		struct {
 			void *obj;
 			void *type;
+			int free;
+			size_t next; // free list link, slot index plus one
 		} *p;
+		uint32_t *marks; // slots reached by the current collection
+		size_t free; // first free slot plus one, zero if none
+		size_t count; // slots in use
+		size_t live; // slots in use after the last sweep
 		size_t len;
 		size_t cap;
 	} extrefs;
 
+	// the top-level frame, the a-list below the head cell, indexed by
+	// symbol. cell has the (sym . value) pair a lookup from the head finds.
+	// epoch counts the lets that may change what a cached lookup of a
+	// global finds.
+	struct {
+		LispRef head;
+		LispRef *sym;
+		LispRef *cell;
+		size_t len;
+		size_t cap;
+		size_t epoch;
+	} globals;
+
+	// compiled code of the lambdas applied so far, an open addressing table
+	// keyed by the lambda form. the collector moves the keys, so moved says
+	// the table has to be rehashed before the next lookup. calls counts the
+	// applications of each, for the JIT.
+	struct {
+		LispRef *lambda;
+		LispRef *code;
+		uint32_t *calls;
+		size_t len;
+		size_t cap;
+		int moved;
+	} code;
+
+	// machine code translations of hot compiled code, see lispJitCompile.
+	// mem is the executable region. refs has a block of the instructions
+	// each translation refers to, which are roots. entry has the addresses
+	// LISP_OP_NATIVE jumps to, numbered from base, since a reset drops them.
+	struct {
+		uint8_t *mem;
+		size_t len;
+		size_t cap;
+		struct {
+			LispRef *p;
+			size_t len;
+		} *refs;
+		size_t nrefs;
+		size_t refscap;
+		void (**entry)(LispMachine *m);
+		size_t nentry;
+		size_t entrycap;
+		size_t base;
+		int off;
+	} jit;
+
+	// extref types known to lispLoadImage.
+	struct {
+		LispExtType **p;
+		size_t len;
+		size_t cap;
+	} exttypes;
+
 	struct {
 		char *buf;
 		size_t len;
@@ -145,6 +331,54 @@ struct LispMachine {
 	int lineno;
 
 	int gclock;
+	int gcmode;
+	int gcthreads; // worker threads for full copying collections, serial below 2
+
+	LispStats stats;
+	struct {
+		int depth;
+		uint64_t start;
+	} pause;
+
+	// generational collector state: cells below oldlen have survived at
+	// least one collection, cells above it are the nursery. cards holds
+	// one byte per old card, dirty lists the cards that may point into
+	// the nursery.
+	struct {
+		size_t oldlen;
+		size_t size;
+		uint8_t *cards;
+		size_t ncards;
+		size_t *dirty;
+		size_t len;
+		size_t cap;
+	} nursery;
+
+	// incremental collector state: during a cycle, the cells from scan up
+	// to mem.len have been copied but not scanned, except for the ones with
+	// a bit in black. budget is the number of references scanned per slice.
+	struct {
+		int active;
+		size_t scan;
+		size_t budget;
+		uint64_t *black;
+		size_t len;
+	} incremental;
+
+	// mark-compact collector state: a mark bit per cell, and the number of
+	// marked cells below each word of marks. stack is the mark stack, of
+	// cap entries, and overflow is set when it can't grow. low is the
+	// lowest cell left unfinished then.
+	struct {
+		uint64_t *marks;
+		size_t *ranks;
+		size_t len;
+		LispRef *stack;
+		size_t sp;
+		size_t cap;
+		int overflow;
+		size_t low;
+	} compact;
 
 	struct {
 		void *context;
@@ -159,30 +393,55 @@ struct LispMachine {
 void lispInit(LispMachine *m);
 int lispSetPort(LispMachine *m, LispPort port, int (*writebyte)(int ch, void *ctx), int (*readbyte)(void *ctx), int (*unreadbyte)(int ch, void *ctx), void *ctx);
 LispRef lispParse(LispMachine *m, int justone);
+LispRef lispOptimize(LispMachine *m, LispRef expr);
 int lispIsError(LispMachine *m, LispRef a);
 void lispCall(LispMachine *m, int ret, int inst);
 int lispStep(LispMachine *m);
 void lispCollect(LispMachine *m);
+void lispSetCollector(LispMachine *m, int mode);
+int lispCollectStep(LispMachine *m, size_t budget);
+void lispGetStats(LispMachine *m, LispStats *stats);
 LispRef lispCar(LispMachine *m, LispRef base);
 LispRef lispCdr(LispMachine *m, LispRef base);
 int lispPrint1(LispMachine *m, LispRef aref, LispPort port);
 LispRef *lispRegister(LispMachine *m, LispRef val);
 void lispRelease(LispMachine *m, LispRef *reg);
+size_t lispRegisterScope(LispMachine *m);
+void lispReleaseScope(LispMachine *m, size_t scope);
 int lispIsSymbol(LispMachine *m, LispRef a);
 int lispIsNumber(LispMachine *m, LispRef a);
+int lispIsFloat(LispMachine *m, LispRef a);
+int lispIsBignum(LispMachine *m, LispRef a);
+int lispIsCons(LispMachine *m, LispRef a);
 int lispIsBuiltin(LispMachine *mach, LispRef a, int builtin);
 int lispIsExtRef(LispMachine *m, LispRef a);
 int lispIsPair(LispMachine *m, LispRef a);
+int lispIsString(LispMachine *m, LispRef a);
+int lispIsVector(LispMachine *m, LispRef a);
 int lispIsNull(LispMachine *m, LispRef a);
 LispRef lispSymbol(LispMachine *m, char *str);
+LispRef lispString(LispMachine *m, char *buf, size_t len);
+size_t lispGetString(LispMachine *m, LispRef str, char *buf, size_t cap);
+size_t lispStringLength(LispMachine *m, LispRef str);
+LispRef lispVector(LispMachine *m, size_t len, LispRef fill);
+size_t lispVectorLength(LispMachine *m, LispRef vec);
+LispRef lispVectorRef(LispMachine *m, LispRef vec, size_t i);
+int lispVectorSet(LispMachine *m, LispRef vec, size_t i, LispRef val);
 LispRef lispBuiltin(LispMachine *m, int val);
 void lispDefine(LispMachine *m, LispRef sym, LispRef val);
 
 LispRef lispExtAlloc(LispMachine *m);
+int lispAddExtType(LispMachine *m, LispExtType *type);
+int lispSaveImage(LispMachine *m, char *path);
+int lispLoadImage(LispMachine *m, char *path);
 int lispExtSet(LispMachine *m, LispRef ext, void *obj, void *type);
 int lispExtGet(LispMachine *m, LispRef ext, void **obj, void **type);
+LispRef lispNative(LispMachine *m, LispNative *native);
+LispRef lispApply(LispMachine *m, LispRef form);
 
-int lispGetInt(LispMachine *m, LispRef num);
-LispRef lispNumber(LispMachine *m, int);
+LispInt lispGetInt(LispMachine *m, LispRef num);
+LispRef lispNumber(LispMachine *m, LispInt);
+double lispGetFloat(LispMachine *m, LispRef num);
+LispRef lispFloat(LispMachine *m, double);
 
 LispRef lispCons(LispMachine *m, LispRef a, LispRef d);
@@ -0,0 +1,9 @@
+; matrix products over matrix.scm, for timing the interpreter:
+;	./basiclisp -stats stdlib.scm matrix.scm bench-matrix.scm
+(let(repeat n fn) (if(equal? n 0) '() ((lambda() (fn) (repeat (- n 1) fn)))))
+(let dim 24)
+(let mat (matrix dim dim 0))
+(set-matrix! mat (lambda(i j) (+ j (* dim i))))
+(let prod '())
+(repeat 10 (lambda() (set! prod (multiply (transpose mat) mat))))
+(print 1 (car prod) "\n")
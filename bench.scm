@@ -0,0 +1,11 @@
+; fib and sort loops over stdlib.scm, for timing the interpreter:
+;	./basiclisp -stats stdlib.scm bench.scm
+; make bench runs it with both dispatch modes of lispStep.
+(let(repeat n fn) (if(equal? n 0) '() ((lambda() (fn) (repeat (- n 1) fn)))))
+(let(mod a b) (- a (* b (/ a b))))
+(let(rlist n seed) (if(equal? n 0) '() (cons (mod seed 1000) (rlist (- n 1) (mod (+ (* seed 1103) 12345) 65536)))))
+(let data (rlist 500 7))
+(repeat 200 (lambda() (fib 40)))
+(repeat 20 (lambda() (sort less? data)))
+(print 1 (fib 10) "\n")
+(print 1 (sort less? (rlist 20 7)) "\n")
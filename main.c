@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <math.h>
+#include <time.h>
 #include <assert.h>
 #include "basiclisp.h"
 //#include "linenoise/linenoise.h"
@@ -22,6 +23,7 @@ typedef struct Type Type;
 typedef struct Vector Vector;
 
 struct Type {
+	LispExtType ext;
 	LispApplier *apply;
 	LispSetter *set;
 	LispGetter *get;
@@ -42,9 +44,12 @@ struct Context {
 
 	LispRef vectorSymbol;
 	Type vectorType;
+
+	int optimize; // run lispOptimize on the forms before evaluating them
 };
 
 struct Vector {
+	int refs; // the extref and the parent nodes
 	unsigned op;
 	Vector *cond;
 	Vector *left;
@@ -53,6 +58,56 @@ struct Vector {
 	size_t cap;
 };
 
+static Vector *
+vectorRetain(Vector *vec)
+{
+	if(vec != NULL)
+		vec->refs++;
+	return vec;
+}
+
+static void
+vectorRelease(Vector *vec)
+{
+	if(vec == NULL || --vec->refs > 0)
+		return;
+	vectorRelease(vec->cond);
+	vectorRelease(vec->left);
+	vectorRelease(vec->right);
+	free(vec);
+}
+
+static void
+vectorFinalize(LispMachine *m, void *obj)
+{
+	vectorRelease((Vector *)obj);
+}
+
+// heap images keep the vectors made by (vector), not the expressions.
+static int
+vectorSave(LispMachine *m, void *obj, char *key)
+{
+	Vector *vec = obj;
+	if(vec->cond != NULL || vec->left != NULL || vec->right != NULL)
+		return -1;
+	snprintf(key, LISP_EXT_KEY, "%u %zu %zu", vec->op, vec->len, vec->cap);
+	return 0;
+}
+
+static void *
+vectorRestore(LispMachine *m, char *key)
+{
+	Vector *vec = calloc(1, sizeof vec[0]);
+	if(vec == NULL)
+		return NULL;
+	if(sscanf(key, "%u %zu %zu", &vec->op, &vec->len, &vec->cap) != 3){
+		free(vec);
+		return NULL;
+	}
+	vec->refs = 1;
+	return vec;
+}
+
 static LispRef
 vectorGet(void *ctx, void *obj, LispRef lispkey)
 {
@@ -116,8 +171,9 @@ vectorBinaryOp(void *ctx, char op, LispRef left, LispRef right)
 
 		Vector *expr = malloc(sizeof expr[0]);
 		memset(expr, 0, sizeof expr[0]);
-		expr->left = leftVector;
-		expr->right = rightVector;
+		expr->refs = 1;
+		expr->left = vectorRetain(leftVector);
+		expr->right = vectorRetain(rightVector);
 		expr->op = op;
 
 		LispRef vectorRef = lispExtAlloc(&c->m);
@@ -201,9 +257,10 @@ vectorCond(void *ctx, LispRef cond, LispRef left, LispRef right)
 		// allocate and initialize node for the condition
 		Vector *expr = malloc(sizeof expr[0]);
 		memset(expr, 0, sizeof expr[0]);
-		expr->cond = condVector;
-		expr->left = leftVector;
-		expr->right = rightVector;
+		expr->refs = 1;
+		expr->cond = vectorRetain(condVector);
+		expr->left = vectorRetain(leftVector);
+		expr->right = vectorRetain(rightVector);
 		expr->op = '?';
 
 		LispRef vectorRef = lispExtAlloc(m);
@@ -264,6 +321,7 @@ vectorNew(void *ctx, void *obj, LispRef args)
 		if(expr == NULL)
 			return lispBuiltin(&c->m, LISP_BUILTIN_ERROR);
 		memset(expr, 0, sizeof expr[0]);
+		expr->refs = 1;
 		LispRef extref = lispExtAlloc(&c->m);
 		expr->op = idChars[id++];
 		lispExtSet(&c->m, extref, (void*)expr, &c->vectorType);
@@ -428,7 +486,7 @@ lispEvaluate(Context *context)
 				fprintf(stderr, "builtin-mul fail\n");
 			}
 		} else {
-			fprintf(stderr, "extcall: not sure what's going on: %x\n", first);
+			fprintf(stderr, "extcall: not sure what's going on: %llx\n", (unsigned long long)first);
 			for(LispRef np = m->expr; np != LISP_NIL; np = lispCdr(m, np)){
 				printf(" ");
 				lispPrint1(m, lispCar(m, np), 1);
@@ -439,16 +497,118 @@ lispEvaluate(Context *context)
 	m->expr = LISP_NIL;
 	//m->value = LISP_NIL;
 }
+static struct {
+	char *name;
+	int mode;
+} collectors[] = {
+	{ "copying", LISP_GC_COPYING },
+	{ "generational", LISP_GC_GENERATIONAL },
+	{ "incremental", LISP_GC_INCREMENTAL },
+	{ "compact", LISP_GC_COMPACT },
+};
+
+// the time stamp counter, for the cycles per step printed by -stats.
+static uint64_t
+cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+#if LISP_AOT
+// the modules compiled in with aot: lispAotInit defines their natives, and
+// the rest of them is evaluated from lispAotSource.
+void lispAotInit(LispMachine *m);
+extern char lispAotSource[];
+
+static int
+sourceGetc(void *ctx)
+{
+	char **p = ctx;
+	if(**p == '\0')
+		return EOF;
+	return (unsigned char)*(*p)++;
+}
+
+static int
+sourceUngetc(int ch, void *ctx)
+{
+	char **p = ctx;
+	if(ch != EOF)
+		(*p)--;
+	return ch;
+}
+#endif
+
+// evaluate what port 0 reads.
+static void
+evaluateAll(Context *c)
+{
+	for(;;){
+		c->m.expr = lispParse(&c->m, 1);
+		if(lispIsError(&c->m, c->m.expr))
+			break;
+		if(c->optimize)
+			c->m.expr = lispOptimize(&c->m, c->m.expr);
+		lispEvaluate(c);
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
 	Context c;
+	int gcmode = LISP_GC_COPYING;
+	int gcthreads = 1;
+	char *load = NULL;
+	char *save = NULL;
+	int stats = 0;
+	int optimize = 0;
+	size_t i;
+
+	// options come before the files to load.
+	for(i = 1; i < (size_t)argc && argv[i][0] == '-'; i++){
+		if(!strcmp(argv[i], "-gc") && i+1 < (size_t)argc){
+			size_t j;
+			i++;
+			for(j = 0; j < sizeof collectors / sizeof collectors[0]; j++)
+				if(!strcmp(argv[i], collectors[j].name))
+					break;
+			if(j == sizeof collectors / sizeof collectors[0]){
+				fprintf(stderr, "unknown collector %s\n", argv[i]);
+				return 1;
+			}
+			gcmode = collectors[j].mode;
+		} else if(!strcmp(argv[i], "-threads") && i+1 < (size_t)argc){
+			gcthreads = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-load") && i+1 < (size_t)argc){
+			load = argv[++i];
+		} else if(!strcmp(argv[i], "-save") && i+1 < (size_t)argc){
+			save = argv[++i];
+		} else if(!strcmp(argv[i], "-stats")){
+			stats = 1;
+		} else if(!strcmp(argv[i], "-O")){
+			optimize = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-gc collector] [-threads n] [-load image] [-save image] [-stats] [-O] files...\n", argv[0]);
+			return 1;
+		}
+	}
 
 	memset(&c, 0, sizeof c);
-	lispInit(&c.m);
+	c.optimize = optimize;
+	lispSetCollector(&c.m, gcmode);
+	c.m.gcthreads = gcthreads;
 	lispSetPort(&c.m, 0, (int(*)(int,void*))NULL, (int(*)(void*))getc, (int(*)(int,void*))ungetc, (void*)stdin);
 	lispSetPort(&c.m, 1, (int(*)(int,void*))putc, (int(*)(void*))NULL, (int(*)(int,void*))NULL, (void*)stdout);
 
+	c.vectorType.ext.name = "vector";
+	c.vectorType.ext.finalize = vectorFinalize;
+	c.vectorType.ext.save = vectorSave;
+	c.vectorType.ext.restore = vectorRestore;
 	c.vectorType.apply = vectorNew;
 
 	c.vectorType.get = vectorGet;
@@ -460,27 +620,56 @@ main(int argc, char *argv[])
 	c.vectorType.less = vectorLess;
 	c.vectorType.print = vectorPrint;
 	c.vectorType.cond = vectorCond;
-	c.vectorSymbol = lispSymbol(&c.m, "vector");
-	LispRef vectorTypeRef = lispExtAlloc(&c.m);
-	lispExtSet(&c.m, vectorTypeRef, NULL, &c.vectorType);
-	lispDefine(&c.m, c.vectorSymbol, vectorTypeRef);
+	lispAddExtType(&c.m, &c.vectorType.ext);
 
+	// an image already has vector defined, and the compiled modules, but
+	// not their natives.
+	if(load != NULL){
+		if(lispLoadImage(&c.m, load) == -1)
+			return 1;
+		c.vectorSymbol = lispSymbol(&c.m, "vector");
+#if LISP_AOT
+		lispAotInit(&c.m);
+#endif
+	} else {
+		lispInit(&c.m);
+		c.vectorSymbol = lispSymbol(&c.m, "vector");
+		LispRef vectorTypeRef = lispExtAlloc(&c.m);
+		lispExtSet(&c.m, vectorTypeRef, NULL, &c.vectorType);
+		lispDefine(&c.m, c.vectorSymbol, vectorTypeRef);
+#if LISP_AOT
+		char *src = lispAotSource;
+		lispAotInit(&c.m);
+		lispSetPort(&c.m, 0, (int(*)(int,void*))NULL, sourceGetc, sourceUngetc, &src);
+		evaluateAll(&c);
+#endif
+	}
 
-	for(size_t i = 1; i < (size_t)argc; i++){
+
+	clock_t t0 = clock();
+	uint64_t c0 = cycles();
+	for(; i < (size_t)argc; i++){
 		FILE *fp = fopen(argv[i], "rb");
 		if(fp == NULL){
 			fprintf(stderr, "cannot open %s\n", argv[i]);
 			return 1;
 		}
 		lispSetPort(&c.m, 0, (int(*)(int,void*))NULL, (int(*)(void*))getc, (int(*)(int,void*))ungetc, (void*)fp);
-		for(;;){
-			c.m.expr = lispParse(&c.m, 1);
-			if(lispIsError(&c.m, c.m.expr))
-				break;
-			lispEvaluate(&c);
-		}
+		evaluateAll(&c);
 
 		fclose(fp);
 	}
+	if(stats){
+		LispStats st;
+		double ns = (double)(clock() - t0) * 1e9 / CLOCKS_PER_SEC;
+		uint64_t cyc = cycles() - c0;
+		lispGetStats(&c.m, &st);
+		fprintf(stderr, "steps %llu, %.0f ms, %.2f ns/step", (unsigned long long)st.steps, ns / 1e6, st.steps ? ns / st.steps : 0.0);
+		if(cyc != 0)
+			fprintf(stderr, ", %.2f cycles/step", st.steps ? (double)cyc / st.steps : 0.0);
+		fprintf(stderr, ", %llu collections, %.0f ms paused\n", (unsigned long long)st.collections, st.pausens / 1e6);
+	}
+	if(save != NULL && lispSaveImage(&c.m, save) == -1)
+		return 1;
 	return 0;
 }
@@ -137,9 +137,6 @@
 	(lambda(method)
 		(if(equal? method 'val) val
 			'())))
-(let(make-vector len)
-	(if(less? len 2) 0
-		(cons (make-vector (/ len 2)) (make-vector (/ len 2)))))
 (let(iabs x) (if(less? x 0) (- x) x))
 (let (frandom)
 	(let(conv i f)
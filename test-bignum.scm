@@ -0,0 +1,24 @@
+; integers go on past a fixnum as bignums, both ways, and come back.
+(let(neg x) (- 0 x))
+(let(up x n) (if (equal? n 0) x (up (+ x x) (- n 1))))
+(let big (fact 25))
+(print 1 big (neg big) (+ big 1) (- big 1) "\n")
+(print 1 (up 1 70) (up (neg 1) 70) (* (up 1 40) (up (neg 1) 40)) "\n")
+(print 1 2147483647 (+ 2147483647 1) (- (neg 2147483647) 2) (* 65536 65536) "\n")
+(print 1 4611686018427387903 (+ 4611686018427387903 1) (neg 4611686018427387905) "\n")
+; and shrink back to fixnums.
+(print 1 (- big big) (+ (up 1 70) (up (neg 1) 70)) (/ big (fact 24)) (* big 0) "\n")
+(print 1 (equal? (- (up 1 70) (up 1 69)) (up 1 69)) (equal? (/ (up 1 70) (up 1 69)) 2) "\n")
+; comparisons across fixnums and bignums of either sign.
+(print 1 (less? 1 big) (less? big 1) (less? (neg big) 1) (less? 1 (neg big)) "\n")
+(print 1 (less? (up 1 70) (up 1 71)) (less? (up 1 71) (up 1 70)) (less? (up (neg 1) 71) (up (neg 1) 70)) "\n")
+(print 1 (equal? big (fact 25)) (equal? big (+ big 1)) (equal? (neg big) (- 0 (fact 25))) "\n")
+; and so are bignum literals.
+(print 1 (car '(123456789012345678901234567890)) (pair? (car '(123456789012345678901234567890))) (equal? (car '(4611686018427387904)) (+ 4611686018427387903 1)) "\n")
+; no arguments: the identities, and nothing to negate or divide.
+(print 1 (+) (*) (+ (+) 2) (* (*) 3) (-) (/) "\n")
+; signed literals, and fixnums on both sides of zero up to the bignums.
+(print 1 -5 +5 -0x10 - + '(-1 +2) (- -5) (/ -20 3) (less? -1 0) "\n")
+(print 1 -536870912 -536870913 (- -536870912) (- 0 -536870912 1) (+ -536870912 -1) "\n")
+(print 1 -2305843009213693952 -2305843009213693953 (- -2305843009213693952) "\n")
+(print 1 -123456789012345678901234567890 (equal? -123456789012345678901234567890 (- 0 123456789012345678901234567890)) "\n")
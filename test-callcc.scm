@@ -0,0 +1,24 @@
+; a continuation taken in the middle of a form comes back there with the
+; work that was pending, however often it is resumed.
+(let kk 0)
+(let(cc n) (if(equal? n 0) (call/cc (lambda(k) (set! kk k) 0)) (+ 1 (cc (- n 1)))))
+(let r (cc 3))
+(print 1 "cc:" r "\n")
+(kk 1)
+(print 1 "cc:" r "\n")
+(kk 2)
+(print 1 "cc:" r "\n")
+
+; between the forms of a body, it goes on where the body last left off,
+; like in the interpreter: this body is done, so it returns right away.
+(let k2 0)
+(let steps '())
+(let(body)
+	(set! steps (cons 'a steps))
+	(call/cc (lambda(k) (set! k2 k) 1))
+	(set! steps (cons 'b steps))
+	(+ 1 (call/cc (lambda(k) (k 6)))))
+(let r (body))
+(print 1 "body:" r steps "\n")
+(k2 2)
+(print 1 "body:" r steps "\n")
@@ -0,0 +1,10 @@
+(let a (vector))
+(let b (vector))
+(print 1 "external:" (+ a (* a b)) "\n")
+(let(churn n)
+	(if (equal? n 0)
+		(+ b (* a b))
+		((lambda()
+			(+ a (* b (+ a b)))
+			(churn (- n 1))))))
+(print 1 "churn:" (churn 5000) "\n")
@@ -0,0 +1,23 @@
+; floats are exact doubles, whatever the width of a reference.
+(print 1 (+ 1000000.0 1.0) "\n")
+(print 1 (equal? (+ 0.1 0.2) 0.3) (+ 0.1 0.2) "\n")
+(print 1 (equal? (- 0.3 0.2) 0.1) (- 0.3 0.2) "\n")
+(print 1 0.1 1.5 123456.789 (/ 1.0 3.0) (- 0.0 2.5) "\n")
+(print 1 (* 1.0 9007199254740993) (* 1.0 9007199254740992) "\n")
+(print 1 (+ 0.5 1) (* 0.1 3) (less? 0.30000000000000004 (* 0.1 3)) "\n")
+(print 1 (/ 1.0 0.0) (- 0.0 (/ 1.0 0.0)) "\n")
+; floats are numbers, not pairs.
+(print 1 (pair? 0.1) (equal? 0.1 0.1) (equal? 0.1 '(0.1)) "\n")
+(let(inc x) (+ x 0.1))
+(print 1 (inc 1) (inc (inc 0.1)) "\n")
+; whole numbers print without an exponent while they have few digits.
+(print 1 100.0 1e16 123e10 1e17 (- 0.0 1e5) 1e-5 "\n")
+; what prints reads back as the same float.
+(print 1 (equal? (+ 0.1 0.2) 0.30000000000000004) (equal? (/ 1.0 3.0) 0.3333333333333333) (equal? (- 0.3 0.2) 0.09999999999999998) "\n")
+(print 1 (equal? (* 1e300 10.0) 1e+301) (equal? (/ 1.0 1e300) 1e-300) (equal? (* 1.0 9007199254740991) 9007199254740991.0) "\n")
+; float literals are themselves in quoted data too.
+(print 1 (car '(0.1)) (pair? (car '(0.1))) (equal? (car '(0.1)) 0.1) (less? (car '(0.25 1)) 0.5) "\n")
+; what only starts like a number is a symbol.
+(print 1 '(1.5x3 1e5x 1e 1e+ 1.2.3 1x2 0x 09) (less? 1 '1e) (+ 1 '1e) "\n")
+; and signed ones.
+(print 1 -2.5 +2.5 -1e3 (- -2.5) (+ -2.5 2) "\n")
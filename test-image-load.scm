@@ -0,0 +1,5 @@
+; the values test-image.scm left in the image.
+(print 1 big f s v "\n")
+(print 1 (equal? (car l) big) (equal? (car (cdr l)) f) (equal? (car (cdr (cdr (cdr l)))) v) (equal? f 0.30000000000000004) (string-length s) "\n")
+(print 1 (add 1) (add f) "\n")
+(print 1 a (* a a) e "\n")
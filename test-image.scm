@@ -0,0 +1,9 @@
+; saved to an image by make test, which test-image-load.scm is run on.
+(let big (fact 25))
+(let f (+ 0.1 0.2))
+(let s "hello, world")
+(let v (make-vector 3 big))
+(let l (list big f s v))
+(let(add x) (+ x big))
+(let a (vector))
+(let e (+ a a))
@@ -0,0 +1,12 @@
+; the pair builtins give #error for the heap objects that are pairs only
+; to the collector, instead of their headers.
+(let big (fact 25))
+(let f 0.1)
+(let v (make-vector 2 0))
+(print 1 (car big) (cdr big) (car f) (cdr f) (car v) (cdr v) "\n")
+(print 1 (set-car! big 1) (set-cdr! big 1) (set-car! f 1) (set-cdr! v 1) "\n")
+(print 1 big f v "\n")
+(print 1 (pair? big) (pair? f) (pair? v) (pair? '(1)) "\n")
+(let(first x) (car x))
+(print 1 (first big) (first '(1 2)) "\n")
+(print 1 (car '()) (cdr 5) "\n")
@@ -0,0 +1,9 @@
+; string-length counts bytes, string-ref gives the byte as a number.
+(let s "hello, world")
+(print 1 (string-length s) (string-length "") (string-length "abc") "\n")
+(print 1 (string-ref s 0) (string-ref s 7) (string-ref s 11) "\n")
+(print 1 (string-ref s 12) (string-ref s (- 0 1)) (string-ref 5 0) (string-length 5) "\n")
+(print 1 (string-length "café") (string-ref "é" 0) (string-ref "é" 1) "\n")
+(print 1 s (equal? s "hello, world") (equal? s "hello, worle") "\n")
+; and strings in quoted data.
+(print 1 (car '("abc" 1)) (pair? (car '("abc"))) (string-length (car '("abc"))) "\n")
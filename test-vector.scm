@@ -0,0 +1,7 @@
+; vector-ref gives #error outside the vector.
+(let v (make-vector 3 7))
+(vector-set! v 2 9)
+(print 1 (vector-ref v 0) (vector-ref v 2) (2 v) (vector-length v) "\n")
+(print 1 (vector-ref v 3) (vector-ref v (- 0 1)) (vector-ref 5 0) (vector-ref v 'a) "\n")
+(print 1 (vector-set! v 3 1) v "\n")
+(print 1 (vector-ref (make-vector 0 0) 0) "\n")